@@ -0,0 +1,448 @@
+/*
+ * Microbenchmarks for the hot paths of the moon toolkit.
+ *
+ * This module only contains the C side of the benchmarks: Every
+ * `bench.xxx( n, ... )` function runs an operation `n` times in a
+ * tight C loop and returns the elapsed CPU time in seconds. The
+ * benchmarks that need Lua code (metamethod dispatch, flag
+ * operations, array kernels) use the objects created by the
+ * constructors in this module. See `bench.lua` for the driver.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "moon.h"
+
+
+/* flag types without cache, with cache, and unboxed (Lua 5.3+) */
+#define MOON_FLAG_NAME "BenchF"
+#define MOON_FLAG_TYPE unsigned
+#define MOON_FLAG_SUFFIX BenchF
+#include "moon_flag.h"
+
+#define MOON_FLAG_NAME "BenchFC"
+#define MOON_FLAG_TYPE unsigned
+#define MOON_FLAG_SUFFIX BenchFC
+#define MOON_FLAG_USECACHE
+#include "moon_flag.h"
+
+#define MOON_FLAG_NAME "BenchFU"
+#define MOON_FLAG_TYPE unsigned
+#define MOON_FLAG_SUFFIX BenchFU
+#define MOON_FLAG_UNBOXED
+#include "moon_flag.h"
+
+
+typedef struct {
+  int x;
+  int y;
+} Bench;
+
+typedef struct {
+  double d;
+  Bench b;
+} BenchC;
+
+typedef struct {
+  double v;
+  int k;
+  float f;
+} BenchR;
+
+
+static int bench_valid = 1;
+static unsigned bench_epoch = 0;
+static void* volatile bench_sink = NULL;
+
+
+static int bench_isvalid( void* p ) {
+  return *(int*)p;
+}
+
+static void bench_destructor( void* p ) {
+  bench_sink = p;
+}
+
+static void* BenchC_to_Bench( void* p ) {
+  return &((BenchC*)p)->b;
+}
+
+
+static double bench_elapsed( clock_t t0 ) {
+  return (double)(clock() - t0) / CLOCKS_PER_SEC;
+}
+
+
+static int bench_n( lua_State* L ) {
+  return (int)moon_checkint( L, 1, 1, INT_MAX );
+}
+
+
+static int bench_newobject( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  moon_object_destructor d = lua_toboolean( L, 2 ) ? bench_destructor : 0;
+  clock_t t0 = clock();
+  for( i = 0; i < n; ++i ) {
+    bench_sink = moon_newobject( L, "Bench", d );
+    lua_pop( L, 1 );
+  }
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  return 1;
+}
+
+
+static int bench_newpointer( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  clock_t t0 = clock();
+  for( i = 0; i < n; ++i ) {
+    *moon_newpointer( L, "Bench", 0 ) = &bench_valid;
+    lua_pop( L, 1 );
+  }
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  return 1;
+}
+
+
+static int bench_newfield( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  Bench* b = moon_checkobject( L, 2, "Bench" );
+  clock_t t0 = clock();
+  for( i = 0; i < n; ++i ) {
+    *moon_newfield( L, "Bench", 2, bench_isvalid, &bench_valid ) = b;
+    lua_pop( L, 1 );
+  }
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  return 1;
+}
+
+
+/* baseline: a plain userdata checked via luaL_checkudata */
+static int bench_checkudata( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  clock_t t0 = clock();
+  for( i = 0; i < n; ++i )
+    bench_sink = luaL_checkudata( L, 2, "BenchPlain" );
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  return 1;
+}
+
+
+static int bench_checkobject( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  char const* tname = luaL_checkstring( L, 3 );
+  clock_t t0 = clock();
+  for( i = 0; i < n; ++i )
+    bench_sink = moon_checkobject( L, 2, tname );
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  return 1;
+}
+
+
+static int bench_checkobject_t( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  moon_object_type* t = moon_gettype( L, luaL_checkstring( L, 3 ) );
+  clock_t t0 = clock();
+  for( i = 0; i < n; ++i )
+    bench_sink = moon_checkobject_t( L, 2, t );
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  return 1;
+}
+
+
+static int bench_checkobject_ic( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  char const* tname = luaL_checkstring( L, 3 );
+  moon_object_cache cache = { 0 };
+  clock_t t0 = clock();
+  for( i = 0; i < n; ++i )
+    bench_sink = moon_checkobject_ic( L, 2, tname, &cache );
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  return 1;
+}
+
+
+/* time for collecting `n` unreachable objects (with or without
+ * destructor) */
+static int bench_gc( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  moon_object_destructor d = lua_toboolean( L, 2 ) ? bench_destructor : 0;
+  clock_t t0;
+  lua_gc( L, LUA_GCCOLLECT, 0 );
+  lua_gc( L, LUA_GCSTOP, 0 );
+  for( i = 0; i < n; ++i ) {
+    moon_newobject( L, "Bench", d );
+    lua_pop( L, 1 );
+  }
+  t0 = clock();
+  lua_gc( L, LUA_GCCOLLECT, 0 );
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  lua_gc( L, LUA_GCRESTART, 0 );
+  return 1;
+}
+
+
+/* constructors for the objects used in the benchmarks */
+static int bench_new( lua_State* L ) {
+  char const* tname = luaL_checkstring( L, 1 );
+  if( 0 == strcmp( tname, "BenchPlain" ) ) {
+    lua_newuserdata( L, sizeof( Bench ) );
+    luaL_getmetatable( L, "BenchPlain" );
+    lua_setmetatable( L, -2 );
+  } else if( 0 == strcmp( tname, "BenchC" ) )
+    moon_newobject( L, tname, 0 );
+  else {
+    Bench* b = moon_newobject( L, tname, 0 );
+    b->x = 1;
+    b->y = 2;
+  }
+  return 1;
+}
+
+
+/* creates a field object with a chain of `d` validity checks (or
+ * `d` levels of nested objects using generation counters) */
+static int bench_chain( lua_State* L ) {
+  int i = 0, d = (int)moon_checkint( L, 1, 1, 64 );
+  int epoch = lua_toboolean( L, 2 );
+  Bench* b = moon_newobject( L, "Bench", 0 );
+  for( i = 0; i < d; ++i ) {
+    if( epoch )
+      *moon_newfield_epoch( L, "Bench", -1, &bench_epoch ) = b;
+    else
+      *moon_newfield( L, "Bench", lua_gettop( L ), bench_isvalid,
+                      &bench_valid ) = b;
+    lua_replace( L, -2 );
+  }
+  return 1;
+}
+
+
+static int bench_flag( lua_State* L ) {
+  static char const* const modes[] = { "plain", "cache", "unboxed", NULL };
+  unsigned v = (unsigned)moon_checkint( L, 1, 0, 0xFFFF );
+  switch( luaL_checkoption( L, 2, "plain", modes ) ) {
+    case 1:
+      moon_flag_new_BenchFC( L, v ); break;
+    case 2:
+      moon_flag_new_BenchFU( L, v ); break;
+    default:
+      moon_flag_new_BenchF( L, v ); break;
+  }
+  return 1;
+}
+
+
+/* array of `n` BenchR records for the array kernels */
+static int bench_array( lua_State* L ) {
+  int i = 0, n = bench_n( L );
+  BenchR* r = moon_newarray( L, "BenchArray", (size_t)n, NULL, 0 );
+  for( i = 0; i < n; ++i ) {
+    r[ i ].v = (double)(i % 1000) * 0.5;
+    r[ i ].k = i;
+    r[ i ].f = (float)r[ i ].v;
+  }
+  return 1;
+}
+
+
+/* time for creating `n` Lua states that define the Bench types
+ * (either via moon_defobject/moon_defcast or via a type set) */
+static int Bench_get( lua_State* L );
+static int Bench_prop( lua_State* L );
+
+static luaL_Reg const bench_state_methods[] = {
+  { "get", Bench_get },
+  { ".prop", Bench_prop },
+  { NULL, NULL }
+};
+
+static moon_object_def const bench_state_types[] = {
+  { "Bench", sizeof( Bench ), bench_state_methods, NULL },
+  { "BenchC", sizeof( BenchC ), NULL, NULL },
+  { "BenchR", sizeof( BenchR ), NULL, NULL },
+  { NULL, 0, NULL, NULL }
+};
+
+static moon_object_castdef const bench_state_casts[] = {
+  { "BenchC", "Bench", BenchC_to_Bench },
+  { NULL, NULL, 0 }
+};
+
+/* a larger type set: a chain of BENCH_NCHAIN types where every type
+ * can be cast to its predecessor (and thus to all types before it) */
+#define BENCH_NCHAIN 64
+
+static moon_object_def bench_chain_types[ BENCH_NCHAIN+1 ];
+static moon_object_castdef bench_chain_casts[ BENCH_NCHAIN ];
+static char bench_chain_names[ BENCH_NCHAIN ][ 16 ];
+
+static void* bench_chain_cast( void* p ) {
+  return p;
+}
+
+static void bench_chain_init( void ) {
+  int i = 0;
+  if( bench_chain_types[ 0 ].tname != NULL )
+    return;
+  for( i = 0; i < BENCH_NCHAIN; ++i ) {
+    sprintf( bench_chain_names[ i ], "BenchT%d", i );
+    bench_chain_types[ i ].tname = bench_chain_names[ i ];
+    bench_chain_types[ i ].size = sizeof( Bench );
+    if( i > 0 ) {
+      bench_chain_casts[ i-1 ].tname1 = bench_chain_names[ i ];
+      bench_chain_casts[ i-1 ].tname2 = bench_chain_names[ i-1 ];
+      bench_chain_casts[ i-1 ].cast = bench_chain_cast;
+    }
+  }
+}
+
+static int bench_newstate( lua_State* L ) {
+  static char const* const modes[] = {
+    "defobject", "defobjects", "typeset", NULL
+  };
+  int i = 0, n = bench_n( L );
+  int mode = luaL_checkoption( L, 2, "defobject", modes );
+  moon_object_def const* types = bench_state_types;
+  moon_object_castdef const* casts = bench_state_casts;
+  moon_object_typeset* set = NULL;
+  clock_t t0;
+  if( lua_toboolean( L, 3 ) ) {
+    bench_chain_init();
+    types = bench_chain_types;
+    casts = bench_chain_casts;
+  }
+  if( mode == 2 )
+    set = moon_newtypeset( L, types, casts );
+  t0 = clock();
+  for( i = 0; i < n; ++i ) {
+    lua_State* L2 = luaL_newstate();
+    if( L2 == NULL )
+      break;
+    if( set != NULL )
+      moon_deftypes( L2, set );
+    else if( mode == 1 )
+      moon_defobjects( L2, types, casts );
+    else {
+      moon_object_def const* d = types;
+      moon_object_castdef const* c = casts;
+      for( ; d->tname != NULL; ++d )
+        moon_defobject( L2, d->tname, d->size, d->methods, 0 );
+      for( ; c->tname1 != NULL; ++c )
+        moon_defcast( L2, c->tname1, c->tname2, c->cast );
+    }
+    lua_close( L2 );
+  }
+  lua_pushnumber( L, bench_elapsed( t0 ) );
+  moon_freetypeset( set );
+  return 1;
+}
+
+
+static int Bench_get( lua_State* L ) {
+  Bench* b = moon_checkobject( L, 1, "Bench" );
+  lua_pushinteger( L, b->x );
+  return 1;
+}
+
+
+static int Bench_prop( lua_State* L ) {
+  Bench* b = moon_checkobject( L, 1, "Bench" );
+  if( lua_gettop( L ) >= 3 ) {
+    b->y = (int)moon_checkint( L, 3, INT_MIN, INT_MAX );
+    return 0;
+  }
+  lua_pushinteger( L, b->y );
+  return 1;
+}
+
+
+static int Bench_index( lua_State* L ) {
+  moon_checkobject( L, 1, "Bench" );
+  lua_pushnil( L );
+  return 1;
+}
+
+
+static int Bench_newindex( lua_State* L ) {
+  Bench* b = moon_checkobject( L, 1, "Bench" );
+  b->y = (int)lua_tointeger( L, 3 );
+  return 0;
+}
+
+
+int luaopen_bench( lua_State* L ) {
+  luaL_Reg const bench_funcs[] = {
+    { "newobject", bench_newobject },
+    { "newpointer", bench_newpointer },
+    { "newfield", bench_newfield },
+    { "checkudata", bench_checkudata },
+    { "checkobject", bench_checkobject },
+    { "checkobject_t", bench_checkobject_t },
+    { "checkobject_ic", bench_checkobject_ic },
+    { "gc", bench_gc },
+    { "new", bench_new },
+    { "chain", bench_chain },
+    { "flag", bench_flag },
+    { "array", bench_array },
+    { "newstate", bench_newstate },
+    { NULL, NULL }
+  };
+  luaL_Reg const Bench_methods[] = {
+    { "get", Bench_get },
+    { ".prop", Bench_prop },
+    { "__index", Bench_index },
+    { "__newindex", Bench_newindex },
+    { NULL, NULL }
+  };
+  moon_object_field const Bench_fields[] = {
+    { "x", MOON_FIELD_INT, offsetof( Bench, x ), 0, 0, NULL, 0 },
+    { NULL, 0, 0, 0, 0, NULL, 0 }
+  };
+  moon_object_field const BenchC_fields[] = {
+    { "b", MOON_FIELD_OBJECT, offsetof( BenchC, b ), 0, 0, "Bench", 0 },
+    { NULL, 0, 0, 0, 0, NULL, 0 }
+  };
+  moon_object_field const BenchR_fields[] = {
+    { "v", MOON_FIELD_DOUBLE, offsetof( BenchR, v ), 0, 0, NULL, 0 },
+    { "k", MOON_FIELD_INT, offsetof( BenchR, k ), 0, 0, NULL, 0 },
+    { "f", MOON_FIELD_FLOAT, offsetof( BenchR, f ), 0, 0, NULL, 0 },
+    { NULL, 0, 0, 0, 0, NULL, 0 }
+  };
+  luaL_newmetatable( L, "BenchPlain" );
+  lua_pop( L, 1 );
+  moon_defobject( L, "Bench", sizeof( Bench ), Bench_methods, 0 );
+  moon_deffields( L, "Bench", Bench_fields );
+  moon_defobject( L, "BenchC", sizeof( BenchC ), NULL, 0 );
+  moon_defcast( L, "BenchC", "Bench", BenchC_to_Bench );
+  moon_deffields( L, "BenchC", BenchC_fields );
+  lua_pushcfunction( L, moon_derive );
+  lua_pushliteral( L, "BenchD" );
+  lua_pushliteral( L, "Bench" );
+  lua_call( L, 2, 0 );
+  /* same as BenchD, but with a compiled __index dispatcher */
+  lua_pushcfunction( L, moon_derive );
+  lua_pushliteral( L, "BenchFast" );
+  lua_pushliteral( L, "Bench" );
+  lua_call( L, 2, 0 );
+  moon_compileindex( L, "BenchFast" );
+  moon_defobject( L, "BenchR", sizeof( BenchR ), NULL, 0 );
+  moon_deffields( L, "BenchR", BenchR_fields );
+  moon_defarray( L, "BenchArray", "BenchR" );
+  moon_flag_def_BenchF( L );
+  moon_flag_def_BenchFC( L );
+  moon_flag_def_BenchFU( L );
+  (void)moon_flag_get_BenchF;
+  (void)moon_flag_get_BenchFC;
+  (void)moon_flag_get_BenchFU;
+#if LUA_VERSION_NUM < 502
+  luaL_register( L, "bench", bench_funcs );
+#else
+  luaL_newlib( L, bench_funcs );
+#endif
+  return 1;
+}
+
@@ -0,0 +1,286 @@
+#!/usr/bin/lua
+
+-- Microbenchmarks for the hot paths of the moon toolkit.
+--
+-- Usage: lua bench.lua [iterations]
+--
+-- Prints one tab-separated line per benchmark:
+--
+--     <Lua version> <benchmark> <ns/op> <iterations>
+--
+-- so that results for different Lua versions (or different revisions
+-- of moon) can be compared using standard text tools. Lines starting
+-- with `#` are comments.
+
+package.cpath = "./?.so;../?.so;.\\?.dll;..\\?.dll"
+package.path = "" -- so that require( "bench" ) doesn't load this script
+require( "sofix" )
+
+local bench = require( "bench" )
+
+local N = tonumber( arg and arg[ 1 ] ) or 1000000
+local VERSION = type( jit ) == "table" and jit.version or _VERSION
+local clock = os.clock
+
+
+local function report( name, secs, n )
+  if secs < 0 then secs = 0 end
+  io.write( VERSION, "\t", name, "\t",
+            ("%.2f"):format( secs * 1e9 / n ), "\t", n, "\n" )
+end
+
+
+-- benchmarks that run in a C loop
+local function c( name, n, f, ... )
+  collectgarbage()
+  report( name, f( n, ... ), n )
+end
+
+
+-- benchmarks that run in a Lua loop (minus the loop overhead)
+local function empty( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = o
+  end
+  return clock() - t0
+end
+
+local function l( name, f, o, ... )
+  collectgarbage()
+  local base = empty( o, N )
+  report( name, f( o, N, ... ) - base, N )
+end
+
+-- benchmarks that process `N` elements in a single call
+local function k( name, f, o, ... )
+  collectgarbage()
+  report( name, f( o, N, ... ), N )
+end
+
+
+local function index_method( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = o.get
+  end
+  return clock() - t0
+end
+
+local function index_field( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = o.x
+  end
+  return clock() - t0
+end
+
+local function index_property( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = o.prop
+  end
+  return clock() - t0
+end
+
+local function index_fallback( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = o.other
+  end
+  return clock() - t0
+end
+
+local function index_object( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = o.b
+  end
+  return clock() - t0
+end
+
+local function newindex_field( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    o.x = i
+  end
+  return clock() - t0
+end
+
+local function newindex_property( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    o.prop = i
+  end
+  return clock() - t0
+end
+
+local function newindex_fallback( o, n )
+  local t0 = clock()
+  for i = 1, n do
+    o.other = i
+  end
+  return clock() - t0
+end
+
+local function flag_add( f, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = f + f
+  end
+  return clock() - t0
+end
+
+-- unboxed flags are plain integers, so `+` would be integer addition
+-- instead of the bitwise or of the flag types (`|` is a syntax error
+-- before Lua 5.3, where unboxed flags don't exist anyway)
+local flag_or = (loadstring or load)( [[
+  local clock, f, n = os.clock, ...
+  local t0 = clock()
+  for i = 1, n do
+    local _ = f | f
+  end
+  return clock() - t0
+]] )
+
+local function flag_call( f, n )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = f( f )
+  end
+  return clock() - t0
+end
+
+local function flag_eq( f, n, g )
+  local t0 = clock()
+  for i = 1, n do
+    local _ = f == g
+  end
+  return clock() - t0
+end
+
+local function array_sum_lua( a, n )
+  local t0 = clock()
+  local s = 0
+  for i = 1, n do
+    s = s + a[ i ].v
+  end
+  return clock() - t0
+end
+
+local function array_sum( a, n, field )
+  local t0 = clock()
+  local _ = a:sum( field )
+  return clock() - t0
+end
+
+local function array_minmax_lua( a, n )
+  local t0 = clock()
+  local lo, hi = math.huge, -math.huge
+  for i = 1, n do
+    local v = a[ i ].v
+    if v < lo then lo = v end
+    if v > hi then hi = v end
+  end
+  return clock() - t0
+end
+
+local function array_minmax( a, n, field )
+  local t0 = clock()
+  local _, _ = a:minmax( field )
+  return clock() - t0
+end
+
+local function array_scale_lua( a, n )
+  local t0 = clock()
+  for i = 1, n do
+    local r = a[ i ]
+    r.v = r.v * 2 + 1
+  end
+  return clock() - t0
+end
+
+local function array_scale( a, n, field )
+  local t0 = clock()
+  a:scale( field, 2, 1 )
+  return clock() - t0
+end
+
+
+io.write( "# lua version\tbenchmark\tns/op\titerations\n" )
+
+-- object creation
+c( "newobject", N, bench.newobject, false )
+c( "newobject.destructor", N, bench.newobject, true )
+c( "newpointer", N, bench.newpointer )
+c( "newfield", N, bench.newfield, bench.new( "Bench" ) )
+
+-- type checks
+c( "checkudata", N, bench.checkudata, bench.new( "BenchPlain" ) )
+c( "checkobject.direct", N, bench.checkobject, bench.new( "Bench" ), "Bench" )
+c( "checkobject.cast", N, bench.checkobject, bench.new( "BenchC" ), "Bench" )
+c( "checkobject.derived", N, bench.checkobject, bench.new( "BenchD" ), "Bench" )
+for d = 1, 8 do
+  c( "checkobject.vcheck"..d, N, bench.checkobject, bench.chain( d ), "Bench" )
+end
+for d = 1, 8 do
+  c( "checkobject.epoch"..d, N, bench.checkobject, bench.chain( d, true ), "Bench" )
+end
+c( "checkobject_t.direct", N, bench.checkobject_t, bench.new( "Bench" ), "Bench" )
+c( "checkobject_t.cast", N, bench.checkobject_t, bench.new( "BenchC" ), "Bench" )
+c( "checkobject_ic.direct", N, bench.checkobject_ic, bench.new( "Bench" ), "Bench" )
+c( "checkobject_ic.cast", N, bench.checkobject_ic, bench.new( "BenchC" ), "Bench" )
+
+-- metamethod dispatch
+for _,t in ipairs{ "Bench", "BenchFast" } do
+  local o = bench.new( t )
+  l( t..".index.method", index_method, o )
+  l( t..".index.field", index_field, o )
+  l( t..".index.property", index_property, o )
+  l( t..".index.fallback", index_fallback, o )
+  l( t..".newindex.field", newindex_field, o )
+  l( t..".newindex.property", newindex_property, o )
+  l( t..".newindex.fallback", newindex_fallback, o )
+end
+l( "BenchC.index.object", index_object, bench.new( "BenchC" ) )
+
+-- flags (plain, with MOON_FLAG_USECACHE, and with MOON_FLAG_UNBOXED)
+for _,mode in ipairs{ "plain", "cache", "unboxed" } do
+  local f = bench.flag( 3, mode )
+  local name = mode == "plain" and "flag" or "flag."..mode
+  l( name..".add", type( f ) == "number" and flag_or or flag_add, f )
+  if type( f ) ~= "number" then -- unboxed flags can't be called
+    l( name..".call", flag_call, f )
+  end
+  l( name..".eq", flag_eq, f, bench.flag( 3, mode ) )
+end
+
+-- array kernels vs. Lua loops (per element)
+do
+  local a = bench.array( N )
+  l( "array.sum.lua", array_sum_lua, a )
+  k( "array.sum", array_sum, a, "v" )
+  k( "array.sum.float", array_sum, a, "f" )
+  k( "array.sum.int", array_sum, a, "k" )
+  l( "array.minmax.lua", array_minmax_lua, a )
+  k( "array.minmax", array_minmax, a, "v" )
+  k( "array.minmax.float", array_minmax, a, "f" )
+  k( "array.minmax.int", array_minmax, a, "k" )
+  l( "array.scale.lua", array_scale_lua, a )
+  k( "array.scale", array_scale, a, "v" )
+  k( "array.scale.float", array_scale, a, "f" )
+end
+
+-- Lua state creation with type definitions (per state)
+local NS = math.ceil( N / 100 )
+local NSC = math.ceil( N / 1000 )
+for _,mode in ipairs{ "defobject", "defobjects", "typeset" } do
+  c( "newstate."..mode, NS, bench.newstate, mode )
+  c( "newstate.chain64."..mode, NSC, bench.newstate, mode, true )
+end
+
+-- garbage collection
+local NGC = math.ceil( N / 10 )
+c( "gc", NGC, bench.gc, false )
+c( "gc.destructor", NGC, bench.gc, true )
+
@@ -0,0 +1,90 @@
+#include <string>
+#include <lua.hpp>
+#include "moon.hpp"
+
+
+/* Objects with non-trivial constructors and destructors are stored
+ * directly in the userdata memory. */
+class Named {
+public:
+  explicit Named( std::string n ) : name( std::move( n ) ) {}
+  virtual ~Named() {}
+  std::string name;
+};
+
+class Counter : public Named {
+public:
+  Counter( std::string n, lua_Integer start )
+    : Named( std::move( n ) ), value( start ) {}
+  lua_Integer value;
+};
+
+MOON_CPP_TYPE( Named, "Named" )
+MOON_CPP_TYPE( Counter, "Counter" )
+
+
+static int Named_getname( lua_State* L ) {
+  Named* n = moon::check< Named >( L, 1 );
+  lua_pushlstring( L, n->name.data(), n->name.size() );
+  return 1;
+}
+
+
+static int Counter_inc( lua_State* L ) {
+  Counter* c = moon::check< Counter >( L, 1 );
+  c->value += luaL_optinteger( L, 2, 1 );
+  return 0;
+}
+
+
+static int Counter_value( lua_State* L ) {
+  Counter* c = moon::check< Counter >( L, 1 );
+  lua_pushinteger( L, c->value );
+  return 1;
+}
+
+
+static int cppex_newcounter( lua_State* L ) {
+  size_t len = 0;
+  char const* s = luaL_checklstring( L, 1, &len );
+  lua_Integer start = luaL_optinteger( L, 2, 0 );
+  moon::make< Counter >( L, std::string( s, len ), start );
+  return 1;
+}
+
+
+static int cppex_copy( lua_State* L ) {
+  /* copy constructor of Counter, again placed in userdata memory */
+  moon::push( L, *moon::check< Counter >( L, 1 ) );
+  return 1;
+}
+
+
+extern "C" int luaopen_cppex( lua_State* L ) {
+  luaL_Reg const cppex_funcs[] = {
+    { "newcounter", cppex_newcounter },
+    { "copy", cppex_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const Named_methods[] = {
+    { "getname", Named_getname },
+    { NULL, NULL }
+  };
+  luaL_Reg const Counter_methods[] = {
+    { "getname", Named_getname },
+    { "inc", Counter_inc },
+    { "value", Counter_value },
+    { NULL, NULL }
+  };
+  moon::define< Named >( L, Named_methods );
+  moon::define< Counter >( L, Counter_methods );
+  /* A Counter can be used wherever a Named is expected (the cast
+   * adjusts the pointer if necessary): */
+  moon::defcast< Counter, Named >( L );
+#if LUA_VERSION_NUM < 502
+  luaL_register( L, "cppex", cppex_funcs );
+#else
+  luaL_newlib( L, cppex_funcs );
+#endif
+  return 1;
+}
@@ -0,0 +1,108 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include "moon_dlfix.h"
+
+/* Measures the cost of MOON_DLFIX() in a process with many loaded
+ * shared objects (e.g. a plugin host).
+ *
+ * Usage: ./dlfixbench [iterations] lib.so ...
+ *
+ * All given libraries are loaded with RTLD_LOCAL first. Include the
+ * Lua shared library in the list to simulate a plugin that is linked
+ * to Lua. Prints one tab-separated line per benchmark:
+ *
+ *     <benchmark> <us/op> <iterations>
+ */
+
+#if defined( MOON_DLFIX_DL_ITERATE_PHDR ) && defined( RTLD_NOLOAD )
+/* the old way: dlopen()/dlsym() every loaded object and check the
+ * name afterwards */
+static int old_cb( struct dl_phdr_info* info, size_t size,
+                   void* data ) {
+  int* found = (int*)data;
+  void* dl = dlopen( info->dlpi_name, RTLD_LAZY );
+  (void)size;
+  if( dl ) {
+    if( dlsym( dl, "lua_gettop" ) ) {
+      char const* libname = strrchr( info->dlpi_name, '/' );
+      if( libname )
+        ++libname;
+      else
+        libname = info->dlpi_name;
+      if( 0 == strncmp( libname, MOON_DLFIX_LIBPREFIX,
+                        sizeof( MOON_DLFIX_LIBPREFIX )-1 ) ) {
+        void* dl2 = dlopen( info->dlpi_name,
+                            RTLD_LAZY|RTLD_GLOBAL|RTLD_NOLOAD );
+        if( dl2 ) {
+          dlclose( dl2 );
+          *found = 1;
+        }
+      }
+    }
+    dlclose( dl );
+  }
+  return *found;
+}
+
+static int old_find( void ) {
+  int found = 0;
+  return dl_iterate_phdr( old_cb, &found );
+}
+
+static int count_cb( struct dl_phdr_info* info, size_t size,
+                     void* data ) {
+  (void)info;
+  (void)size;
+  ++*(int*)data;
+  return 0;
+}
+
+static int new_find( void ) {
+  return MOON_DLFIX_FIND();
+}
+
+static int memoized( void ) {
+  MOON_DLFIX();
+  return 1;
+}
+
+
+static void report( char const* name, int (*f)( void ), int n ) {
+  clock_t t0 = clock();
+  int i = 0;
+  for( i = 0; i < n; ++i )
+    f();
+  printf( "%s\t%.2f\t%d\n", name,
+          (double)(clock() - t0) * 1e6 / CLOCKS_PER_SEC / n, n );
+}
+
+
+int main( int argc, char* argv[] ) {
+  int n = 1000, i = 1, nobjs = 0;
+  if( argc > 1 && atoi( argv[ 1 ] ) > 0 )
+    n = atoi( argv[ i++ ] );
+  for( ; i < argc; ++i )
+    if( !dlopen( argv[ i ], RTLD_LAZY|RTLD_LOCAL ) )
+      fprintf( stderr, "WARNING: %s\n", dlerror() );
+  dl_iterate_phdr( count_cb, &nobjs );
+  printf( "# %d loaded ELF objects\n", nobjs );
+  printf( "# benchmark\tus/op\titerations\n" );
+  report( "find.dlopen", old_find, n );
+  report( "find.symtab", new_find, n );
+  report( "MOON_DLFIX", memoized, n );
+  printf( "# Lua API is %savailable globally\n",
+          moon_dlfix_isglobal() ? "" : "NOT " );
+  return EXIT_SUCCESS;
+}
+#else
+int main( void ) {
+  fprintf( stderr, "dl_iterate_phdr() is not available!\n" );
+  return EXIT_FAILURE;
+}
+#endif
@@ -7,6 +7,7 @@
 #define MOON_FLAG_TYPE unsigned
 #define MOON_FLAG_SUFFIX X
 #define MOON_FLAG_USECACHE
+#define MOON_FLAG_NAMES { "NULL", 0 }, { "ONE", 1 }, { "TWO", 2 }
 #include "moon_flag.h"
 
 #define MOON_FLAG_NAME "Y"
@@ -14,6 +15,13 @@
 #define MOON_FLAG_SUFFIX Y
 #include "moon_flag.h"
 
+/* on Lua 5.3+ Z values are plain integers */
+#define MOON_FLAG_NAME "Z"
+#define MOON_FLAG_TYPE unsigned
+#define MOON_FLAG_SUFFIX Z
+#define MOON_FLAG_UNBOXED
+#include "moon_flag.h"
+
 
 static int flgex_getXmethods( lua_State* L ) {
   if( moon_getmethods( L, "X" ) == LUA_TNIL )
@@ -25,11 +33,13 @@ static int flgex_getXmethods( lua_State* L ) {
 int luaopen_flgex( lua_State* L ) {
   luaL_Reg const flgex_funcs[] = {
     { "getXmethods", flgex_getXmethods },
+    { "parseX", moon_flag_parse_X },
     { NULL, NULL }
   };
   /* define the flags and create their metatables */
   moon_flag_def_X( L );
   moon_flag_def_Y( L );
+  moon_flag_def_Z( L );
 #if LUA_VERSION_NUM < 502
   luaL_register( L, "flgex", flgex_funcs );
 #else
@@ -46,9 +56,12 @@ int luaopen_flgex( lua_State* L ) {
   lua_setfield( L, -2, "THREE" );
   moon_flag_new_Y( L, 8 );
   lua_setfield( L, -2, "FOUR" );
+  moon_flag_new_Z( L, 16 );
+  lua_setfield( L, -2, "FIVE" );
   /* we don't use those functions in this example: */
   (void)moon_flag_get_X;
   (void)moon_flag_get_Y;
+  (void)moon_flag_get_Z;
   return 1;
 }
 
@@ -4,13 +4,23 @@
  * The moon toolkits provides the following functions for handling
  * userdata in an easy and safe way:
  * -   moon_defobject
+ * -   moon_defobject_lazy
  * -   moon_newobject
+ * -   moon_newobjects
  * -   moon_newpointer
- * -   moon_newfield
+ * -   moon_newfield/moon_newfield_epoch
+ * -   moon_defpool/moon_newpooled
+ * -   moon_defarray/moon_newarray/moon_maparray
  * -   moon_killobject
  * -   moon_checkobject
  * -   moon_testobject
  * -   moon_defcast
+ * -   moon_gettype (and the `_t` variants of the functions above)
+ * -   moon_checkobject_ic
+ * -   moon_deffields
+ * -   moon_compileindex
+ * -   moon_defobjects
+ * -   moon_newtypeset/moon_deftypes
  *
  * Using those functions enables you to
  * -   Create and register a new metatable for a C type in a single
@@ -25,6 +35,7 @@
  * -   Use userdata polymorphically (use one method implementation for
  *     multiple similar types).
  */
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -44,10 +55,48 @@ typedef struct {
   D d;
 } C;
 
+typedef struct {
+  D d;
+  int z;
+} E;
+
 typedef struct {
   double f;
 } B;
 
+typedef struct {
+  double v;
+  float w;
+} F;
+
+typedef struct {
+  int v;
+} J;
+
+typedef struct {
+  J j;
+  int x;
+} G;
+
+typedef struct {
+  G g;
+  int y;
+} H;
+
+typedef struct {
+  int v;
+} M;
+
+typedef struct {
+  M m;
+  int w;
+} N;
+
+typedef struct {
+  double d;
+  N n;
+} O;
+
 #define TYPE_B 1
 #define TYPE_C 2
 
@@ -59,10 +108,22 @@ typedef struct {
   } u;
 } A;
 
+/* Similar to A, but the union members are exposed via
+ * `moon_deffields`, and their views are invalidated by a generation
+ * counter (see `K_switch`) instead of a tag check: */
+typedef struct {
+  unsigned epoch;
+  int tag;
+  union {
+    B b;
+    C c;
+  } u;
+} K;
+
 
 /* Check functions to make sure that embedded userdata are still
- * valid. A change in the tagged union (A_switch) or running a cleanup
- * function (C_close) can make embedded userdata invalid. */
+ * valid. A change in the tagged union (A_switch) can make embedded
+ * userdata invalid. */
 static int type_b_check( void* p ) {
   int* tagp = p;
   int res = *tagp == TYPE_B;
@@ -75,12 +136,6 @@ static int type_c_check( void* p ) {
   return res;
 }
 
-static int object_valid_check( void* p ) {
-  unsigned char* flagp = p;
-  int res = *flagp & MOON_OBJECT_IS_VALID;
-  return res;
-}
-
 
 /* Types that are similar can share one method implementation, but a
  * pointer to one type has to be transformed to a pointer to the other
@@ -159,6 +214,25 @@ static int A_printme( lua_State* L ) {
 }
 
 
+static int K_switch( lua_State* L ) {
+  K* k = moon_checkobject( L, 1, "K" );
+  lua_settop( L, 1 );
+  k->tag = k->tag == TYPE_B ? TYPE_C : TYPE_B;
+  memset( &(k->u), 0, sizeof( k->u ) );
+  /* All views of the old union member (and any objects embedded in
+   * it) become invalid at once: */
+  k->epoch++;
+  return 1;
+}
+
+
+static int K_close( lua_State* L ) {
+  moon_checkobject( L, 1, "K" );
+  moon_killobject( L, 1 );
+  return 0;
+}
+
+
 static int B_property_f( lua_State* L ) {
   B* b = moon_checkobject( L, 1, "B" );
   printf( "property{f} B (uv1: %d, uv2: %d)\n",
@@ -208,42 +282,24 @@ static int B_printme( lua_State* L ) {
 }
 
 
+/* The embedded `d` field is handled by moon_deffields (see below):
+ * The D object for `c.d` is created on first access and cached in
+ * the C object, and `c.d = x` copies a D object into the field. */
 static int C_index( lua_State* L ) {
-  C* c = moon_checkobject( L, 1, "C" );
-  /* You can get a pointer to the `moon_object_header` structure
-   * common to all objects created via the moon toolkit by using the
-   * normal `lua_touserdata` function: */
-  moon_object_header* h = lua_touserdata( L, 1 );
-  char const* key = luaL_checkstring( L, 2 );
+  moon_checkobject( L, 1, "C" );
   printf( "__index C (uv1: %d, uv2: %d)\n",
           (int)lua_tointeger( L, lua_upvalueindex( 1 ) ),
           (int)lua_tointeger( L, lua_upvalueindex( 2 ) ) );
-  if( 0 == strcmp( key, "d" ) ) {
-    if( moon_getuvfield( L, 1, "d" ) == LUA_TNIL ) {
-      /* The `object_valid_check` makes sure that the parent object
-       * has the `MOON_OBJECT_IS_VALID` flag set. This flag is reset
-       * by the `moon_killobject` function. */
-      void** p = moon_newfield( L, "D", 1, object_valid_check, &h->flags );
-      *p = &(c->d);
-      lua_pushvalue( L, -1 );
-      moon_setuvfield( L, 1, "d" );
-    }
-  } else
-    lua_pushnil( L );
+  lua_pushnil( L );
   return 1;
 }
 
 
 static int C_newindex( lua_State* L ) {
-  C* c = moon_checkobject( L, 1, "C" );
-  char const* key = luaL_checkstring( L, 2 );
+  moon_checkobject( L, 1, "C" );
   printf( "__newindex C (uv1: %d, uv2: %d)\n",
           (int)lua_tointeger( L, lua_upvalueindex( 1 ) ),
           (int)lua_tointeger( L, lua_upvalueindex( 2 ) ) );
-  if( 0 == strcmp( key, "d" ) ) {
-    D* d = moon_checkobject( L, 3, "D" );
-    c->d = *d;
-  }
   return 0;
 }
 
@@ -271,44 +327,40 @@ static int C_printme( lua_State* L ) {
 }
 
 
+/* The fields `x` and `y` are handled by moon_deffields (see below),
+ * so those functions only see the other keys. */
 static int D_index( lua_State* L ) {
-  D* d = moon_checkobject( L, 1, "D" );
-  char const* key = luaL_checkstring( L, 2 );
-  if( 0 == strcmp( key, "x" ) )
-    lua_pushinteger( L, d->x );
-  else if( 0 == strcmp( key, "y" ) )
-    lua_pushinteger( L, d->y );
-  else {
+  /* For functions that are called very often, you can add a cache
+   * for the type check. It's fine to share the cache between Lua
+   * states (as long as they don't run in parallel): */
+  static moon_object_cache cache;
+  moon_checkobject_ic( L, 1, "D", &cache );
 #if LUA_VERSION_NUM < 502
-    lua_getfenv( L, 1 );
+  lua_getfenv( L, 1 );
 #else
-    lua_getuservalue( L, 1 );
+  lua_getuservalue( L, 1 );
 #endif
-    lua_pushvalue( L, 2 );
-    lua_rawget( L, -2 );
-    lua_replace( L, -2 );
-  }
+  /* Field objects like `c.d` have no uservalue table on Lua 5.4. */
+  if( !lua_istable( L, -1 ) )
+    return 0;
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, -2 );
+  lua_replace( L, -2 );
   return 1;
 }
 
 
 static int D_newindex( lua_State* L ) {
-  D* d = moon_checkobject( L, 1, "D" );
-  char const* key = luaL_checkstring( L, 2 );
-  if( 0 == strcmp( key, "x" ) )
-    d->x = (int)moon_checkint( L, 3, INT_MIN, INT_MAX );
-  else if( 0 == strcmp( key, "y" ) )
-    d->y = (int)moon_checkint( L, 3, INT_MIN, INT_MAX );
-  else {
+  moon_checkobject( L, 1, "D" );
 #if LUA_VERSION_NUM < 502
-    lua_getfenv( L, 1 );
+  lua_getfenv( L, 1 );
 #else
-    lua_getuservalue( L, 1 );
+  lua_getuservalue( L, 1 );
 #endif
-    lua_pushvalue( L, 2 );
-    lua_pushvalue( L, 3 );
-    lua_rawset( L, -3 );
-  }
+  luaL_argcheck( L, lua_istable( L, -1 ), 2, "no such field" );
+  lua_pushvalue( L, 2 );
+  lua_pushvalue( L, 3 );
+  lua_rawset( L, -3 );
   return 0;
 }
 
@@ -332,6 +384,29 @@ static int D_vcall( lua_State* L ) {
 }
 
 
+static int E_printme( lua_State* L ) {
+  E* e = moon_checkobject( L, 1, "E" );
+  printf( "E { d = { x = %d, y = %d }, z = %d }\n", e->d.x, e->d.y,
+          e->z );
+  return 0;
+}
+
+
+static void* E_to_D( void* p ) {
+  E* e = p;
+  return &(e->d);
+}
+
+
+/* The method list of a lazily defined type is used after
+ * `luaopen_objex` has returned, so it can't be a local array. */
+static luaL_Reg const E_methods[] = {
+  { "printme", E_printme },
+  { "printmeD", D_printme },
+  { NULL, NULL }
+};
+
+
 static int objex_getAmethods( lua_State* L ) {
   if( moon_getmethods( L, "A" ) == LUA_TNIL )
     lua_pushnil( L );
@@ -339,6 +414,15 @@ static int objex_getAmethods( lua_State* L ) {
 }
 
 
+static int objex_getDmethods( lua_State* L ) {
+  /* D has a compiled __index dispatcher, which is reverted here, so
+   * that methods added from Lua are found. */
+  if( moon_getmethods( L, "D" ) == LUA_TNIL )
+    lua_pushnil( L );
+  return 1;
+}
+
+
 static int objex_newA( lua_State* L ) {
   /* Create a new A object. The memory is allocated inside the
    * userdata when using `moon_newobject`. Here no cleanup function
@@ -360,6 +444,14 @@ static int objex_newA( lua_State* L ) {
 }
 
 
+static int objex_newK( lua_State* L ) {
+  K* k = moon_newobject( L, "K", 0 );
+  memset( k, 0, sizeof( *k ) );
+  k->tag = TYPE_C;
+  return 1;
+}
+
+
 static int objex_newB( lua_State* L ) {
   B* b = moon_newobject( L, "B", 0 );
   b->f = 0.0;
@@ -367,6 +459,22 @@ static int objex_newB( lua_State* L ) {
 }
 
 
+static void B_init( void* p, int i, void* ud ) {
+  ((B*)p)->f += i;
+  (void)ud;
+}
+
+static int objex_newBs( lua_State* L ) {
+  /* Create a table of B objects in one go. All objects are copied
+   * from the prototype first and then passed to the init function
+   * (both are optional): */
+  B proto = { 0.5 };
+  int n = (int)moon_checkint( L, 1, 0, INT_MAX );
+  moon_newobjects( L, "B", n, 0, &proto, B_init, NULL );
+  return 1;
+}
+
+
 static void C_destructor( void* p ) {
   printf( "destroying C: %p\n", p );
 }
@@ -389,7 +497,11 @@ static int objex_newC( lua_State* L ) {
 
 
 static int objex_newD( lua_State* L ) {
-  D* d = moon_newobject( L, "D", 0 );
+  /* If you create lots of objects, you can look up the type handle
+   * once (it's passed as an upvalue here) and use the `_t` variants
+   * which don't need to find the metatable by name: */
+  moon_object_type* t = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  D* d = moon_newobject_t( L, t, 0 );
   d->x = 0;
   d->y = 0;
   lua_newtable( L );
@@ -455,17 +567,303 @@ static int objex_makeD( lua_State* L ) {
 }
 
 
+static int objex_allocD( lua_State* L ) {
+  int x = (int)moon_checkint( L, 1, INT_MIN, INT_MAX );
+  int y = (int)moon_checkint( L, 2, INT_MIN, INT_MAX );
+  /* Same as `objex_makeD`, but the memory comes from a pool of D
+   * objects managed by moon (see `moon_defpool` below), so there is
+   * no need for malloc/free: */
+  D* d = moon_newpooled( L, "D" );
+  d->x = x;
+  d->y = y;
+  lua_newtable( L );
+#if LUA_VERSION_NUM < 502
+  lua_setfenv( L, -2 );
+#else
+  lua_setuservalue( L, -2 );
+#endif
+  return 1;
+}
+
+
+static void closeD( void* d ) {
+  printf( "closing D: %p\n", d );
+}
+
+static int objex_newregion( lua_State* L ) {
+  moon_newregion( L, 0 );
+  return 1;
+}
+
+static int objex_regionD( lua_State* L ) {
+  int x = (int)moon_checkint( L, 2, INT_MIN, INT_MAX );
+  int y = (int)moon_checkint( L, 3, INT_MIN, INT_MAX );
+  /* The memory for this D object belongs to the region, and the
+   * object (and all other objects in the region) becomes invalid
+   * when the region is closed: */
+  D* d = moon_newobject_r( L, "D", 1, closeD );
+  d->x = x;
+  d->y = y;
+  return 1;
+}
+
+
+static int objex_newDs( lua_State* L ) {
+  int i = 0, n = (int)moon_checkint( L, 1, 0, INT_MAX );
+  /* `n` D structs in a single contiguous memory block. Indexing the
+   * array gives D objects that refer to the array elements. */
+  D* ds = moon_newarray( L, "DArray", (size_t)n, NULL, 0 );
+  for( i = 0; i < n; ++i ) {
+    ds[ i ].x = i+1;
+    ds[ i ].y = 2*(i+1);
+  }
+  return 1;
+}
+
+
+static int objex_newFs( lua_State* L ) {
+  int i = 0, n = lua_gettop( L );
+  /* An array of F structs with the given values, e.g. for the
+   * sum/minmax/scale kernels of arrays. */
+  F* fs = moon_newarray( L, "FArray", (size_t)n, NULL, 0 );
+  for( i = 0; i < n; ++i ) {
+    fs[ i ].v = luaL_checknumber( L, i+1 );
+    fs[ i ].w = (float)fs[ i ].v;
+  }
+  return 1;
+}
+
+
+static int objex_newE( lua_State* L ) {
+  /* The first E object creates the metatable of the lazily defined
+   * type (including the cast to D recorded in `luaopen_objex`). */
+  E* e = moon_newobject( L, "E", 0 );
+  e->d.x = (int)moon_optint( L, 1, INT_MIN, INT_MAX, 0 );
+  e->d.y = (int)moon_optint( L, 2, INT_MIN, INT_MAX, 0 );
+  e->z = (int)moon_optint( L, 3, INT_MIN, INT_MAX, 0 );
+  return 1;
+}
+
+
+static int objex_mapDs( lua_State* L ) {
+  static char const* const names[] = {
+    "private", "shared", "readonly", NULL
+  };
+  static int const modes[] = {
+    MOON_MAP_PRIVATE, MOON_MAP_SHARED, MOON_MAP_READONLY
+  };
+  char const* path = luaL_checkstring( L, 1 );
+  int mode = modes[ luaL_checkoption( L, 2, "private", names ) ];
+  /* The D structs are the contents of a file mapped into memory. The
+   * file is only changed if the mapping is shared, and the D objects
+   * of a read-only mapping can't be modified. */
+  moon_maparray( L, "DArray", path, mode, NULL );
+  return 1;
+}
+
+
+static int objex_unmap( lua_State* L ) {
+  moon_checkarray( L, 1, "DArray", NULL );
+  /* Removes the mapping right away (instead of waiting for the garbage
+   * collector) and invalidates all D objects referring to it. */
+  moon_killobject( L, 1 );
+  return 0;
+}
+
+
+static int objex_view( lua_State* L ) {
+  size_t off = (size_t)moon_optint( L, 2, 0, INT_MAX, 0 );
+  size_t len = (size_t)-1;
+  if( !lua_isnoneornil( L, 3 ) )
+    len = (size_t)moon_checkint( L, 3, 0, INT_MAX );
+  /* A buffer object referring to the memory of a Lua string or a moon
+   * object (e.g. the elements of a D array) without copying. */
+  moon_viewbuffer( L, 1, off, len );
+  return 1;
+}
+
+
+static void* H_to_G( void* p ) {
+  H* h = p;
+  return &(h->g);
+}
+
+static void* G_to_J( void* p ) {
+  G* g = p;
+  return &(g->j);
+}
+
+/* A type set is created once and can then be used for many Lua
+ * states, e.g. one per thread or per request. The arrays must
+ * stay valid as long as the type set is used. */
+static moon_object_def const typeset_types[] = {
+  { "G", sizeof( G ), NULL, NULL },
+  { "H", sizeof( H ), NULL, NULL },
+  { NULL, 0, NULL, NULL }
+};
+
+static moon_object_castdef const typeset_casts[] = {
+  { "H", "G", H_to_G },
+  { NULL, NULL, 0 }
+};
+
+static int typeset_run( lua_State* L ) {
+  moon_object_typeset const* set = lua_touserdata( L, 1 );
+  int late = lua_toboolean( L, 2 );
+  int early = lua_toboolean( L, 3 );
+  H* h = NULL;
+  G* g = NULL;
+  J* j = NULL;
+  /* With a type defined before the type set, the type IDs of the Lua
+   * state differ from the ones in the type set. */
+  if( early )
+    moon_defobject( L, "J", sizeof( J ), NULL, 0 );
+  moon_deftypes( L, set );
+  if( !early )
+    moon_defobject( L, "J", sizeof( J ), NULL, 0 );
+  /* Adding a cast for a type from the type set gives this Lua state
+   * private copies of the affected cast tables. */
+  if( late )
+    moon_defcast( L, "G", "J", G_to_J );
+  h = moon_newobject( L, "H", 0 );
+  h->g.j.v = 1;
+  h->g.x = 2;
+  h->y = 3;
+  g = moon_checkobject( L, -1, "G" );
+  j = moon_testobject( L, -1, "J" );
+  lua_pushinteger( L, g->x );
+  lua_pushinteger( L, j != NULL ? j->v : 0 );
+  return 2;
+}
+
+static int objex_typeset( lua_State* L ) {
+  moon_object_typeset* set = moon_newtypeset( L, typeset_types,
+                                              typeset_casts );
+  int i = 0;
+  luaL_checkstack( L, 8, "objex_typeset" );
+  /* the Lua states without the late cast must not see the cast added
+   * in the others */
+  for( i = 0; i < 4; ++i ) {
+    lua_State* L2 = luaL_newstate();
+    if( L2 == NULL ) {
+      moon_freetypeset( set );
+      luaL_error( L, "memory allocation error" );
+    }
+    lua_pushcfunction( L2, typeset_run );
+    lua_pushlightuserdata( L2, set );
+    lua_pushboolean( L2, i % 2 == 0 );
+    lua_pushboolean( L2, i >= 2 );
+    if( lua_pcall( L2, 3, 2, 0 ) != 0 ) {
+      lua_pushstring( L, lua_tostring( L2, -1 ) );
+      lua_close( L2 );
+      moon_freetypeset( set );
+      lua_error( L );
+    }
+    lua_pushinteger( L, lua_tointeger( L2, -2 ) );
+    lua_pushinteger( L, lua_tointeger( L2, -1 ) );
+    lua_close( L2 );
+  }
+  moon_freetypeset( set );
+  return 8;
+}
+
+
+static void* O_to_N( void* p ) {
+  O* o = p;
+  return &(o->n);
+}
+
+static void* N_to_M( void* p ) {
+  N* n = p;
+  return &(n->m);
+}
+
+/* Many types and casts can be registered in one go. The cast chains
+ * are computed once for all casts, so the order of the casts doesn't
+ * matter. */
+static moon_object_field const M_fields[] = {
+  { "v", MOON_FIELD_INT, offsetof( M, v ), 0, 0, NULL, 0 },
+  { NULL, 0, 0, 0, 0, NULL, 0 }
+};
+
+static moon_object_field const N_fields[] = {
+  { "w", MOON_FIELD_INT, offsetof( N, w ), 0, 0, NULL, 0 },
+  { NULL, 0, 0, 0, 0, NULL, 0 }
+};
+
+static moon_object_field const O_fields[] = {
+  { "d", MOON_FIELD_DOUBLE, offsetof( O, d ), 0, 0, NULL, 0 },
+  { NULL, 0, 0, 0, 0, NULL, 0 }
+};
+
+static moon_object_def const chain_types[] = {
+  { "M", sizeof( M ), NULL, M_fields },
+  { "N", sizeof( N ), NULL, N_fields },
+  { "O", sizeof( O ), NULL, O_fields },
+  { NULL, 0, NULL, NULL }
+};
+
+static moon_object_castdef const chain_casts[] = {
+  { "O", "N", O_to_N },
+  { "N", "M", N_to_M },
+  { NULL, NULL, 0 }
+};
+
+static int objex_newO( lua_State* L ) {
+  O* o = moon_newobject( L, "O", 0 );
+  o->d = luaL_optnumber( L, 1, 0 );
+  o->n.w = (int)moon_optint( L, 2, INT_MIN, INT_MAX, 0 );
+  o->n.m.v = (int)moon_optint( L, 3, INT_MIN, INT_MAX, 0 );
+  return 1;
+}
+
+static int objex_getMv( lua_State* L ) {
+  M* m = moon_checkobject( L, 1, "M" );
+  lua_pushinteger( L, m->v );
+  return 1;
+}
+
+static int objex_getNw( lua_State* L ) {
+  N* n = moon_checkobject( L, 1, "N" );
+  lua_pushinteger( L, n->w );
+  return 1;
+}
+
+
+static int objex_poolstats( lua_State* L ) {
+  moon_getpoolstats( L, "D" );
+  return 1;
+}
+
+
 int luaopen_objex( lua_State* L ) {
   luaL_Reg const objex_funcs[] = {
     { "getAmethods", objex_getAmethods },
+    { "getDmethods", objex_getDmethods },
     { "newA", objex_newA },
+    { "newK", objex_newK },
     { "newB", objex_newB },
+    { "newBs", objex_newBs },
     { "newC", objex_newC },
-    { "newD", objex_newD },
     { "getD", objex_getD },
     { "makeD", objex_makeD },
+    { "allocD", objex_allocD },
+    { "poolstats", objex_poolstats },
+    { "newDs", objex_newDs },
+    { "newFs", objex_newFs },
+    { "newE", objex_newE },
+    { "mapDs", objex_mapDs },
+    { "unmap", objex_unmap },
+    { "newregion", objex_newregion },
+    { "regionD", objex_regionD },
+    { "view", objex_view },
+    { "typeset", objex_typeset },
+    { "newO", objex_newO },
+    { "getMv", objex_getMv },
+    { "getNw", objex_getNw },
     { "derive", moon_derive },
     { "downcast", moon_downcast },
+    { "stats", moon_stats },
     { NULL, NULL }
   };
   /* You put metamethods and normal methods in the same luaL_Reg
@@ -477,6 +875,11 @@ int luaopen_objex( lua_State* L ) {
     { "printme", A_printme },
     { NULL, NULL }
   };
+  luaL_Reg const K_methods[] = {
+    { "switch", K_switch },
+    { "close", K_close },
+    { NULL, NULL }
+  };
   luaL_Reg const B_methods[] = {
     { ".f", B_property_f },
 #if 0
@@ -500,9 +903,38 @@ int luaopen_objex( lua_State* L ) {
     { "__index", D_index },
     { "__newindex", D_newindex },
     { "printme", D_printme },
+    /* Lua doesn't intern long strings, but moon_compileindex can
+     * handle those as well: */
+    { "printme_with_a_name_too_long_to_be_interned", D_printme },
     { "vcall", D_vcall },
     { NULL, NULL }
   };
+  moon_object_field const C_fields[] = {
+    { "d", MOON_FIELD_OBJECT, offsetof( C, d ), 0, 0, "D", 0 },
+    { NULL, 0, 0, 0, 0, NULL, 0 }
+  };
+  /* The views for `k.b` and `k.c` are created via
+   * `moon_newfield_epoch` using the generation counter `k->epoch`:
+   */
+  moon_object_field const K_fields[] = {
+    { "tag", MOON_FIELD_INT | MOON_FIELD_READONLY, offsetof( K, tag ),
+      0, 0, NULL, 0 },
+    { "b", MOON_FIELD_OBJECT, offsetof( K, u.b ), 0, 0, "B",
+      MOON_FIELD_EPOCH( K, epoch ) },
+    { "c", MOON_FIELD_OBJECT, offsetof( K, u.c ), 0, 0, "C",
+      MOON_FIELD_EPOCH( K, epoch ) },
+    { NULL, 0, 0, 0, 0, NULL, 0 }
+  };
+  moon_object_field const D_fields[] = {
+    { "x", MOON_FIELD_INT, offsetof( D, x ), 0, 0, NULL, 0 },
+    { "y", MOON_FIELD_INT, offsetof( D, y ), 0, 0, NULL, 0 },
+    { NULL, 0, 0, 0, 0, NULL, 0 }
+  };
+  moon_object_field const F_fields[] = {
+    { "v", MOON_FIELD_DOUBLE, offsetof( F, v ), 0, 0, NULL, 0 },
+    { "w", MOON_FIELD_FLOAT, offsetof( F, w ), 0, 0, NULL, 0 },
+    { NULL, 0, 0, 0, 0, NULL, 0 }
+  };
   /* All object types must be defined once (this creates the
    * metatables): */
   moon_defobject( L, "A", sizeof( A ), A_methods, 0 );
@@ -514,14 +946,40 @@ int luaopen_objex( lua_State* L ) {
   lua_pushinteger( L, 2 );
   moon_defobject( L, "C", sizeof( C ), C_methods, 2 );
   moon_defobject( L, "D", sizeof( D ), D_methods, 0 );
+  /* Simple struct fields can be accessed without writing any
+   * __index/__newindex code: */
+  moon_deffields( L, "D", D_fields );
+  moon_deffields( L, "C", C_fields );
+  moon_defobject( L, "K", sizeof( K ), K_methods, 0 );
+  moon_deffields( L, "K", K_fields );
+  /* The method list for D is final, so the lookup of methods and
+   * fields can be merged into a single hash table: */
+  moon_compileindex( L, "D" );
   /* Add a type cast from a C object to the embedded D object. The
    * cast is executed automatically during moon_checkobject. */
   moon_defcast( L, "C", "D", C_to_D );
+  /* D objects may also be allocated from a pool (with the default
+   * number of slots per slab and no extra destructor): */
+  moon_defpool( L, "D", sizeof( D ), 0, 0 );
+  /* An array type for contiguously stored D objects: */
+  moon_defarray( L, "DArray", "D" );
+  moon_defobject( L, "F", sizeof( F ), NULL, 0 );
+  moon_deffields( L, "F", F_fields );
+  moon_defarray( L, "FArray", "F" );
+  /* The metatable for E is only created when it is needed for the
+   * first time. Casts for E are recorded until then: */
+  moon_defobject_lazy( L, "E", sizeof( E ), E_methods, 0 );
+  moon_defcast( L, "E", "D", E_to_D );
+  moon_defobjects( L, chain_types, chain_casts );
 #if LUA_VERSION_NUM < 502
   luaL_register( L, "objex", objex_funcs );
 #else
   luaL_newlib( L, objex_funcs );
 #endif
+  /* The type handle stays valid as long as the Lua state is open: */
+  lua_pushlightuserdata( L, moon_gettype( L, "D" ) );
+  lua_pushcclosure( L, objex_newD, 1 );
+  lua_setfield( L, -2, "newD" );
   return 1;
 }
 
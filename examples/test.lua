@@ -6,6 +6,7 @@ require( "sofix" )
 local objex = require( "objex" )
 local flgex = require( "flgex" )
 local stkex = require( "stkex" )
+local cppex = require( "cppex" )
 
 
 print( _VERSION )
@@ -41,6 +42,8 @@ do
   d.y = 10
   print( d, d.x, d.y )
   d:printme()
+  d:printme_with_a_name_too_long_to_be_interned()
+  print( d.no_such_field_with_a_name_too_long_to_be_interned )
   a:switch()
   print( pcall( d.printme, d ) )
   a:switch()
@@ -53,9 +56,19 @@ do
   local d3 = objex.makeD( 100, 200 )
   print( d3, d3.x, d3.y )
   d3:printme()
+  local d5 = objex.allocD( 300, 400 )
+  print( d5, d5.x, d5.y )
+  d5:printme()
+  local stats = objex.poolstats()
+  print( stats.slabs, stats.slots, stats.used, stats.fragmentation )
   local d4 = objex.newD()
   print( d4, d4.x, d4.y )
   d4:printme()
+  local dmethods = objex.getDmethods()
+  function dmethods:sum()
+    return self.x + self.y
+  end
+  print( d4:sum(), d4.printme ~= nil )
   local c2 = objex.newC()
   c2.d.x = 22
   c2.d.y = 44
@@ -81,6 +94,103 @@ do
   x.y = 2
   x:printme()
   x:vcall( 1, 2, 3 )
+  local bs = objex.newBs( 3 )
+  print( #bs, bs[ 1 ].f, bs[ 2 ].f, bs[ 3 ].f )
+  local ds = objex.newDs( 3 )
+  print( #ds, ds[ 1 ].x, ds[ 3 ].y, ds[ 4 ] )
+  print( ds:sum( "x" ), ds:minmax( "y" ) )
+  local fs = objex.newFs( 1, 2, 0/0, 3 )
+  print( fs:minmax( "v" ) ) -- NaN is ignored
+  print( fs:minmax( "v", 2, 4 ) )
+  print( objex.newFs( 4, 5, 6, 0/0 ):minmax( "v" ) )
+  fs:scale( "v", 2, 1 )
+  print( fs[ 1 ].v, fs[ 4 ].v, fs:sum( "v", 1, 2 ) )
+  -- long enough for the vectorized loops of the kernels
+  local fl = objex.newFs( 3, 1, 0/0, 4, 1, 5, 9, 2, 6, 5, 3, 5 )
+  print( fl:sum( "v", 4 ), fl:minmax( "v" ) )
+  print( fl:sum( "w", 4 ), fl:minmax( "w" ) )
+  fl:scale( "w", 2, 1 )
+  print( fl[ 1 ].w, fl[ 12 ].w, fl:minmax( "w", 4 ) )
+  local dl = objex.newDs( 11 )
+  print( dl:sum( "x" ), dl:minmax( "y" ) )
+  local dv = ds[ 2 ]
+  dv:printme()
+  ds:resize( 10 )
+  print( #ds, pcall( dv.printme, dv ) )
+  ds:set( 9, ds:get( 1, 2 ) )
+  ds[ 5 ] = d3
+  print( ds[ 10 ].x, ds[ 5 ].x, #ds:slice( 2, 4 ) )
+  local buf = objex.view( ds )
+  print( #buf, buf:get( "int", 0 ), buf:slice( 4 ):get( "int", 0 ) )
+  buf:set( "int", 0, 42 )
+  print( ds[ 1 ].x, buf:tostring( 0, 1 ) ~= nil )
+  ds:resize( 2 )
+  print( pcall( buf.get, buf, "int", 0 ) )
+  local fname = os.tmpname()
+  local f = assert( io.open( fname, "wb" ) )
+  f:write( objex.view( objex.newDs( 3 ) ):tostring() )
+  f:close()
+  local mds = objex.mapDs( fname )
+  local mdv = mds[ 2 ]
+  print( #mds, mdv.x, mds[ 3 ].y )
+  mdv.x = 20 -- private copy, the file is unchanged
+  print( mdv.x, objex.mapDs( fname )[ 2 ].x )
+  local rds = objex.mapDs( fname, "readonly" )
+  local rdv = rds[ 2 ]
+  print( rdv.x, pcall( function() rdv.x = 20 end ) )
+  print( pcall( function() rds[ 1 ] = d3 end ) )
+  print( pcall( rds.set, rds, 1, { d3 } ), rds[ 1 ].x )
+  print( pcall( objex.view( rds ).set, objex.view( rds ), "int", 0, 1 ) )
+  objex.unmap( mds )
+  print( pcall( mdv.printme, mdv ) )
+  os.remove( fname )
+  local sbuf = objex.view( "hello world", 6 )
+  print( #sbuf, sbuf:tostring(), pcall( sbuf.set, sbuf, "int", 0, 1 ) )
+  local e = objex.newE( 1, 2, 3 )
+  e:printme()
+  e:printmeD()
+  local r = objex.newregion()
+  local rd1, rd2 = objex.regionD( r, 1, 2 ), objex.regionD( r, 3, 4 )
+  rd2:printme()
+  r:close()
+  print( pcall( rd1.printme, rd1 ) )
+  local k = objex.newK()
+  local kc = k.c
+  local kcd = kc.d -- uses the generation counter of k.c
+  kcd.x = 3
+  kcd:printme()
+  print( k.c == kc, kc.d == kcd ) -- both live at the same address
+  k:switch() -- invalidates k.c and k.c.d
+  print( k.tag, pcall( kc.printme, kc ) )
+  print( pcall( kcd.printme, kcd ) )
+  local kcd2 = k.c.d
+  kcd2:printme()
+  k:close() -- invalidates all views of k
+  print( pcall( kcd2.printme, kcd2 ) )
+  -- with and without a late cast G -> J, in fresh and used Lua states
+  print( objex.typeset() )
+  local o = objex.newO( 1, 2, 3 ) -- casts O -> N -> M
+  print( o.d, objex.getNw( o ), objex.getMv( o ) )
+  print( pcall( objex.getNw, objex.newD() ) )
+  local s0, sd, sc = objex.stats(), objex.newD(), objex.newC()
+  sd:printme() -- method, direct check
+  print( sd.x, sd.no_such_key ) -- field, fallback (both check directly)
+  print( pcall( sd.printme, {} ) ) -- method, failed check
+  sc:printmeD() -- method, check with cast
+  local s1 = objex.stats()
+  if s1.D then -- compiled with MOON_STATS
+    local function delta( tname, ... )
+      local t = {}
+      for i, k in ipairs( { ... } ) do
+        t[ i ] = s1[ tname ][ k ] - s0[ tname ][ k ]
+      end
+      return (table.unpack or unpack)( t )
+    end
+    print( delta( "D", "check_direct", "check_cast", "check_fail",
+                  "index_method", "index_field", "index_fallback" ) )
+    print( delta( "C", "check_direct", "check_cast", "check_fail",
+                  "index_method", "index_field", "index_fallback" ) )
+  end
 end
 collectgarbage()
 
@@ -114,6 +224,13 @@ do
   print( "same but not identical:", flags == flgex.THREE, flags, flgex.THREE )
   print( "better error message for mismatched types:" )
   print( pcall( function() local wrong = flgex.ONE + flgex.THREE end ) )
+  print( "unboxed flag (Lua 5.3+):", flgex.FIVE, type( flgex.FIVE ) )
+  flags = flgex.parseX( "ONE | TWO" )
+  print( "parsed flags:", flags == flgex.ONE + flgex.TWO )
+  for bit, name in flags:bits() do
+    print( "bit set:", bit, name )
+  end
+  print( pcall( flgex.parseX, "ONE|THREE" ) )
 end
 
 
@@ -133,3 +250,17 @@ do
   print( pcall( stkex.somefunc, nil, nil, nil ) )
 end
 
+
+do
+  print( ("="):rep( 70 ) )
+  print( "[ cppex test ]" )
+  local c = cppex.newcounter( "counter", 10 )
+  print( c, c:getname(), c:value() )
+  c:inc()
+  c:inc( 5 )
+  local c2 = cppex.copy( c )
+  c:inc()
+  print( c:value(), c2:value(), c2:getname() )
+  print( pcall( cppex.copy, {} ) )
+end
+
@@ -6,6 +6,7 @@
  */
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -39,6 +40,31 @@ typedef struct moon_object_vcheck_ {
 } moon_object_vcheck_;
 
 
+/* Validity record of objects created via `moon_newfield_epoch`: The
+ * object is valid as long as the flags at `flagsp` (usually the ones
+ * of the outermost parent object) have the `MOON_OBJECT_IS_VALID` bit
+ * set, and the generation counter `*epochp` (if any) still has the
+ * value it had when the object was created. Nested objects copy the
+ * record of their parent, so the check doesn't depend on the nesting
+ * depth. The embedded vcheck node is used for parents with vcheck
+ * chains, and it makes those objects usable as parents for objects
+ * created via `moon_newfield`. */
+typedef struct {
+  moon_object_vcheck_ vc; /* must be first! */
+  unsigned char const* flagsp;
+  unsigned const* epochp;
+  unsigned epoch;
+} moon_object_epoch_;
+
+/* internal flag for objects with a `moon_object_epoch_` record */
+#define MOON_OBJECT_HAS_EPOCH_ 0x80u
+/* internal flag for views of read-only memory (e.g. the elements of
+ * read-only mapped arrays), fields can't be assigned via those */
+#define MOON_OBJECT_IS_READONLY_ 0x40u
+
+static int moon_epoch_valid_( void* p );
+
+
 /* For keeping memory consumption as low as possible multiple C
  * values might be stored side-by-side in the same memory block, and
  * we have to figure out the alignment to use for those values. */
@@ -91,20 +117,84 @@ struct moon_alignof_struct_ {
 #define MOON_PTR_ALIGNMENT_ MOON_ALIGNOF_( void* )
 #define MOON_GCF_ALIGNMENT_ MOON_ALIGNOF_( moon_object_destructor )
 #define MOON_VCK_ALIGNMENT_ MOON_ALIGNOF_( moon_object_vcheck_ )
+#define MOON_EPC_ALIGNMENT_ MOON_ALIGNOF_( moon_object_epoch_ )
 #define MOON_ROUNDTO_( _s, _a ) ((((_s)+(_a)-1)/(_a))*(_a))
 #define MOON_PTR_( _p, _o ) ((void*)(((char*)(_p))+(_o)))
 
 
+/* On Lua 5.4 objects created via `moon_newfield` keep a reference to
+ * their parent in a dedicated user value instead of a separate
+ * uservalue table. The first user value stays available for the
+ * user (`moon_setuvfield` and friends). */
+#if LUA_VERSION_NUM >= 504
+#  define MOON_PARENT_UV_ 2
+/* Objects of types with embedded object fields (see `moon_deffields`)
+ * get one more user value per such field, which caches the view of
+ * that field. */
+#  define MOON_VIEW_UV_( _k ) (MOON_PARENT_UV_+(_k))
+#endif
+
+
+/* Per-type counters for instrumented builds (see `moon_stats`). */
+#ifdef MOON_STATS
+#  define MOON_STATS_NEWOBJECT_       0
+#  define MOON_STATS_NEWPOINTER_      1
+#  define MOON_STATS_NEWFIELD_        2
+#  define MOON_STATS_NEWPOOLED_       3
+#  define MOON_STATS_CHECK_DIRECT_    4
+#  define MOON_STATS_CHECK_CAST_      5
+#  define MOON_STATS_CHECK_FAIL_      6
+#  define MOON_STATS_VCHECK_          7
+#  define MOON_STATS_VCHECK_FAIL_     8
+#  define MOON_STATS_KILL_            9
+#  define MOON_STATS_GC_             10
+#  define MOON_STATS_INDEX_METHOD_   11
+#  define MOON_STATS_INDEX_FIELD_    12
+#  define MOON_STATS_INDEX_PROPERTY_ 13
+#  define MOON_STATS_INDEX_FALLBACK_ 14
+#  define MOON_STATS_INDEX_NONE_     15
+#  define MOON_STATS_N_              16
+static char const* const moon_stats_names_[ MOON_STATS_N_ ] = {
+  "newobject", "newpointer", "newfield", "newpooled",
+  "check_direct", "check_cast", "check_fail",
+  "vcheck", "vcheck_fail", "kill", "gc",
+  "index_method", "index_field", "index_property",
+  "index_fallback", "index_none"
+};
+/* defined below (they need the type registry) */
+static void moon_stats_count_( lua_State* L, int idx, int c );
+static void moon_stats_count_uv_( lua_State* L, int uv, int c );
+static void moon_stats_fail_( lua_State* L, char const* tname );
+/* The __gc metamethod and the __index dispatchers get the type
+ * registry as an upvalue, so that they can count per type without
+ * looking at the metatable of the object. */
+#  define MOON_STATS_INDEX_UV_ 7
+#  define MOON_STATS_ADD_( _ti, _c, _n ) \
+  ((_ti) != NULL ? (void)((_ti)->stats[ (_c) ] += (_n)) : (void)0)
+#else
+#  define MOON_STATS_ADD_( _ti, _c, _n ) ((void)(_ti))
+#endif
+#define MOON_STAT_( _ti, _c ) MOON_STATS_ADD_( _ti, _c, 1 )
+
+
 /* Raise properly formatted argument error messages. */
 static int moon_type_error_( lua_State* L, int i, char const* t1,
                              char const* t2 ) {
-  char const* msg = lua_pushfstring( L, "%s expected, got %s", t1, t2 );
+  char const* msg = NULL;
+#ifdef MOON_STATS
+  moon_stats_fail_( L, t1 );
+#endif
+  msg = lua_pushfstring( L, "%s expected, got %s", t1, t2 );
   return luaL_argerror( L, i, msg );
 }
 
 static int moon_type_error_invalid_( lua_State* L, int i,
                                      char const* tname ) {
-  char const* msg = lua_pushfstring( L, "invalid '%s' object", tname );
+  char const* msg = NULL;
+#ifdef MOON_STATS
+  moon_stats_fail_( L, tname );
+#endif
+  msg = lua_pushfstring( L, "invalid '%s' object", tname );
   return luaL_argerror( L, i, msg );
 }
 
@@ -164,18 +254,379 @@ static void moon_object_run_destructor_( moon_object_header* h ) {
 MOON_LLINKAGE_BEGIN
 static int moon_object_default_gc_( lua_State* L ) {
   moon_object_header* h = (moon_object_header*)lua_touserdata( L, 1 );
+#ifdef MOON_STATS
+  if( h->cleanup_offset > 0 && (h->flags & MOON_OBJECT_IS_VALID) )
+    moon_stats_count_uv_( L, lua_upvalueindex( 1 ), MOON_STATS_GC_ );
+#endif
   moon_object_run_destructor_( h );
   return 0;
 }
 MOON_LLINKAGE_END
 
 
+/* Some field types for `moon_deffields` need the exact-width integer
+ * types, which are not available in C89. */
+#if (defined( __STDC_VERSION__ ) && __STDC_VERSION__ >= 199901L) || \
+    (defined( __cplusplus ) && __cplusplus >= 201103L) || \
+    (defined( _MSC_VER ) && _MSC_VER >= 1600) || defined( __GNUC__ )
+#  include <stdint.h>
+#  define MOON_HAVE_STDINT_
+#endif
+
+/* The array kernels have SSE2 versions for double fields on x86
+ * platforms that always have SSE2. */
+#if !defined( MOON_NO_SIMD ) && \
+    (defined( __SSE2__ ) || defined( _M_X64 ) || \
+     (defined( _M_IX86_FP ) && _M_IX86_FP >= 2))
+#  include <emmintrin.h>
+#  define MOON_HAVE_SSE2_
+/* GCC-compatible compilers can additionally build AVX2 versions of
+ * the kernels for `double`, `float`, and `int` fields, which are
+ * selected at runtime if the CPU supports AVX2. */
+#  if defined( __GNUC__ ) && \
+      (defined( __x86_64__ ) || defined( __i386__ ))
+#    include <immintrin.h>
+#    define MOON_HAVE_AVX2_
+#  endif
+#endif
+
+/* `moon_maparray` needs POSIX `mmap` */
+#if !defined( MOON_NO_MMAP ) && \
+    (defined( unix ) || defined( __unix ) || defined( __unix__ ) || \
+     (defined( __APPLE__ ) && defined( __MACH__ )) || \
+     defined( HAVE_UNISTD_H ))
+#  include <unistd.h>
+#  if (defined( _POSIX_VERSION ) && _POSIX_VERSION >= 200112L) || \
+      defined( HAVE_SYS_MMAN_H )
+#    include <sys/types.h>
+#    include <sys/stat.h>
+#    include <sys/mman.h>
+#    include <fcntl.h>
+#    include <errno.h>
+#    define MOON_HAVE_MMAP_
+#  endif
+#endif
+
+/* largest value of type lua_Integer (without overflow) */
+#define MOON_INTEGER_MAX_ \
+  ((((lua_Integer)1 << (sizeof( lua_Integer )*CHAR_BIT-2)) - 1)*2 + 1)
+#define MOON_INTEGER_MIN_ (-MOON_INTEGER_MAX_-1)
+
+
+/* Compiled version of a `moon_object_field` as stored in the fields
+ * table of the __index/__newindex dispatchers. */
+typedef struct {
+  moon_object_type* owner;
+  moon_object_type* type; /* for MOON_FIELD_OBJECT */
+  size_t size; /* size of the nested object */
+  size_t offset;
+  lua_Integer low;
+  lua_Integer high;
+  size_t epoch; /* offset+1 of the generation counter (or 0) */
+  unsigned kind;
+  unsigned short tid; /* type ID of `type` */
+  unsigned short view; /* cache slot for the view (see below) */
+} moon_field_;
+
+
+static void** moon_newfield_epoch_t_( lua_State* L, moon_object_type* t,
+                                      int idx, unsigned const* epochp );
+static int moon_validate_( moon_object_header const* h );
+static int moon_pushuvtable_( lua_State* L, int i );
+
+
+/* Pushes the cached view for the embedded object field `f` of the
+ * object at index 1 (or nil). On Lua 5.4 the views are kept in
+ * private user values of the parent (one per field, so they are only
+ * missing for objects created before `moon_deffields` was called).
+ * Older Lua versions only have one uservalue per userdata, so the
+ * views are stored in the uservalue table using the (light userdata)
+ * address of the field descriptor as key. */
+static void moon_field_getview_( lua_State* L, moon_field_ const* f ) {
+#ifdef MOON_VIEW_UV_
+  lua_getiuservalue( L, 1, MOON_VIEW_UV_( f->view ) );
+#else
+#  if LUA_VERSION_NUM < 502
+  lua_getfenv( L, 1 );
+#  else
+  lua_getuservalue( L, 1 );
+#  endif
+  if( lua_istable( L, -1 ) ) {
+    lua_pushlightuserdata( L, (void*)f );
+    lua_rawget( L, -2 );
+    lua_replace( L, -2 );
+  } else {
+    lua_pop( L, 1 );
+    lua_pushnil( L );
+  }
+#endif
+}
+
+
+/* Caches the view at the top of the Lua stack (without popping it). */
+static void moon_field_setview_( lua_State* L, moon_field_ const* f ) {
+#ifdef MOON_VIEW_UV_
+  lua_pushvalue( L, -1 );
+  /* fails (but pops anyway) if the object has no slot for it */
+  lua_setiuservalue( L, 1, MOON_VIEW_UV_( f->view ) );
+#else
+  if( moon_pushuvtable_( L, 1 ) ) {
+    lua_pushlightuserdata( L, (void*)f );
+    lua_pushvalue( L, -3 );
+    lua_rawset( L, -3 );
+  }
+  lua_pop( L, 1 );
+#endif
+}
+
+
+/* Pushes the view for an embedded object field of the moon object at
+ * index 1 (whose memory starts at `base`). The views are cached in the
+ * parent, and are replaced when they become invalid (e.g. because
+ * they have been killed, or because the generation counter of the
+ * field was incremented), or when they refer to different memory
+ * (e.g. because the parent is a pointer that has been rebound). */
+static void moon_field_view_( lua_State* L, moon_field_ const* f,
+                              char* base ) {
+  char* p = base + f->offset;
+  unsigned const* epochp = NULL;
+  moon_object_header* h = NULL;
+  if( f->epoch > 0 )
+    epochp = (unsigned const*)(base + f->epoch - 1);
+  luaL_checkstack( L, 4, "moon_field_view_" );
+  moon_field_getview_( L, f );
+  h = (moon_object_header*)lua_touserdata( L, -1 );
+  if( h != NULL && (h->flags & MOON_OBJECT_IS_VALID) &&
+      h->type_id == f->tid &&
+      *(void**)MOON_PTR_( h, h->object_offset ) == p &&
+      moon_validate_( h ) )
+    return;
+  lua_pop( L, 1 );
+  *moon_newfield_epoch_t_( L, f->type, 1, epochp ) = p;
+  if( ((moon_object_header*)lua_touserdata( L, 1 ))->flags &
+      MOON_OBJECT_IS_READONLY_ )
+    ((moon_object_header*)lua_touserdata( L, -1 ))->flags |=
+      MOON_OBJECT_IS_READONLY_;
+  moon_field_setview_( L, f );
+}
+
+
+/* Pushes the value of a non-object field of type `kind` at `p`. */
+static void moon_field_push_( lua_State* L, unsigned kind,
+                              char const* p ) {
+  switch( kind & ~MOON_FIELD_READONLY ) {
+#ifdef MOON_HAVE_STDINT_
+    case MOON_FIELD_INT8:
+      lua_pushinteger( L, *(int8_t const*)p ); break;
+    case MOON_FIELD_UINT8:
+      lua_pushinteger( L, *(uint8_t const*)p ); break;
+    case MOON_FIELD_INT16:
+      lua_pushinteger( L, *(int16_t const*)p ); break;
+    case MOON_FIELD_UINT16:
+      lua_pushinteger( L, *(uint16_t const*)p ); break;
+    case MOON_FIELD_INT32:
+      lua_pushinteger( L, (lua_Integer)*(int32_t const*)p ); break;
+    case MOON_FIELD_UINT32:
+      lua_pushinteger( L, (lua_Integer)*(uint32_t const*)p ); break;
+    case MOON_FIELD_INT64:
+      lua_pushinteger( L, (lua_Integer)*(int64_t const*)p ); break;
+    case MOON_FIELD_UINT64:
+      if( *(uint64_t const*)p > (uint64_t)MOON_INTEGER_MAX_ )
+        lua_pushnumber( L, (lua_Number)*(uint64_t const*)p );
+      else
+        lua_pushinteger( L, (lua_Integer)*(uint64_t const*)p );
+      break;
+#endif
+    case MOON_FIELD_INT:
+      lua_pushinteger( L, *(int const*)p ); break;
+    case MOON_FIELD_FLOAT:
+      lua_pushnumber( L, *(float const*)p ); break;
+    case MOON_FIELD_DOUBLE:
+      lua_pushnumber( L, *(double const*)p ); break;
+    case MOON_FIELD_BOOL:
+      lua_pushboolean( L, *(unsigned char const*)p ); break;
+    case MOON_FIELD_POINTER:
+      if( *(void* const*)p != NULL )
+        lua_pushlightuserdata( L, *(void* const*)p );
+      else
+        lua_pushnil( L );
+      break;
+  }
+}
+
+
+/* Pushes the value of a field of the moon object at index 1. */
+static void moon_field_get_( lua_State* L, moon_field_ const* f ) {
+  char* base = (char*)moon_checkobject_t( L, 1, f->owner );
+  if( (f->kind & ~MOON_FIELD_READONLY) == MOON_FIELD_OBJECT )
+    moon_field_view_( L, f, base );
+  else
+    moon_field_push_( L, f->kind, base + f->offset );
+}
+
+
+/* Assigns the value at index `idx` to a non-object field of type
+ * `kind` at `p` (integers must be in the range `low` to `high`). */
+static void moon_field_store_( lua_State* L, unsigned kind, char* p,
+                               int idx, lua_Integer low,
+                               lua_Integer high ) {
+  lua_Integer i = 0;
+  switch( kind ) {
+#ifdef MOON_HAVE_STDINT_
+    case MOON_FIELD_INT8:
+    case MOON_FIELD_UINT8:
+    case MOON_FIELD_INT16:
+    case MOON_FIELD_UINT16:
+    case MOON_FIELD_INT32:
+    case MOON_FIELD_UINT32:
+    case MOON_FIELD_INT64:
+    case MOON_FIELD_UINT64:
+#endif
+    case MOON_FIELD_INT:
+      i = moon_checkint( L, idx, low, high );
+      break;
+  }
+  switch( kind ) {
+#ifdef MOON_HAVE_STDINT_
+    case MOON_FIELD_INT8:
+      *(int8_t*)p = (int8_t)i; break;
+    case MOON_FIELD_UINT8:
+      *(uint8_t*)p = (uint8_t)i; break;
+    case MOON_FIELD_INT16:
+      *(int16_t*)p = (int16_t)i; break;
+    case MOON_FIELD_UINT16:
+      *(uint16_t*)p = (uint16_t)i; break;
+    case MOON_FIELD_INT32:
+      *(int32_t*)p = (int32_t)i; break;
+    case MOON_FIELD_UINT32:
+      *(uint32_t*)p = (uint32_t)i; break;
+    case MOON_FIELD_INT64:
+      *(int64_t*)p = (int64_t)i; break;
+    case MOON_FIELD_UINT64:
+      *(uint64_t*)p = (uint64_t)i; break;
+#endif
+    case MOON_FIELD_INT:
+      *(int*)p = (int)i; break;
+    case MOON_FIELD_FLOAT:
+      *(float*)p = (float)luaL_checknumber( L, idx ); break;
+    case MOON_FIELD_DOUBLE:
+      *(double*)p = (double)luaL_checknumber( L, idx ); break;
+    case MOON_FIELD_BOOL:
+      *(unsigned char*)p = (unsigned char)lua_toboolean( L, idx ); break;
+    case MOON_FIELD_POINTER:
+      if( lua_isnil( L, idx ) )
+        *(void**)p = NULL;
+      else if( lua_islightuserdata( L, idx ) )
+        *(void**)p = lua_touserdata( L, idx );
+      else
+        moon_type_error_( L, idx, "lightuserdata",
+                          luaL_typename( L, idx ) );
+      break;
+  }
+}
+
+
+/* Assigns the value at index 3 to a field of the moon object at
+ * index 1. */
+static void moon_field_set_( lua_State* L, moon_field_ const* f ) {
+  char* p = (char*)moon_checkobject_t( L, 1, f->owner ) + f->offset;
+  if( (f->kind & MOON_FIELD_READONLY) ||
+      (((moon_object_header*)lua_touserdata( L, 1 ))->flags &
+       MOON_OBJECT_IS_READONLY_) )
+    luaL_error( L, "attempt to set read-only field '%s'",
+                lua_tostring( L, 2 ) );
+  if( f->kind == MOON_FIELD_OBJECT )
+    memmove( p, moon_checkobject_t( L, 3, f->type ), f->size );
+  else
+    moon_field_store_( L, f->kind, p, 3, f->low, f->high );
+}
+
+
+/* Natural value range for the integer field types. */
+static int moon_field_range_( unsigned kind, lua_Integer* low,
+                              lua_Integer* high ) {
+  switch( kind & ~MOON_FIELD_READONLY ) {
+#ifdef MOON_HAVE_STDINT_
+    case MOON_FIELD_INT8:
+      *low = INT8_MIN; *high = INT8_MAX; break;
+    case MOON_FIELD_UINT8:
+      *low = 0; *high = UINT8_MAX; break;
+    case MOON_FIELD_INT16:
+      *low = INT16_MIN; *high = INT16_MAX; break;
+    case MOON_FIELD_UINT16:
+      *low = 0; *high = UINT16_MAX; break;
+    case MOON_FIELD_INT32:
+      *low = INT32_MIN > MOON_INTEGER_MIN_ ? INT32_MIN : MOON_INTEGER_MIN_;
+      *high = INT32_MAX < MOON_INTEGER_MAX_ ? INT32_MAX : MOON_INTEGER_MAX_;
+      break;
+    case MOON_FIELD_UINT32:
+      *low = 0;
+      *high = (uint64_t)UINT32_MAX < (uint64_t)MOON_INTEGER_MAX_ ?
+              (lua_Integer)UINT32_MAX : MOON_INTEGER_MAX_;
+      break;
+    case MOON_FIELD_INT64:
+      *low = MOON_INTEGER_MIN_; *high = MOON_INTEGER_MAX_; break;
+    case MOON_FIELD_UINT64:
+      *low = 0; *high = MOON_INTEGER_MAX_; break;
+#endif
+    case MOON_FIELD_INT:
+      *low = INT_MIN > MOON_INTEGER_MIN_ ? INT_MIN : MOON_INTEGER_MIN_;
+      *high = INT_MAX < MOON_INTEGER_MAX_ ? INT_MAX : MOON_INTEGER_MAX_;
+      break;
+    case MOON_FIELD_FLOAT:
+    case MOON_FIELD_DOUBLE:
+    case MOON_FIELD_BOOL:
+    case MOON_FIELD_POINTER:
+    case MOON_FIELD_OBJECT:
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+
+/* A compiled __index dispatcher (see moon_compileindex) merges the
+ * methods, fields, and properties of a type into a single perfect
+ * hash table keyed by the addresses of the (interned) key strings, so
+ * that every lookup of an interned key string needs exactly one probe
+ * and one pointer compare. The keys and values are kept alive in a
+ * separate Lua table, which also maps the key strings to their slots
+ * in the hash for keys that can't be found by address. The tags are
+ * also used as return values of the __index dispatchers. */
+#define MOON_DISPATCH_METHOD_    1u
+#define MOON_DISPATCH_FIELD_     2u
+#define MOON_DISPATCH_PROPERTY_  3u
+#define MOON_DISPATCH_FUNCTION_  4u
+
+typedef struct {
+  char const* key; /* NULL for empty slots */
+  moon_field_ const* field;
+  int value; /* index of the value in the values table */
+  unsigned tag;
+} moon_dispatch_entry_;
+
+typedef struct {
+  size_t mask;
+  size_t seed;
+  moon_dispatch_entry_ e[ 1 ];
+} moon_dispatch_hash_;
+
+
+/* Lua has already hashed (and interned) the key string, so only its
+ * address is mixed with the seed. */
+static size_t moon_dispatch_hashstr_( char const* s, size_t seed ) {
+  size_t h = ((size_t)s >> 3) * (2654435761u + 2*seed);
+  return h ^ (h >> 15);
+}
+
+
 static int moon_index_dispatch_methods_( lua_State* L ) {
   if( lua_type( L, lua_upvalueindex( 1 ) ) == LUA_TTABLE ) {
     lua_pushvalue( L, 2 ); /* duplicate key */
     lua_rawget( L, lua_upvalueindex( 1 ) );
     if( !lua_isnil( L, -1 ) )
-      return 1;
+      return MOON_DISPATCH_METHOD_;
     lua_pop( L, 1 );
   }
   return 0;
@@ -189,7 +640,7 @@ static int moon_index_dispatch_properties_( lua_State* L ) {
     if( !lua_isnil( L, -1 ) ) {
       lua_pushvalue( L, 1 );
       lua_call( L, 1, 1 );
-      return 1;
+      return MOON_DISPATCH_PROPERTY_;
     }
     lua_pop( L, 1 );
   }
@@ -197,13 +648,74 @@ static int moon_index_dispatch_properties_( lua_State* L ) {
 }
 
 
+static int moon_index_dispatch_fields_( lua_State* L ) {
+  if( lua_type( L, lua_upvalueindex( 4 ) ) == LUA_TTABLE ) {
+    moon_field_ const* f = NULL;
+    lua_pushvalue( L, 2 ); /* duplicate key */
+    lua_rawget( L, lua_upvalueindex( 4 ) );
+    f = (moon_field_ const*)lua_touserdata( L, -1 );
+    lua_pop( L, 1 );
+    if( f != NULL ) {
+      moon_field_get_( L, f );
+      return MOON_DISPATCH_FIELD_;
+    }
+  }
+  return 0;
+}
+
+
+/* Returns the tag of the hash entry for the key at index 2, 0 if the
+ * key isn't in the hash, or -1 if the key isn't a string. Strings
+ * that miss the hash may still be keys that just aren't interned (long
+ * strings), so they are looked up in the values table. Only if the
+ * length limit for interned strings of the Lua build is visible, and
+ * the key is within that limit, a miss is final. */
+static int moon_index_dispatch_hash_( lua_State* L ) {
+  moon_dispatch_hash_ const* dh = (moon_dispatch_hash_ const*)
+    lua_touserdata( L, lua_upvalueindex( 5 ) );
+  if( lua_type( L, 2 ) == LUA_TSTRING ) {
+    size_t len = 0;
+    char const* s = lua_tolstring( L, 2, &len );
+    moon_dispatch_entry_ const* e = dh->e +
+      (moon_dispatch_hashstr_( s, dh->seed ) & dh->mask);
+    if( e->key != s ) {
+      size_t i = 0;
+#ifdef LUAI_MAXSHORTLEN
+      if( len <= LUAI_MAXSHORTLEN )
+        return 0;
+#else
+      (void)len;
+#endif
+      lua_pushvalue( L, 2 ); /* duplicate key */
+      lua_rawget( L, lua_upvalueindex( 6 ) );
+      i = (size_t)lua_tointeger( L, -1 );
+      lua_pop( L, 1 );
+      if( i == 0 )
+        return 0;
+      e = dh->e + (i-1);
+    }
+    if( e->tag == MOON_DISPATCH_FIELD_ )
+      moon_field_get_( L, e->field );
+    else {
+      lua_rawgeti( L, lua_upvalueindex( 6 ), e->value );
+      if( e->tag == MOON_DISPATCH_PROPERTY_ ) {
+        lua_pushvalue( L, 1 );
+        lua_call( L, 1, 1 );
+      }
+    }
+    return (int)e->tag;
+  }
+  return -1;
+}
+
+
 static int moon_index_dispatch_function_( lua_State* L ) {
   if( lua_type( L, lua_upvalueindex( 3 ) ) == LUA_TFUNCTION ) {
     lua_pushvalue( L, lua_upvalueindex( 3 ) );
     lua_pushvalue( L, 1 );
     lua_pushvalue( L, 2 );
     lua_call( L, 2, 1 );
-    return 1;
+    return MOON_DISPATCH_FUNCTION_;
   }
   return 0;
 }
@@ -226,6 +738,22 @@ static int moon_newindex_dispatch_properties_( lua_State* L ) {
 }
 
 
+static int moon_newindex_dispatch_fields_( lua_State* L ) {
+  if( lua_type( L, lua_upvalueindex( 3 ) ) == LUA_TTABLE ) {
+    moon_field_ const* f = NULL;
+    lua_pushvalue( L, 2 ); /* duplicate key */
+    lua_rawget( L, lua_upvalueindex( 3 ) );
+    f = (moon_field_ const*)lua_touserdata( L, -1 );
+    lua_pop( L, 1 );
+    if( f != NULL ) {
+      moon_field_set_( L, f );
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
 static int moon_newindex_dispatch_function_( lua_State* L ) {
   if( lua_type( L, lua_upvalueindex( 2 ) ) == LUA_TFUNCTION ) {
     lua_pushvalue( L, lua_upvalueindex( 2 ) );
@@ -239,20 +767,36 @@ static int moon_newindex_dispatch_function_( lua_State* L ) {
 }
 
 
-/* Check the methods and properties tables for a given key and then
- * (if unsuccessful) call the registered C function for looking up
- * properties. */
+/* Check the methods, fields, and properties tables for a given key
+ * and then (if unsuccessful) call the registered C function for
+ * looking up properties. Compiled dispatchers check the perfect hash
+ * instead of the tables. Only keys that aren't strings (and thus
+ * aren't in the hash) still use the tables. */
 MOON_LLINKAGE_BEGIN
 static int moon_index_dispatch_( lua_State* L ) {
-  if( !moon_index_dispatch_methods_( L ) &&
-      !moon_index_dispatch_properties_( L ) &&
-      !moon_index_dispatch_function_( L ) )
+  int r = -1;
+  if( lua_type( L, lua_upvalueindex( 5 ) ) == LUA_TUSERDATA )
+    r = moon_index_dispatch_hash_( L );
+  if( r < 0 ) {
+    if( !(r = moon_index_dispatch_methods_( L )) &&
+        !(r = moon_index_dispatch_fields_( L )) &&
+        !(r = moon_index_dispatch_properties_( L )) )
+      r = moon_index_dispatch_function_( L );
+  } else if( r == 0 )
+    r = moon_index_dispatch_function_( L );
+  if( r == 0 )
     lua_pushnil( L );
+#ifdef MOON_STATS
+  moon_stats_count_uv_( L, lua_upvalueindex( MOON_STATS_INDEX_UV_ ),
+                        r == 0 ? MOON_STATS_INDEX_NONE_ :
+                                 MOON_STATS_INDEX_METHOD_ + r - 1 );
+#endif
   return 1;
 }
 
 static int moon_newindex_dispatch_( lua_State* L ) {
-  if( !moon_newindex_dispatch_properties_( L ) &&
+  if( !moon_newindex_dispatch_fields_( L ) &&
+      !moon_newindex_dispatch_properties_( L ) &&
       !moon_newindex_dispatch_function_( L ) )
     luaL_error( L, "attempt to set invalid field" );
   return 0;
@@ -285,11 +829,31 @@ static lua_CFunction moon_getf_( lua_State* L, char const* name,
 }
 
 
+#ifdef MOON_STATS
+static struct moon_types_* moon_types_push_( lua_State* L );
+#endif
+
+/* Creates an __index dispatcher closure from the `n` upvalues at the
+ * top of the stack. Instrumented builds add the type registry (see
+ * MOON_STATS_INDEX_UV_). */
+static void moon_pushindex_( lua_State* L, lua_CFunction dispatch,
+                             int n ) {
+#ifdef MOON_STATS
+  luaL_checkstack( L, MOON_STATS_INDEX_UV_+3, "moon_pushindex_" );
+  for( ; n < MOON_STATS_INDEX_UV_-1; ++n )
+    lua_pushnil( L );
+  moon_types_push_( L );
+  ++n;
+#endif
+  lua_pushcclosure( L, dispatch, n );
+}
+
+
 static void moon_pushreg_( lua_State* L, luaL_Reg const funcs[],
-                           int (*predicate)( char const* ),
+                           int (*predicate)( char const* ), int n,
                            int nups, int firstupvalue, int skip ) {
   if( funcs != NULL ) {
-    lua_newtable( L );
+    lua_createtable( L, 0, n );
     for( ; funcs->func; ++funcs ) {
       if( predicate( funcs->name ) ) {
         int i = 0;
@@ -319,13 +883,16 @@ static void moon_pushfunction_( lua_State* L, lua_CFunction func,
 
 /* Depending on the availability of a methods table and/or a C
  * function for looking up properties this function creates an __index
- * metamethod (function or table). */
+ * metamethod (function or table). `nmethods` and `nproperties` are
+ * only used to presize the tables. */
 static void moon_makeindex_( lua_State* L, luaL_Reg const methods[],
                              luaL_Reg const properties[],
-                             lua_CFunction pindex, int nups ) {
+                             lua_CFunction pindex, int nups,
+                             int nmethods, int nproperties ) {
   int firstupvalue = lua_gettop( L ) + 1 - nups;
   if( !properties && !pindex ) { /* methods only (maybe) */
-    moon_pushreg_( L, methods, moon_is_method, nups, firstupvalue, 0 );
+    moon_pushreg_( L, methods, moon_is_method, nmethods,
+                   nups, firstupvalue, 0 );
     if( nups > 0 ) {
       lua_replace( L, firstupvalue );
       lua_pop( L, nups-1 );
@@ -334,10 +901,12 @@ static void moon_makeindex_( lua_State* L, luaL_Reg const methods[],
     lua_pushcclosure( L, pindex, nups );
   } else {
     lua_CFunction dispatch = moon_getf_( L, "index", moon_index_dispatch_ );
-    moon_pushreg_( L, methods, moon_is_method, nups, firstupvalue, 0 );
-    moon_pushreg_( L, properties, moon_is_property, nups, firstupvalue, 1 );
+    moon_pushreg_( L, methods, moon_is_method, nmethods,
+                   nups, firstupvalue, 0 );
+    moon_pushreg_( L, properties, moon_is_property, nproperties,
+                   nups, firstupvalue, 1 );
     moon_pushfunction_( L, pindex, nups, firstupvalue );
-    lua_pushcclosure( L, dispatch, 3 );
+    moon_pushindex_( L, dispatch, 3 );
     if( nups > 0 ) {
       lua_replace( L, firstupvalue );
       lua_pop( L, nups-1 );
@@ -347,7 +916,8 @@ static void moon_makeindex_( lua_State* L, luaL_Reg const methods[],
 
 
 static void moon_makenewindex_( lua_State* L, luaL_Reg const properties[],
-                                lua_CFunction pnewindex, int nups ) {
+                                lua_CFunction pnewindex, int nups,
+                                int nproperties ) {
   if( !properties && !pnewindex ) {
     lua_pop( L, nups );
     lua_pushnil( L );
@@ -356,7 +926,8 @@ static void moon_makenewindex_( lua_State* L, luaL_Reg const properties[],
   } else {
     int firstupvalue = lua_gettop( L ) + 1 - nups;
     lua_CFunction dispatch = moon_getf_( L, "newindex", moon_newindex_dispatch_ );
-    moon_pushreg_( L, properties, moon_is_property, nups, firstupvalue, 1 );
+    moon_pushreg_( L, properties, moon_is_property, nproperties,
+                   nups, firstupvalue, 1 );
     moon_pushfunction_( L, pnewindex, nups, firstupvalue );
     lua_pushcclosure( L, dispatch, 2 );
     if( nups > 0 ) {
@@ -375,159 +946,1305 @@ static void moon_check_tname_( lua_State* L, char const* tname ) {
 }
 
 
-MOON_API void moon_defobject( lua_State* L, char const* tname,
-                              size_t sz, luaL_Reg const* methods,
-                              int nups ) {
-  int has_methods = 0;
-  int has_properties = 0;
-  lua_CFunction index = 0;
-  lua_CFunction newindex = 0;
-  moon_check_tname_( L, tname );
-  luaL_checkstack( L, 2*nups+4, "moon_defobject" );
-  /* we don't use luaL_newmetatable to make sure that we never have a
-   * half-constructed metatable in the registry! */
-  luaL_getmetatable( L, tname );
-  if( !lua_isnil( L, -1 ) )
-    luaL_error( L, "type '%s' is already defined", tname );
-  lua_pop( L, 1 );
-  lua_newtable( L );
-  lua_pushstring( L, tname );
-  lua_pushcclosure( L, moon_object_default_tostring_, 1 );
-  lua_setfield( L, -2, "__tostring" );
-  if( methods != NULL ) {
-    luaL_Reg const* l = methods;
-    int i = 0;
-    for( ; l->func != NULL; ++l ) {
-      if( moon_is_meta( l->name ) ) {
-        int is_index = 0 == strcmp( l->name+2, "index" );
-        int is_newindex = 0 == strcmp( l->name+2, "newindex" );
-        if( !is_index && !is_newindex ) {
-          for( i = 0; i < nups; ++i )
-            lua_pushvalue( L, -nups-1 );
-          lua_pushcclosure( L, l->func, nups );
-          lua_setfield( L, -2, l->name );
-        } else if( is_index ) /* handle __index later */
-          index = l->func;
-        else /* handle __newindex later */
-          newindex = l->func;
-      } else if( moon_is_property( l->name ) ) {
-        has_properties = 1;
-      } else
-        has_methods = 1;
-    }
-  }
-  if( has_methods || has_properties || index ) {
-    int i = 0;
-    for( i = 0; i < nups; ++i )
-      lua_pushvalue( L, -nups-1 );
-    moon_makeindex_( L, has_methods ? methods : NULL,
-                        has_properties ? methods : NULL, index, nups );
-    lua_setfield( L, -2, "__index" );
-  }
-  if( has_properties || newindex ) {
-    int i = 0;
-    for( i = 0; i < nups; ++i )
-      lua_pushvalue( L, -nups-1 );
-    moon_makenewindex_( L, methods, newindex, nups );
-    lua_setfield( L, -2, "__newindex" );
-  }
-  lua_pushboolean( L, 0 );
-  lua_setfield( L, -2, "__metatable" );
-  lua_pushstring( L, tname );
-  lua_setfield( L, -2, "__name" );
-  lua_pushcfunction( L, moon_object_default_gc_ );
-  lua_pushvalue( L, -1);
-  lua_setfield( L, -3, "__gc" );
-  lua_setfield( L, -2, "__close" );
-  lua_pushinteger( L, MOON_VERSION );
-  lua_setfield( L, -2, "__moon_version" );
-  lua_pushinteger( L, (lua_Integer)sz );
-  lua_setfield( L, -2, "__moon_size" );
-  lua_setfield( L, LUA_REGISTRYINDEX, tname );
-  lua_pop( L, nups );
+/* Every moon type gets a small descriptor in a per-state type
+ * registry, so that the hot paths (type checks and casts) can work
+ * without string-keyed table lookups. The `type_id` in the object
+ * header is an index into the descriptor array, and the metatable of
+ * each moon type refers to the type registry in its array part (at
+ * index 1). The is-a bitmap and the cast table are indexed by type
+ * ID as well. The cast table contains the transitive closure of all
+ * registered casts, i.e. a NULL-terminated sequence of cast functions
+ * for every reachable type (or NULL if no cast function needs to be
+ * called). */
+struct moon_types_;
+
+typedef struct {
+  moon_object_cast cast; /* 0 for the identity cast */
+  unsigned short to;
+} moon_typeinfo_edge_;
+
+/* Translates the type IDs of a Lua state into the type IDs of a type
+ * set, for cast tables borrowed from a type set whose IDs differ (see
+ * `moon_deftypes`). */
+typedef struct moon_types_remap_ {
+  struct moon_types_remap_* next;
+  size_t n; /* number of type IDs of the Lua state covered */
+  unsigned short* id; /* type set ID for every type ID, or 0 */
+} moon_types_remap_;
+
+typedef struct moon_typeinfo_ {
+  void const* mt; /* identity of the metatable, NULL if undefined */
+  struct moon_types_* types;
+  char* name;
+  size_t size;
+  moon_object_cast** casts; /* cast chains indexed by type ID */
+  unsigned char* isa; /* bitmap indexed by type ID */
+  size_t ncasts; /* number of type IDs covered by casts/isa */
+  int shared; /* casts/isa are borrowed from a type set */
+  moon_types_remap_ const* remap; /* NULL if the type IDs match */
+  moon_typeinfo_edge_* edges; /* casts registered for this type */
+  size_t nedges;
+  size_t cedges;
+  int mtref; /* reference to the metatable in the registry */
+  unsigned long stamp; /* changes whenever the casts change */
+  struct moon_pool_* pool; /* see moon_defpool */
+#ifdef MOON_STATS
+  unsigned long stats[ MOON_STATS_N_ ];
+#endif
+  unsigned short id;
+  unsigned short nviews; /* number of embedded object fields */
+} moon_typeinfo_;
+
+typedef struct moon_types_ {
+  void const* self; /* to recognize the type registry */
+  int version;
+  lua_Alloc alloc;
+  void* ud;
+  moon_typeinfo_** v; /* indexed by type ID, v[ 0 ] is unused */
+  unsigned short* hash; /* open addressing: name -> type ID */
+  size_t n;
+  size_t cap;
+  size_t hcap;
+  moon_types_remap_* remaps; /* created by `moon_deftypes` */
+} moon_types_;
+
+
+static void* moon_types_realloc_( lua_State* L, moon_types_* t,
+                                  void* p, size_t osz, size_t nsz ) {
+  void* np = t->alloc( t->ud, p, osz, nsz );
+  if( np == NULL && nsz > 0 )
+    luaL_error( L, "memory allocation error" );
+  return np;
 }
 
 
-/* Verify that the value at the stack top is the metatable for a moon
- * object type. */
-static void moon_check_metatable_( lua_State* L, char const* tname ) {
-  if( !lua_istable( L, -1 ) )
-    luaL_error( L, "no metatable for type '%s' defined", tname );
-  lua_getfield( L, -1, "__moon_version" );
-  if( lua_tointeger( L, -1 ) != MOON_VERSION )
-    luaL_error( L, "'%s' is not a moon %d.%d object type", tname,
-                MOON_VERSION_MAJOR, MOON_VERSION_MINOR );
-  lua_pop( L, 1 );
+static size_t moon_cast_chain_len_( moon_object_cast const* c ) {
+  size_t n = 0;
+  if( c != NULL )
+    while( c[ n ] != 0 )
+      ++n;
+  return n;
 }
 
 
-/* Pushes the metatable for the given type onto the Lua stack, and
- * makes sure that the given type is a moon object type. */
-static void moon_push_metatable_( lua_State* L, char const* tname ) {
-  moon_check_tname_( L, tname );
-  luaL_getmetatable( L, tname );
-  moon_check_metatable_( L, tname );
+static void moon_cast_chain_free_( moon_types_* t,
+                                   moon_object_cast* c ) {
+  if( c != NULL )
+    t->alloc( t->ud, c, (moon_cast_chain_len_( c )+1)*sizeof( *c ), 0 );
 }
 
 
-MOON_API void* moon_newobject( lua_State* L, char const* tname,
-                               void (*gc)( void* ) ) {
-  moon_object_header* obj = NULL;
-  size_t off1 = 0;
-#ifdef _MSC_VER
-#  pragma warning(push)
-#  pragma warning(disable: 4116)
-#endif
-  size_t off2 = MOON_ROUNDTO_( sizeof( moon_object_header ),
-                               MOON_OBJ_ALIGNMENT_ );
-  size_t sz = 0;
-  luaL_checkstack( L, 2, "moon_newobject" );
-  moon_push_metatable_( L, tname );
-  lua_getfield( L, -1, "__moon_size" );
-  sz = lua_tointeger( L, -1 );
-  lua_pop( L, 1 );
-  if( sz == 0 )
-    luaL_error( L, "type '%s' is incomplete (size is 0)", tname );
-  if( gc != 0 ) {
-    off1 = MOON_ROUNDTO_( sizeof( moon_object_header ),
-                          MOON_GCF_ALIGNMENT_ );
-    off2 = MOON_ROUNDTO_( off1 + sizeof( moon_object_destructor ),
-                          MOON_OBJ_ALIGNMENT_ );
-#ifdef _MSC_VER
-#  pragma warning(pop)
-#endif
-  }
-  obj = (moon_object_header*)lua_newuserdata( L, sz+off2 );
-  if( off1 > 0 ) {
-    moon_object_destructor* cl = NULL;
-    cl = (moon_object_destructor*)MOON_PTR_( obj, off1 );
-    *cl = gc;
-  }
-  obj->cleanup_offset = off1;
-  obj->object_offset = off2;
-  obj->vcheck_offset = 0;
-  obj->flags = MOON_OBJECT_IS_VALID;
-  lua_insert( L, -2 );
-  lua_setmetatable( L, -2 );
-  return MOON_PTR_( obj, off2 );
+/* Slab allocator for the payloads of pooled moon objects (see
+ * `moon_defpool`). Every slot in a slab starts with a pointer to its
+ * slab, so that the destructor can find the pool without any extra
+ * information in the object header. Slabs with free slots are kept
+ * in a doubly linked list, and empty slabs are returned to the
+ * allocator unless they are the only ones with free slots. */
+typedef struct moon_pool_slab_ {
+  struct moon_pool_* pool;
+  struct moon_pool_slab_* prev; /* list of slabs with free slots */
+  struct moon_pool_slab_* next;
+  struct moon_pool_slab_* aprev; /* list of all slabs */
+  struct moon_pool_slab_* anext;
+  void* free; /* free list of released slots */
+  size_t fresh; /* number of slots never handed out */
+  size_t used;
+} moon_pool_slab_;
+
+typedef struct moon_pool_ {
+  moon_types_* types; /* NULL when the type registry is gone */
+  lua_Alloc alloc;
+  void* ud;
+  moon_object_destructor destructor;
+  size_t elem_size;
+  size_t slot_size;
+  size_t nslots; /* slots per slab */
+  moon_pool_slab_* partial;
+  moon_pool_slab_* slabs;
+  size_t nslabs;
+  size_t used;
+} moon_pool_;
+
+#define MOON_POOL_SLOT_OFFSET_ \
+  MOON_ROUNDTO_( sizeof( moon_pool_slab_* ), MOON_OBJ_ALIGNMENT_ )
+#define MOON_POOL_SLAB_OFFSET_ \
+  MOON_ROUNDTO_( sizeof( moon_pool_slab_ ), MOON_OBJ_ALIGNMENT_ )
+
+
+static size_t moon_pool_slabsize_( moon_pool_ const* pool ) {
+  return MOON_POOL_SLAB_OFFSET_ + pool->nslots * pool->slot_size;
 }
 
 
-MOON_API void** moon_newpointer( lua_State* L, char const* tname,
-                                 void (*gc)( void* ) ) {
-  moon_object_header* obj = NULL;
-  void** p = NULL;
-  size_t off1 = 0;
-#ifdef _MSC_VER
-#  pragma warning(push)
-#  pragma warning(disable: 4116)
-#endif
-  size_t off2 = MOON_ROUNDTO_( sizeof( moon_object_header ),
-                               MOON_PTR_ALIGNMENT_ );
-  luaL_checkstack( L, 2, "moon_newpointer" );
-  moon_push_metatable_( L, tname );
-  if( gc != 0 ) {
-    off1 = MOON_ROUNDTO_( sizeof( moon_object_header ),
+static void moon_pool_unlink_partial_( moon_pool_* pool,
+                                       moon_pool_slab_* s ) {
+  if( s->prev != NULL )
+    s->prev->next = s->next;
+  else
+    pool->partial = s->next;
+  if( s->next != NULL )
+    s->next->prev = s->prev;
+  s->prev = s->next = NULL;
+}
+
+
+static void moon_pool_free_slab_( moon_pool_* pool,
+                                  moon_pool_slab_* s ) {
+  if( s->aprev != NULL )
+    s->aprev->anext = s->anext;
+  else
+    pool->slabs = s->anext;
+  if( s->anext != NULL )
+    s->anext->aprev = s->aprev;
+  pool->nslabs--;
+  pool->alloc( pool->ud, s, moon_pool_slabsize_( pool ), 0 );
+}
+
+
+static void moon_pool_free_( moon_pool_* pool ) {
+  while( pool->slabs != NULL )
+    moon_pool_free_slab_( pool, pool->slabs );
+  pool->alloc( pool->ud, pool, sizeof( *pool ), 0 );
+}
+
+
+/* Called when the type registry is collected. Pools with live
+ * objects are only freed when the last object is gone. */
+static void moon_pool_detach_( moon_pool_* pool ) {
+  if( pool->used == 0 )
+    moon_pool_free_( pool );
+  else
+    pool->types = NULL;
+}
+
+
+static void* moon_pool_alloc_( lua_State* L, moon_pool_* pool ) {
+  moon_pool_slab_* s = pool->partial;
+  void* p = NULL;
+  if( s == NULL ) {
+    s = (moon_pool_slab_*)moon_types_realloc_( L, pool->types, NULL, 0,
+      moon_pool_slabsize_( pool ) );
+    s->pool = pool;
+    s->prev = s->next = NULL;
+    s->aprev = NULL;
+    s->anext = pool->slabs;
+    if( pool->slabs != NULL )
+      pool->slabs->aprev = s;
+    pool->slabs = s;
+    pool->nslabs++;
+    s->free = NULL;
+    s->fresh = pool->nslots;
+    s->used = 0;
+    pool->partial = s;
+  }
+  if( s->free != NULL ) {
+    p = s->free;
+    s->free = *((void**)p);
+  } else {
+    char* slot = (char*)MOON_PTR_( s, MOON_POOL_SLAB_OFFSET_ ) +
+                 (pool->nslots - s->fresh) * pool->slot_size;
+    *((moon_pool_slab_**)slot) = s;
+    p = slot + MOON_POOL_SLOT_OFFSET_;
+    s->fresh--;
+  }
+  s->used++;
+  pool->used++;
+  if( s->used == pool->nslots )
+    moon_pool_unlink_partial_( pool, s );
+  return p;
+}
+
+
+/* Destructor of pooled objects: runs the destructor registered for
+ * the pool and puts the slot back into its slab. */
+static void moon_pool_release_( void* p ) {
+  moon_pool_slab_* s = *((moon_pool_slab_**)((char*)p -
+                                             MOON_POOL_SLOT_OFFSET_));
+  moon_pool_* pool = s->pool;
+  if( pool->destructor != 0 )
+    pool->destructor( p );
+  *((void**)p) = s->free;
+  s->free = p;
+  if( s->used == pool->nslots ) { /* slab has a free slot again */
+    s->prev = NULL;
+    s->next = pool->partial;
+    if( pool->partial != NULL )
+      pool->partial->prev = s;
+    pool->partial = s;
+  }
+  s->used--;
+  pool->used--;
+  if( s->used == 0 && (s->prev != NULL || s->next != NULL) ) {
+    moon_pool_unlink_partial_( pool, s );
+    moon_pool_free_slab_( pool, s );
+  }
+  if( pool->types == NULL && pool->used == 0 )
+    moon_pool_free_( pool );
+}
+
+
+/* Releases the cast chains and the is-a bitmap of `ti` (unless they
+ * are borrowed from a type set). */
+static void moon_typeinfo_freecasts_( moon_types_* t,
+                                      moon_typeinfo_* ti ) {
+  size_t i = 0;
+  if( !ti->shared ) {
+    for( i = 0; i < ti->ncasts; ++i )
+      moon_cast_chain_free_( t, ti->casts[ i ] );
+    t->alloc( t->ud, ti->casts, ti->ncasts*sizeof( *ti->casts ), 0 );
+    t->alloc( t->ud, ti->isa, (ti->ncasts+CHAR_BIT-1)/CHAR_BIT, 0 );
+  }
+  ti->casts = NULL;
+  ti->isa = NULL;
+  ti->ncasts = 0;
+  ti->shared = 0;
+  ti->remap = NULL;
+}
+
+
+static void moon_typeinfo_free_( moon_types_* t, moon_typeinfo_* ti ) {
+  if( ti->pool != NULL )
+    moon_pool_detach_( ti->pool );
+  moon_typeinfo_freecasts_( t, ti );
+  t->alloc( t->ud, ti->edges, ti->cedges*sizeof( *ti->edges ), 0 );
+  t->alloc( t->ud, ti->name, strlen( ti->name )+1, 0 );
+  t->alloc( t->ud, ti, sizeof( *ti ), 0 );
+}
+
+
+static void moon_types_free_( moon_types_* t ) {
+  size_t i = 0;
+  for( i = 1; i < t->n; ++i )
+    moon_typeinfo_free_( t, t->v[ i ] );
+  while( t->remaps != NULL ) {
+    moon_types_remap_* r = t->remaps;
+    t->remaps = r->next;
+    t->alloc( t->ud, r, sizeof( *r ) + r->n*sizeof( *r->id ), 0 );
+  }
+  t->alloc( t->ud, t->v, t->cap*sizeof( *t->v ), 0 );
+  t->alloc( t->ud, t->hash, t->hcap*sizeof( *t->hash ), 0 );
+  t->v = NULL;
+  t->hash = NULL;
+  t->n = t->cap = t->hcap = 0;
+}
+
+
+MOON_LLINKAGE_BEGIN
+static int moon_types_gc_( lua_State* L ) {
+  /* later lookups (e.g. from other finalizers) just fail */
+  moon_types_free_( (moon_types_*)lua_touserdata( L, 1 ) );
+  return 0;
+}
+MOON_LLINKAGE_END
+
+
+/* Returns the type registry at the given stack index, or NULL if
+ * the value isn't a type registry of this moon version. */
+static moon_types_* moon_types_test_( lua_State* L, int i ) {
+  moon_types_* t = (moon_types_*)lua_touserdata( L, i );
+  if( t != NULL && lua_type( L, i ) == LUA_TUSERDATA &&
+#if LUA_VERSION_NUM < 502
+      lua_objlen( L, i ) == sizeof( moon_types_ ) &&
+#else
+      lua_rawlen( L, i ) == sizeof( moon_types_ ) &&
+#endif
+      t->self == t && t->version == MOON_VERSION )
+    return t;
+  return NULL;
+}
+
+
+/* Pushes the type registry for the current Lua state (creating it
+ * if necessary). */
+static moon_types_* moon_types_push_( lua_State* L ) {
+  moon_types_* t = NULL;
+  luaL_checkstack( L, 3, "moon_types_push_" );
+  lua_getfield( L, LUA_REGISTRYINDEX, "__moon_types" );
+  if( lua_isnil( L, -1 ) ) {
+    lua_pop( L, 1 );
+    t = (moon_types_*)lua_newuserdata( L, sizeof( moon_types_ ) );
+    t->self = t;
+    t->version = MOON_VERSION;
+    t->alloc = lua_getallocf( L, &t->ud );
+    t->v = NULL;
+    t->hash = NULL;
+    t->n = t->cap = t->hcap = 0;
+    t->remaps = NULL;
+    lua_newtable( L );
+    lua_pushcfunction( L, moon_types_gc_ );
+    lua_setfield( L, -2, "__gc" );
+    lua_setmetatable( L, -2 );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, "__moon_types" );
+  } else if( (t = moon_types_test_( L, -1 )) == NULL )
+    luaL_error( L, "incompatible moon type registry" );
+  return t;
+}
+
+
+/* Returns a new process-wide stamp for type descriptors. The stamp is
+ * used to validate the contents of `moon_object_cache`s, which might
+ * refer to memory that has been reused for another type descriptor
+ * (e.g. when the Lua state has been closed and a new one created in
+ * the mean time). */
+static unsigned long moon_types_stamp_( void ) {
+  static unsigned long counter = 0;
+#if defined( __GNUC__ ) || defined( __clang__ )
+  unsigned long s = __sync_add_and_fetch( &counter, 1 );
+#else
+  unsigned long s = ++counter;
+#endif
+  return s != 0 ? s : moon_types_stamp_();
+}
+
+
+static size_t moon_types_hashstr_( char const* s ) {
+  size_t h = 2166136261u;
+  for( ; *s != '\0'; ++s )
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+}
+
+
+/* Finds the type ID for a given type name (0 if there is none). */
+static unsigned short moon_types_find_( moon_types_ const* t,
+                                        char const* tname ) {
+  if( t->hcap > 0 ) {
+    size_t i = moon_types_hashstr_( tname ) & (t->hcap-1);
+    for( ; t->hash[ i ] != 0; i = (i+1) & (t->hcap-1) ) {
+      if( 0 == strcmp( t->v[ t->hash[ i ] ]->name, tname ) )
+        return t->hash[ i ];
+    }
+  }
+  return 0;
+}
+
+
+static void moon_types_rehash_( lua_State* L, moon_types_* t,
+                                size_t ncap ) {
+  unsigned short* h = (unsigned short*)
+    moon_types_realloc_( L, t, NULL, 0, ncap*sizeof( *h ) );
+  size_t i = 0;
+  for( i = 0; i < ncap; ++i )
+    h[ i ] = 0;
+  for( i = 1; i < t->n; ++i ) {
+    size_t j = moon_types_hashstr_( t->v[ i ]->name ) & (ncap-1);
+    while( h[ j ] != 0 )
+      j = (j+1) & (ncap-1);
+    h[ j ] = (unsigned short)i;
+  }
+  t->alloc( t->ud, t->hash, t->hcap*sizeof( *t->hash ), 0 );
+  t->hash = h;
+  t->hcap = ncap;
+}
+
+
+/* Makes room for `n` additional type descriptors, so that registering
+ * many types at once doesn't have to grow (and rehash) the type
+ * registry over and over again. */
+static void moon_types_reserve_( lua_State* L, moon_types_* t,
+                                 size_t n ) {
+  size_t need = (t->n > 0 ? t->n : 1) + n + 1;
+  size_t ncap = t->cap > 0 ? t->cap : 16;
+  while( ncap <= need )
+    ncap *= 2;
+  if( ncap != t->cap ) {
+    t->v = (moon_typeinfo_**)moon_types_realloc_( L, t, t->v,
+      t->cap*sizeof( *t->v ), ncap*sizeof( *t->v ) );
+    t->cap = ncap;
+  }
+  ncap = t->hcap > 0 ? t->hcap : 16;
+  while( ncap < 2*need )
+    ncap *= 2;
+  if( ncap != t->hcap )
+    moon_types_rehash_( L, t, ncap );
+}
+
+
+/* Returns the descriptor for the given type name. The descriptor is
+ * created if necessary, because casts may refer to types that are
+ * not defined yet. */
+static moon_typeinfo_* moon_types_intern_( lua_State* L,
+                                           moon_types_* t,
+                                           char const* tname ) {
+  unsigned short id = moon_types_find_( t, tname );
+  moon_typeinfo_* ti = NULL;
+  size_t len = strlen( tname );
+  size_t j = 0;
+  if( id != 0 )
+    return t->v[ id ];
+  if( t->n > USHRT_MAX )
+    luaL_error( L, "too many moon object types" );
+  if( t->n + 1 >= t->cap ) {
+    size_t ncap = t->cap > 0 ? 2*t->cap : 16;
+    t->v = (moon_typeinfo_**)moon_types_realloc_( L, t, t->v,
+      t->cap*sizeof( *t->v ), ncap*sizeof( *t->v ) );
+    t->cap = ncap;
+  }
+  if( t->n == 0 ) { /* type ID 0 is reserved */
+    t->v[ 0 ] = NULL;
+    t->n = 1;
+  }
+  if( 2*(t->n+1) > t->hcap )
+    moon_types_rehash_( L, t, t->hcap > 0 ? 2*t->hcap : 16 );
+  ti = (moon_typeinfo_*)moon_types_realloc_( L, t, NULL, 0,
+                                             sizeof( *ti ) );
+  ti->name = (char*)t->alloc( t->ud, NULL, 0, len+1 );
+  if( ti->name == NULL ) {
+    t->alloc( t->ud, ti, sizeof( *ti ), 0 );
+    luaL_error( L, "memory allocation error" );
+  }
+  memcpy( ti->name, tname, len+1 );
+  ti->mt = NULL;
+  ti->types = t;
+  ti->size = 0;
+  ti->casts = NULL;
+  ti->isa = NULL;
+  ti->ncasts = 0;
+  ti->shared = 0;
+  ti->remap = NULL;
+  ti->edges = NULL;
+  ti->nedges = ti->cedges = 0;
+  ti->mtref = LUA_NOREF;
+  ti->pool = NULL;
+  ti->nviews = 0;
+#ifdef MOON_STATS
+  memset( ti->stats, 0, sizeof( ti->stats ) );
+#endif
+  ti->stamp = moon_types_stamp_();
+  ti->id = (unsigned short)t->n;
+  t->v[ t->n ] = ti;
+  j = moon_types_hashstr_( tname ) & (t->hcap-1);
+  while( t->hash[ j ] != 0 )
+    j = (j+1) & (t->hcap-1);
+  t->hash[ j ] = ti->id;
+  t->n++;
+  return ti;
+}
+
+
+/* Returns the index into the cast tables of `ti` for the given type
+ * ID, which is different if the cast tables are borrowed from a type
+ * set with other type IDs. */
+static size_t moon_typeinfo_slot_( moon_typeinfo_ const* ti,
+                                   size_t id ) {
+  if( ti->remap != NULL )
+    return id < ti->remap->n ? ti->remap->id[ id ] : 0;
+  return id;
+}
+
+
+static int moon_typeinfo_isa_( moon_typeinfo_ const* ti,
+                               size_t id ) {
+  id = moon_typeinfo_slot_( ti, id );
+  return id < ti->ncasts &&
+         ((ti->isa[ id/CHAR_BIT ] >> (id%CHAR_BIT)) & 1);
+}
+
+
+/* Returns the cast chain from `ti` to the given type ID (which must
+ * be covered by the is-a bitmap). */
+static moon_object_cast const* moon_typeinfo_chain_( moon_typeinfo_ const* ti,
+                                                     size_t id ) {
+  return ti->casts[ moon_typeinfo_slot_( ti, id ) ];
+}
+
+
+/* Replaces the cast chains and the is-a bitmap borrowed from a type
+ * set (see `moon_deftypes`) with private copies, so that they can be
+ * modified. If memory runs out halfway, some casts are lost, but the
+ * tables stay consistent. */
+static void moon_typeinfo_unshare_( lua_State* L, moon_typeinfo_* ti ) {
+  if( ti->shared ) {
+    moon_types_* t = ti->types;
+    moon_object_cast** scasts = ti->casts;
+    unsigned char const* sisa = ti->isa;
+    moon_types_remap_ const* r = ti->remap;
+    size_t sn = ti->ncasts;
+    /* the copies are indexed by the type IDs of the Lua state */
+    size_t n = r != NULL ? t->n : sn;
+    size_t nbytes = (n+CHAR_BIT-1)/CHAR_BIT;
+    size_t i = 0;
+    ti->casts = NULL;
+    ti->isa = NULL;
+    ti->ncasts = 0;
+    ti->shared = 0;
+    ti->remap = NULL;
+    if( sn > 0 ) {
+      moon_object_cast** casts = NULL;
+      unsigned char* isa = NULL;
+      casts = (moon_object_cast**)moon_types_realloc_( L, t, NULL, 0,
+        n*sizeof( *casts ) );
+      isa = (unsigned char*)t->alloc( t->ud, NULL, 0, nbytes );
+      if( isa == NULL ) {
+        t->alloc( t->ud, casts, n*sizeof( *casts ), 0 );
+        luaL_error( L, "memory allocation error" );
+      }
+      for( i = 0; i < n; ++i )
+        casts[ i ] = NULL;
+      for( i = 0; i < nbytes; ++i )
+        isa[ i ] = 0;
+      ti->casts = casts;
+      ti->isa = isa;
+      ti->ncasts = n;
+      for( i = 0; i < n; ++i ) {
+        size_t j = r == NULL ? i : (i < r->n ? r->id[ i ] : 0);
+        if( j < sn && ((sisa[ j/CHAR_BIT ] >> (j%CHAR_BIT)) & 1) ) {
+          size_t len = moon_cast_chain_len_( scasts[ j ] );
+          if( len > 0 ) {
+            casts[ i ] = (moon_object_cast*)moon_types_realloc_( L, t,
+              NULL, 0, (len+1)*sizeof( **casts ) );
+            memcpy( casts[ i ], scasts[ j ], (len+1)*sizeof( **casts ) );
+          }
+          isa[ i/CHAR_BIT ] |= (unsigned char)(1u << (i%CHAR_BIT));
+        }
+      }
+    }
+  }
+}
+
+
+/* Makes sure that the cast chains and the is-a bitmap of `ti` cover
+ * the given type ID. */
+static void moon_typeinfo_grow_( lua_State* L, moon_typeinfo_* ti,
+                                 size_t id ) {
+  moon_types_* t = ti->types;
+  moon_typeinfo_unshare_( L, ti );
+  if( id >= ti->ncasts ) {
+    size_t ncasts = ti->ncasts > 0 ? 2*ti->ncasts : 16;
+    size_t obytes = (ti->ncasts+CHAR_BIT-1)/CHAR_BIT;
+    size_t nbytes = 0;
+    moon_object_cast** casts = NULL;
+    unsigned char* isa = NULL;
+    size_t i = 0;
+    while( ncasts <= id )
+      ncasts *= 2;
+    nbytes = (ncasts+CHAR_BIT-1)/CHAR_BIT;
+    casts = (moon_object_cast**)moon_types_realloc_( L, t, NULL, 0,
+      ncasts*sizeof( *casts ) );
+    isa = (unsigned char*)t->alloc( t->ud, NULL, 0, nbytes );
+    if( isa == NULL ) {
+      t->alloc( t->ud, casts, ncasts*sizeof( *casts ), 0 );
+      luaL_error( L, "memory allocation error" );
+    }
+    for( i = 0; i < ncasts; ++i )
+      casts[ i ] = i < ti->ncasts ? ti->casts[ i ] : NULL;
+    for( i = 0; i < nbytes; ++i )
+      isa[ i ] = i < obytes ? ti->isa[ i ] : 0;
+    t->alloc( t->ud, ti->casts, ti->ncasts*sizeof( *ti->casts ), 0 );
+    t->alloc( t->ud, ti->isa, obytes, 0 );
+    ti->casts = casts;
+    ti->isa = isa;
+    ti->ncasts = ncasts;
+  }
+}
+
+
+/* Sets the cast chain from type `ti` to the type with the given ID
+ * to the concatenation of the chain `a`, the cast `f`, and the chain
+ * `b`. Identity casts (`0`) are left out, so the resulting chain may
+ * be empty (NULL). */
+static void moon_typeinfo_setchain_( lua_State* L, moon_typeinfo_* ti,
+                                     size_t id,
+                                     moon_object_cast const* a,
+                                     moon_object_cast f,
+                                     moon_object_cast const* b ) {
+  moon_types_* t = ti->types;
+  size_t na = moon_cast_chain_len_( a );
+  size_t nb = moon_cast_chain_len_( b );
+  size_t n = na + (f != 0) + nb;
+  moon_object_cast* c = NULL;
+  moon_typeinfo_grow_( L, ti, id );
+  if( n > 0 ) {
+    size_t i = 0, j = 0;
+    c = (moon_object_cast*)moon_types_realloc_( L, t, NULL, 0,
+                                                (n+1)*sizeof( *c ) );
+    for( i = 0; i < na; ++i )
+      c[ j++ ] = a[ i ];
+    if( f != 0 )
+      c[ j++ ] = f;
+    for( i = 0; i < nb; ++i )
+      c[ j++ ] = b[ i ];
+    c[ j ] = 0;
+  }
+  moon_cast_chain_free_( t, ti->casts[ id ] );
+  ti->casts[ id ] = c;
+  ti->isa[ id/CHAR_BIT ] |= (unsigned char)(1u << (id%CHAR_BIT));
+  ti->stamp = moon_types_stamp_(); /* invalidate inline caches */
+}
+
+
+/* Adds all paths through the new cast `a` -> `b` to the transitive
+ * closure of the cast graph. Objects of type `a` must not be castable
+ * to `b` yet, so the new chains are shortest paths, and existing
+ * chains stay as they are. */
+static void moon_types_addpaths_( lua_State* L, moon_typeinfo_* a,
+                                  moon_typeinfo_* b,
+                                  moon_object_cast f ) {
+  moon_types_* t = a->types;
+  size_t x = 0, y = 0;
+  for( x = 1; x < t->n; ++x ) {
+    moon_typeinfo_* tx = t->v[ x ];
+    moon_object_cast const* cx = NULL;
+    if( tx != a ) {
+      if( !moon_typeinfo_isa_( tx, a->id ) )
+        continue;
+      cx = moon_typeinfo_chain_( tx, a->id );
+    }
+    if( tx != b && !moon_typeinfo_isa_( tx, b->id ) )
+      moon_typeinfo_setchain_( L, tx, b->id, cx, f, NULL );
+    for( y = 1; y < t->n; ++y )
+      if( y != x && moon_typeinfo_isa_( b, y ) &&
+          !moon_typeinfo_isa_( tx, y ) )
+        moon_typeinfo_setchain_( L, tx, y, cx, f,
+                                 moon_typeinfo_chain_( b, y ) );
+  }
+}
+
+
+/* Recomputes the transitive closure of the cast graph from scratch
+ * using a breadth-first search for every type (or only for the types
+ * with a nonzero entry in `only`, which is indexed by type ID). This
+ * is necessary if an existing cast has been replaced, or if many
+ * casts have been added at once. */
+static void moon_types_reclose_( lua_State* L, moon_types_* t,
+                                 unsigned char const* only ) {
+  unsigned short* queue = NULL;
+  size_t x = 0, i = 0;
+  for( x = 1; x < t->n; ++x ) {
+    moon_typeinfo_* tx = t->v[ x ];
+    if( only != NULL && !only[ x ] )
+      continue;
+    moon_typeinfo_unshare_( L, tx );
+    for( i = 0; i < tx->ncasts; ++i ) {
+      moon_cast_chain_free_( t, tx->casts[ i ] );
+      tx->casts[ i ] = NULL;
+    }
+    for( i = 0; i < (tx->ncasts+CHAR_BIT-1)/CHAR_BIT; ++i )
+      tx->isa[ i ] = 0;
+    tx->stamp = moon_types_stamp_();
+  }
+  /* use a userdata, so that the memory is released on errors */
+  queue = (unsigned short*)lua_newuserdata( L, t->n*sizeof( *queue ) );
+  for( x = 1; x < t->n; ++x ) {
+    moon_typeinfo_* tx = t->v[ x ];
+    size_t head = 0, tail = 0;
+    if( only != NULL && !only[ x ] )
+      continue;
+    queue[ tail++ ] = (unsigned short)x;
+    while( head < tail ) {
+      moon_typeinfo_* tu = t->v[ queue[ head++ ] ];
+      moon_object_cast const* cu = tu != tx ? tx->casts[ tu->id ] : NULL;
+      for( i = 0; i < tu->nedges; ++i ) {
+        unsigned short v = tu->edges[ i ].to;
+        if( v != x && !moon_typeinfo_isa_( tx, v ) ) {
+          moon_typeinfo_setchain_( L, tx, v, cu, tu->edges[ i ].cast,
+                                   NULL );
+          queue[ tail++ ] = v;
+        }
+      }
+    }
+  }
+  lua_pop( L, 1 );
+}
+
+
+/* Adds the cast function (`0` for the identity cast) from the type
+ * `a` to the type `b` to the cast graph without updating any cast
+ * chains. Returns 0 if the cast is already registered, 1 if it is
+ * new, and 2 if it replaces another cast between the same types. */
+static int moon_typeinfo_addedge_( lua_State* L, moon_typeinfo_* a,
+                                   moon_typeinfo_* b,
+                                   moon_object_cast cast ) {
+  moon_types_* t = a->types;
+  size_t i = 0;
+  for( i = 0; i < a->nedges; ++i ) {
+    if( a->edges[ i ].to == b->id ) {
+      if( a->edges[ i ].cast == cast )
+        return 0;
+      a->edges[ i ].cast = cast;
+      return 2;
+    }
+  }
+  if( a->nedges >= a->cedges ) {
+    size_t n = a->cedges > 0 ? 2*a->cedges : 4;
+    a->edges = (moon_typeinfo_edge_*)moon_types_realloc_( L, t,
+      a->edges, a->cedges*sizeof( *a->edges ), n*sizeof( *a->edges ) );
+    a->cedges = n;
+  }
+  a->edges[ a->nedges ].to = b->id;
+  a->edges[ a->nedges ].cast = cast;
+  a->nedges++;
+  return 1;
+}
+
+
+/* Registers a cast function (`0` for the identity cast) from the
+ * type `a` to the type `b`, and updates the cast chains of all types
+ * that can be cast to `a`. */
+static void moon_typeinfo_addcast_( lua_State* L, moon_typeinfo_* a,
+                                    moon_typeinfo_* b,
+                                    moon_object_cast cast ) {
+  switch( moon_typeinfo_addedge_( L, a, b, cast ) ) {
+    case 1:
+      /* a direct cast beats a composed one */
+      if( a != b && moon_typeinfo_isa_( a, b->id ) )
+        moon_types_reclose_( L, a->types, NULL );
+      else
+        moon_types_addpaths_( L, a, b, cast );
+      break;
+    case 2:
+      moon_types_reclose_( L, a->types, NULL );
+      break;
+  }
+}
+
+
+/* Looks up the type descriptor of the moon object at the given stack
+ * index using the type ID in the object header. The metatable of the
+ * object must be the one registered for that type ID, otherwise NULL
+ * is returned (e.g. for objects created by other moon versions). The
+ * type registry is found via the metatable, because the only per-state
+ * slot that doesn't need the stack (`lua_getextraspace`) belongs to
+ * the application. */
+static moon_typeinfo_* moon_typeinfo_get_( lua_State* L, int idx,
+                                           moon_object_header const* h ) {
+  moon_typeinfo_* ti = NULL;
+  if( h != NULL && lua_type( L, idx ) == LUA_TUSERDATA &&
+      lua_getmetatable( L, idx ) ) {
+    moon_types_* t = NULL;
+    lua_rawgeti( L, -1, 1 );
+    t = moon_types_test_( L, -1 );
+    if( t != NULL && h->type_id > 0 && h->type_id < t->n ) {
+      ti = t->v[ h->type_id ];
+      if( ti->mt != lua_topointer( L, -2 ) )
+        ti = NULL;
+    }
+    lua_pop( L, 2 );
+  }
+  return ti;
+}
+
+
+/* Same as `moon_typeinfo_get_` for callers that have a type handle
+ * `t`, and thus already know the type registry of the current Lua
+ * state. Objects of type `t` are recognized by their type ID and the
+ * identity of their metatable, without looking at the metatable
+ * contents. */
+static moon_typeinfo_* moon_typeinfo_get_t_( lua_State* L, int idx,
+                                             moon_object_header const* h,
+                                             moon_typeinfo_* t ) {
+  moon_typeinfo_* ti = NULL;
+  if( h != NULL && lua_type( L, idx ) == LUA_TUSERDATA &&
+      lua_getmetatable( L, idx ) ) {
+    void const* mt = lua_topointer( L, -1 );
+    lua_pop( L, 1 );
+    if( mt == t->mt ) {
+      if( h->type_id == t->id )
+        ti = t;
+    } else if(
+#if LUA_VERSION_NUM < 502
+               lua_objlen( L, idx ) >= sizeof( *h ) &&
+#else
+               lua_rawlen( L, idx ) >= sizeof( *h ) &&
+#endif
+               h->type_id > 0 && h->type_id < t->types->n &&
+               t->types->v[ h->type_id ]->mt == mt )
+      ti = t->types->v[ h->type_id ];
+  }
+  return ti;
+}
+
+
+#ifdef MOON_STATS
+/* Increments a counter for the type of the object at index `idx`. */
+static void moon_stats_count_( lua_State* L, int idx, int c ) {
+  moon_typeinfo_* ti = moon_typeinfo_get_( L, idx, (moon_object_header*)
+                                           lua_touserdata( L, idx ) );
+  MOON_STAT_( ti, c );
+}
+
+
+/* Same for the object at index 1 using the type registry at the
+ * pseudo-index `uv` (an upvalue of the calling metamethod, which
+ * only gets objects with the right metatable). The registry is empty
+ * once it has been finalized. */
+static void moon_stats_count_uv_( lua_State* L, int uv, int c ) {
+  moon_types_* t = (moon_types_*)lua_touserdata( L, uv );
+  moon_object_header const* h = (moon_object_header const*)
+    lua_touserdata( L, 1 );
+  if( t != NULL && h != NULL && lua_type( L, 1 ) == LUA_TUSERDATA &&
+      h->type_id > 0 && h->type_id < t->n )
+    MOON_STAT_( t->v[ h->type_id ], c );
+}
+
+
+/* Failed type checks are counted for the expected type. */
+static void moon_stats_fail_( lua_State* L, char const* tname ) {
+  moon_types_* t = NULL;
+  lua_getfield( L, LUA_REGISTRYINDEX, "__moon_types" );
+  t = moon_types_test_( L, -1 );
+  if( t != NULL ) {
+    unsigned short id = moon_types_find_( t, tname );
+    if( id != 0 )
+      MOON_STAT_( t->v[ id ], MOON_STATS_CHECK_FAIL_ );
+  }
+  lua_pop( L, 1 );
+}
+#endif
+
+
+/* Returns the type descriptor for the metatable at index `i` which
+ * has been registered as type `tname`. */
+static moon_typeinfo_* moon_typeinfo_frommt_( lua_State* L, int i,
+                                              char const* tname ) {
+  moon_typeinfo_* ti = NULL;
+  moon_types_* t = NULL;
+  i = moon_absindex( L, i );
+  lua_rawgeti( L, i, 1 );
+  t = moon_types_test_( L, -1 );
+  if( t != NULL ) {
+    unsigned short id = moon_types_find_( t, tname );
+    if( id != 0 && t->v[ id ]->mt == lua_topointer( L, i ) )
+      ti = t->v[ id ];
+  }
+  lua_pop( L, 1 );
+  return ti;
+}
+
+
+/* Figures out whether an object with the type descriptor `ti` may be
+ * used as a `tname` object, and which cast functions are necessary.
+ * This doesn't touch the Lua stack at all. */
+static int moon_typeinfo_match_( moon_typeinfo_ const* ti,
+                                 char const* tname,
+                                 moon_object_cast const** casts ) {
+  if( 0 == strcmp( ti->name, tname ) ) {
+    *casts = NULL;
+    return 1;
+  } else {
+    unsigned short id = moon_types_find_( ti->types, tname );
+    if( id != 0 && moon_typeinfo_isa_( ti, id ) ) {
+      *casts = moon_typeinfo_chain_( ti, id );
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* Registers the metatable at the top of the Lua stack as the one for
+ * type `tname` in the type registry. */
+static moon_typeinfo_* moon_types_define_( lua_State* L,
+                                           char const* tname,
+                                           size_t sz ) {
+  moon_types_* t = moon_types_push_( L );
+  moon_typeinfo_* ti = moon_types_intern_( L, t, tname );
+  lua_rawseti( L, -2, 1 );
+  ti->mt = lua_topointer( L, -1 );
+  ti->size = sz;
+  lua_pushvalue( L, -1 );
+  ti->mtref = luaL_ref( L, LUA_REGISTRYINDEX );
+  return ti;
+}
+
+
+/* Pushes the record of a type that has been registered using
+ * moon_defobject_lazy but hasn't been materialized yet. Returns 0
+ * (and pushes nothing) if there is no such record. */
+static int moon_lazy_push_( lua_State* L, char const* tname ) {
+  lua_getfield( L, LUA_REGISTRYINDEX, "__moon_lazy" );
+  if( lua_istable( L, -1 ) ) {
+    lua_getfield( L, -1, tname );
+    lua_replace( L, -2 );
+    if( lua_istable( L, -1 ) )
+      return 1;
+  }
+  lua_pop( L, 1 );
+  return 0;
+}
+
+
+MOON_API void moon_defobject( lua_State* L, char const* tname,
+                              size_t sz, luaL_Reg const* methods,
+                              int nups ) {
+  int nmethods = 0;
+  int nproperties = 0;
+  int nmeta = 0;
+  lua_CFunction index = 0;
+  lua_CFunction newindex = 0;
+  moon_check_tname_( L, tname );
+  luaL_checkstack( L, 2*nups+4, "moon_defobject" );
+  /* we don't use luaL_newmetatable to make sure that we never have a
+   * half-constructed metatable in the registry! */
+  luaL_getmetatable( L, tname );
+  if( !lua_isnil( L, -1 ) || moon_lazy_push_( L, tname ) )
+    luaL_error( L, "type '%s' is already defined", tname );
+  lua_pop( L, 1 );
+  /* count the functions first, so that all tables can be created
+   * with the correct size */
+  if( methods != NULL ) {
+    luaL_Reg const* l = methods;
+    for( ; l->func != NULL; ++l ) {
+      if( moon_is_meta( l->name ) )
+        ++nmeta;
+      else if( moon_is_property( l->name ) )
+        ++nproperties;
+      else
+        ++nmethods;
+    }
+  }
+  /* + __tostring, __index, __newindex, __metatable, __name, __gc,
+   * __close, __moon_version, __moon_size */
+  lua_createtable( L, 1, nmeta+9 );
+  lua_pushstring( L, tname );
+  lua_pushcclosure( L, moon_object_default_tostring_, 1 );
+  lua_setfield( L, -2, "__tostring" );
+  if( nmeta > 0 ) {
+    luaL_Reg const* l = methods;
+    int i = 0;
+    for( ; l->func != NULL; ++l ) {
+      if( moon_is_meta( l->name ) ) {
+        if( 0 == strcmp( l->name+2, "index" ) ) /* handle __index later */
+          index = l->func;
+        else if( 0 == strcmp( l->name+2, "newindex" ) ) /* ditto */
+          newindex = l->func;
+        else {
+          for( i = 0; i < nups; ++i )
+            lua_pushvalue( L, -nups-1 );
+          lua_pushcclosure( L, l->func, nups );
+          lua_setfield( L, -2, l->name );
+        }
+      }
+    }
+  }
+  if( nmethods > 0 || nproperties > 0 || index ) {
+    int i = 0;
+    for( i = 0; i < nups; ++i )
+      lua_pushvalue( L, -nups-1 );
+    moon_makeindex_( L, nmethods > 0 ? methods : NULL,
+                        nproperties > 0 ? methods : NULL, index, nups,
+                        nmethods, nproperties );
+    lua_setfield( L, -2, "__index" );
+  }
+  if( nproperties > 0 || newindex ) {
+    int i = 0;
+    for( i = 0; i < nups; ++i )
+      lua_pushvalue( L, -nups-1 );
+    moon_makenewindex_( L, methods, newindex, nups, nproperties );
+    lua_setfield( L, -2, "__newindex" );
+  }
+  lua_pushboolean( L, 0 );
+  lua_setfield( L, -2, "__metatable" );
+  lua_pushstring( L, tname );
+  lua_setfield( L, -2, "__name" );
+#ifdef MOON_STATS
+  moon_types_push_( L );
+  lua_pushcclosure( L, moon_object_default_gc_, 1 );
+#else
+  lua_pushcfunction( L, moon_object_default_gc_ );
+#endif
+  lua_pushvalue( L, -1);
+  lua_setfield( L, -3, "__gc" );
+  lua_setfield( L, -2, "__close" );
+  lua_pushinteger( L, MOON_VERSION );
+  lua_setfield( L, -2, "__moon_version" );
+  lua_pushinteger( L, (lua_Integer)sz );
+  lua_setfield( L, -2, "__moon_size" );
+  moon_types_define_( L, tname, sz );
+  lua_setfield( L, LUA_REGISTRYINDEX, tname );
+  lua_pop( L, nups );
+}
+
+
+MOON_API void moon_defobject_lazy( lua_State* L, char const* tname,
+                                   size_t sz, luaL_Reg const* methods,
+                                   int nups ) {
+  int i = 0;
+  moon_check_tname_( L, tname );
+  luaL_checkstack( L, 4, "moon_defobject_lazy" );
+  luaL_getmetatable( L, tname );
+  if( !lua_isnil( L, -1 ) || moon_lazy_push_( L, tname ) )
+    luaL_error( L, "type '%s' is already defined", tname );
+  lua_pop( L, 1 );
+  lua_getfield( L, LUA_REGISTRYINDEX, "__moon_lazy" );
+  if( !lua_istable( L, -1 ) ) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, "__moon_lazy" );
+  }
+  /* only remember what is needed to call moon_defobject later */
+  lua_createtable( L, nups, 3 );
+  lua_pushinteger( L, (lua_Integer)sz );
+  lua_setfield( L, -2, "size" );
+  lua_pushlightuserdata( L, (void*)methods );
+  lua_setfield( L, -2, "methods" );
+  lua_pushinteger( L, nups );
+  lua_setfield( L, -2, "nups" );
+  for( i = 1; i <= nups; ++i ) {
+    lua_pushvalue( L, i-nups-3 );
+    lua_rawseti( L, -2, i );
+  }
+  lua_setfield( L, -2, tname );
+  lua_pop( L, nups+1 );
+}
+
+
+/* Verify that the value at the stack top is the metatable for a moon
+ * object type. */
+static void moon_check_metatable_( lua_State* L, char const* tname ) {
+  if( !lua_istable( L, -1 ) )
+    luaL_error( L, "no metatable for type '%s' defined", tname );
+  lua_getfield( L, -1, "__moon_version" );
+  if( lua_tointeger( L, -1 ) != MOON_VERSION )
+    luaL_error( L, "'%s' is not a moon %d.%d object type", tname,
+                MOON_VERSION_MAJOR, MOON_VERSION_MINOR );
+  lua_pop( L, 1 );
+}
+
+/* Turns a lazily defined type into a real one: the metatable is
+ * created using the recorded methods and upvalues, and all casts and
+ * fields that were added in the meantime are applied. Returns 0 if
+ * there is nothing to do for the given type name. */
+static int moon_lazy_materialize_( lua_State* L, char const* tname ) {
+  int rec = 0, nups = 0, i = 0;
+  size_t sz = 0;
+  luaL_Reg const* methods = NULL;
+  luaL_checkstack( L, 5, "moon_lazy_materialize_" );
+  if( !moon_lazy_push_( L, tname ) )
+    return 0;
+  rec = lua_gettop( L );
+  /* remove the record first, so that moon_defobject doesn't complain
+   * about an existing type */
+  lua_getfield( L, LUA_REGISTRYINDEX, "__moon_lazy" );
+  lua_pushnil( L );
+  lua_setfield( L, -2, tname );
+  lua_pop( L, 1 );
+  lua_getfield( L, rec, "size" );
+  lua_getfield( L, rec, "methods" );
+  lua_getfield( L, rec, "nups" );
+  sz = (size_t)lua_tointeger( L, -3 );
+  methods = (luaL_Reg const*)lua_touserdata( L, -2 );
+  nups = (int)lua_tointeger( L, -1 );
+  lua_pop( L, 3 );
+  luaL_checkstack( L, nups+5, "moon_lazy_materialize_" );
+  for( i = 1; i <= nups; ++i )
+    lua_rawgeti( L, rec, i );
+  moon_defobject( L, tname, sz, methods, nups );
+  /* the type registry already knows about the casts */
+  lua_getfield( L, rec, "casts" );
+  if( lua_istable( L, -1 ) ) {
+    luaL_getmetatable( L, tname );
+    lua_pushnil( L );
+    while( lua_next( L, -3 ) ) {
+      lua_pushvalue( L, -2 );
+      lua_insert( L, -2 );
+      lua_rawset( L, -4 );
+    }
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 1 );
+  lua_getfield( L, rec, "fields" );
+  if( lua_istable( L, -1 ) ) {
+    i = 1;
+    lua_rawgeti( L, -1, i );
+    while( !lua_isnil( L, -1 ) ) {
+      moon_deffields( L, tname,
+                      (moon_object_field const*)lua_touserdata( L, -1 ) );
+      lua_pop( L, 1 );
+      lua_rawgeti( L, -1, ++i );
+    }
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 2 );
+  return 1;
+}
+
+
+/* Pushes the metatable for the given type onto the Lua stack, and
+ * makes sure that the given type is a moon object type. Returns the
+ * type descriptor if available. */
+static moon_typeinfo_* moon_push_metatable_( lua_State* L,
+                                             char const* tname ) {
+  moon_check_tname_( L, tname );
+  luaL_getmetatable( L, tname );
+  if( lua_isnil( L, -1 ) && moon_lazy_materialize_( L, tname ) ) {
+    lua_pop( L, 1 );
+    luaL_getmetatable( L, tname );
+  }
+  moon_check_metatable_( L, tname );
+  return moon_typeinfo_frommt_( L, -1, tname );
+}
+
+
+/* Returns the payload size of type `tname` whose metatable is at the
+ * top of the Lua stack. The size is taken from the type descriptor
+ * `ti`, only foreign metatables (without type descriptor) need the
+ * `__moon_size` field. */
+static size_t moon_object_size_( lua_State* L, moon_typeinfo_ const* ti,
+                                 char const* tname ) {
+  size_t sz = 0;
+  if( ti != NULL )
+    sz = ti->size;
+  else {
+    lua_getfield( L, -1, "__moon_size" );
+    sz = lua_tointeger( L, -1 );
+    lua_pop( L, 1 );
+  }
+  if( sz == 0 )
+    luaL_error( L, "type '%s' is incomplete (size is 0)", tname );
+  return sz;
+}
+
+
+/* Calculates the offsets of the destructor and the payload for
+ * objects created via `moon_newobject`. */
+static void moon_object_layout_( void (*gc)( void* ), size_t* off1,
+                                 size_t* off2 ) {
+#ifdef _MSC_VER
+#  pragma warning(push)
+#  pragma warning(disable: 4116)
+#endif
+  *off1 = 0;
+  *off2 = MOON_ROUNDTO_( sizeof( moon_object_header ),
+                         MOON_OBJ_ALIGNMENT_ );
+  if( gc != 0 ) {
+    *off1 = MOON_ROUNDTO_( sizeof( moon_object_header ),
+                           MOON_GCF_ALIGNMENT_ );
+    *off2 = MOON_ROUNDTO_( *off1 + sizeof( moon_object_destructor ),
+                           MOON_OBJ_ALIGNMENT_ );
+  }
+#ifdef _MSC_VER
+#  pragma warning(pop)
+#endif
+}
+
+
+/* Initializes the header (and the destructor) of a new object with
+ * the given layout and returns a pointer to the payload. */
+static void* moon_object_setup_( moon_object_header* obj, size_t off1,
+                                 size_t off2, void (*gc)( void* ),
+                                 unsigned short id ) {
+  if( off1 > 0 ) {
+    moon_object_destructor* cl = NULL;
+    cl = (moon_object_destructor*)MOON_PTR_( obj, off1 );
+    *cl = gc;
+  }
+  obj->cleanup_offset = off1;
+  obj->object_offset = off2;
+  obj->vcheck_offset = 0;
+  obj->flags = MOON_OBJECT_IS_VALID;
+  obj->type_id = id;
+  return MOON_PTR_( obj, off2 );
+}
+
+
+/* Allocates the userdata for a new object of type `ti` (which may be
+ * NULL) with all the user values it needs: the one for the user, the
+ * parent reference (for field objects), and the caches for the views
+ * of embedded object fields. */
+static moon_object_header* moon_newuserdata_( lua_State* L, size_t sz,
+                                              moon_typeinfo_ const* ti,
+                                              int field ) {
+#ifdef MOON_PARENT_UV_
+  int nuv = field ? MOON_PARENT_UV_ : 1;
+  if( ti != NULL && ti->nviews > 0 )
+    nuv = MOON_VIEW_UV_( ti->nviews );
+  return (moon_object_header*)lua_newuserdatauv( L, sz, nuv );
+#else
+  (void)ti;
+  (void)field;
+  return (moon_object_header*)lua_newuserdata( L, sz );
+#endif
+}
+
+
+/* Creates a new moon object of the given payload size using the
+ * metatable at the top of the Lua stack. The metatable is replaced by
+ * the new object. */
+static void* moon_newobject_( lua_State* L, size_t sz,
+                              moon_typeinfo_ const* ti,
+                              void (*gc)( void* ) ) {
+  moon_object_header* obj = NULL;
+  void* p = NULL;
+  size_t off1 = 0, off2 = 0;
+  moon_object_layout_( gc, &off1, &off2 );
+  obj = moon_newuserdata_( L, sz+off2, ti, 0 );
+  p = moon_object_setup_( obj, off1, off2, gc,
+                          ti != NULL ? ti->id : 0 );
+  lua_insert( L, -2 );
+  lua_setmetatable( L, -2 );
+  return p;
+}
+
+
+MOON_API void* moon_newobject( lua_State* L, char const* tname,
+                               void (*gc)( void* ) ) {
+  size_t sz = 0;
+  moon_typeinfo_* ti = NULL;
+  luaL_checkstack( L, 2, "moon_newobject" );
+  ti = moon_push_metatable_( L, tname );
+  sz = moon_object_size_( L, ti, tname );
+  MOON_STAT_( ti, MOON_STATS_NEWOBJECT_ );
+  return moon_newobject_( L, sz, ti, gc );
+}
+
+
+MOON_API void moon_newobjects( lua_State* L, char const* tname,
+                               int n, void (*gc)( void* ),
+                               void const* proto,
+                               void (*init)( void*, int, void* ),
+                               void* ud ) {
+  size_t sz = 0, off1 = 0, off2 = 0;
+  moon_typeinfo_* ti = NULL;
+  unsigned short id = 0;
+  int i = 0;
+  luaL_checkstack( L, 4, "moon_newobjects" );
+  if( n < 0 )
+    luaL_error( L, "invalid number of objects: %d", n );
+  ti = moon_push_metatable_( L, tname );
+  sz = moon_object_size_( L, ti, tname );
+  id = ti != NULL ? ti->id : 0;
+  moon_object_layout_( gc, &off1, &off2 );
+  lua_createtable( L, n, 0 );
+  for( i = 1; i <= n; ++i ) {
+    moon_object_header* obj = NULL;
+    void* p = NULL;
+    obj = moon_newuserdata_( L, sz+off2, ti, 0 );
+    p = moon_object_setup_( obj, off1, off2, gc, id );
+    /* the objects created so far might be collected (and finalized)
+     * if a later allocation fails, so they must be initialized now */
+    if( proto != NULL )
+      memcpy( p, proto, sz );
+    else if( init == 0 )
+      memset( p, 0, sz );
+    if( init != 0 )
+      init( p, i, ud );
+    lua_pushvalue( L, -3 );
+    lua_setmetatable( L, -2 );
+    lua_rawseti( L, -2, i );
+  }
+  lua_replace( L, -2 );
+  MOON_STATS_ADD_( ti, MOON_STATS_NEWOBJECT_, (unsigned long)n );
+}
+
+
+/* Same as `moon_newobject_` for objects that store a pointer. */
+static void** moon_newpointer_( lua_State* L,
+                                moon_typeinfo_ const* ti,
+                                void (*gc)( void* ) ) {
+  moon_object_header* obj = NULL;
+  void** p = NULL;
+  size_t off1 = 0;
+#ifdef _MSC_VER
+#  pragma warning(push)
+#  pragma warning(disable: 4116)
+#endif
+  size_t off2 = MOON_ROUNDTO_( sizeof( moon_object_header ),
+                               MOON_PTR_ALIGNMENT_ );
+  if( gc != 0 ) {
+    off1 = MOON_ROUNDTO_( sizeof( moon_object_header ),
                           MOON_GCF_ALIGNMENT_ );
     off2 = MOON_ROUNDTO_( off1 + sizeof( moon_object_destructor ),
                           MOON_PTR_ALIGNMENT_ );
@@ -535,93 +2252,1647 @@ MOON_API void** moon_newpointer( lua_State* L, char const* tname,
 #  pragma warning(pop)
 #endif
   }
-  obj = (moon_object_header*)lua_newuserdata( L, sizeof( void* )+off2 );
-  p = (void**)MOON_PTR_( obj, off2 );
-  *p = NULL;
-  if( off1 > 0 ) {
-    moon_object_destructor* cl = NULL;
-    cl = (moon_object_destructor*)MOON_PTR_( obj, off1 );
-    *cl = gc;
+  obj = moon_newuserdata_( L, sizeof( void* )+off2, ti, 0 );
+  p = (void**)MOON_PTR_( obj, off2 );
+  *p = NULL;
+  if( off1 > 0 ) {
+    moon_object_destructor* cl = NULL;
+    cl = (moon_object_destructor*)MOON_PTR_( obj, off1 );
+    *cl = gc;
+  }
+  obj->cleanup_offset = off1;
+  obj->object_offset = off2;
+  obj->vcheck_offset = 0;
+  obj->flags = MOON_OBJECT_IS_VALID | MOON_OBJECT_IS_POINTER;
+  obj->type_id = ti != NULL ? ti->id : 0;
+  lua_insert( L, -2 );
+  lua_setmetatable( L, -2 );
+  return p;
+}
+
+
+MOON_API void** moon_newpointer( lua_State* L, char const* tname,
+                                 void (*gc)( void* ) ) {
+  moon_typeinfo_* ti = NULL;
+  luaL_checkstack( L, 2, "moon_newpointer" );
+  ti = moon_push_metatable_( L, tname );
+  MOON_STAT_( ti, MOON_STATS_NEWPOINTER_ );
+  return moon_newpointer_( L, ti, gc );
+}
+
+
+/* Checks whether the userdata `h` at stack index `idx` is a moon
+ * object (of any type). */
+static int moon_isobject_( lua_State* L, int idx, moon_object_header* h ) {
+  int is_moon = moon_typeinfo_get_( L, idx, h ) != NULL;
+  if( !is_moon && h != NULL && lua_getmetatable( L, idx ) ) {
+    lua_getfield( L, -1, "__moon_version" );
+    is_moon = lua_tointeger( L, -1 ) == MOON_VERSION;
+    lua_pop( L, 2 );
+  }
+  return is_moon;
+}
+
+
+/* Figures out the vcheck chain for a new field object from the
+ * parent object at stack index `idx`. */
+static void moon_newfield_parent_( lua_State* L, int idx,
+                                   int (**isvalid)( void* ),
+                                   void** tagp,
+                                   moon_object_vcheck_** nextcheck ) {
+  moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
+  if( moon_isobject_( L, idx, h ) && h->vcheck_offset > 0 ) {
+    moon_object_vcheck_* vc = NULL;
+    vc = (moon_object_vcheck_*)MOON_PTR_( h, h->vcheck_offset );
+    if( *isvalid == 0 ) { /* inherit vcheck from idx object */
+      *isvalid = vc->check;
+      *tagp = vc->tagp;
+      *nextcheck = vc->next;
+    } else /* add it to the chain */
+      *nextcheck = vc;
+  }
+}
+
+
+/* Allocates a userdata for a field object with room for a vcheck
+ * node (`epoch` is 0) or an epoch record (`epoch` is 1), and sets
+ * the metatable (at the top of the stack) and the parent reference.
+ * The validity record is left uninitialized. The payload is a NULL
+ * pointer, or `sz` zeroed bytes if `sz` is not 0. `idx` must be an
+ * absolute stack index (or 0). */
+static moon_object_header* moon_newfield_alloc_( lua_State* L,
+                                                 moon_typeinfo_ const* ti,
+                                                 int idx, int vcheck,
+                                                 int epoch, size_t sz ) {
+  moon_object_header* obj = NULL;
+  size_t off1 = 0;
+  int is_pointer = sz == 0;
+#ifdef _MSC_VER
+#  pragma warning(push)
+#  pragma warning(disable: 4116)
+#endif
+  size_t align = sz > 0 ? MOON_OBJ_ALIGNMENT_ : MOON_PTR_ALIGNMENT_;
+  size_t off2 = MOON_ROUNDTO_( sizeof( moon_object_header ), align );
+  if( epoch ) {
+    off1 = MOON_ROUNDTO_( sizeof( moon_object_header ),
+                          MOON_EPC_ALIGNMENT_ );
+    off2 = MOON_ROUNDTO_( off1 + sizeof( moon_object_epoch_ ), align );
+  } else if( vcheck ) {
+    off1 = MOON_ROUNDTO_( sizeof( moon_object_header ),
+                          MOON_VCK_ALIGNMENT_ );
+    off2 = MOON_ROUNDTO_( off1 + sizeof( moon_object_vcheck_ ), align );
+  }
+#ifdef _MSC_VER
+#  pragma warning(pop)
+#endif
+  if( is_pointer )
+    sz = sizeof( void* );
+  obj = moon_newuserdata_( L, sz+off2, ti, idx != 0 );
+  if( is_pointer )
+    *(void**)MOON_PTR_( obj, off2 ) = NULL;
+  else
+    memset( MOON_PTR_( obj, off2 ), 0, sz );
+  obj->vcheck_offset = off1;
+  obj->object_offset = off2;
+  obj->cleanup_offset = 0;
+  obj->flags = MOON_OBJECT_IS_VALID;
+  if( is_pointer )
+    obj->flags |= MOON_OBJECT_IS_POINTER;
+  if( epoch )
+    obj->flags |= MOON_OBJECT_HAS_EPOCH_;
+  obj->type_id = ti != NULL ? ti->id : 0;
+  lua_insert( L, -2 );
+  lua_setmetatable( L, -2 );
+  if( idx != 0 ) {
+#ifdef MOON_PARENT_UV_
+    lua_pushvalue( L, idx );
+    lua_setiuservalue( L, -2, MOON_PARENT_UV_ );
+#else
+    lua_newtable( L );
+    lua_pushvalue( L, idx );
+    lua_rawseti( L, -2, 1 );
+#if LUA_VERSION_NUM < 502
+    lua_setfenv( L, -2 );
+#else
+    lua_setuservalue( L, -2 );
+#endif
+#endif
+  }
+  return obj;
+}
+
+
+/* Same as `moon_newpointer_` for objects created via
+ * `moon_newfield`. `idx` must be an absolute stack index (or 0). */
+static void** moon_newfield_( lua_State* L, moon_typeinfo_ const* ti,
+                              int idx, int (*isvalid)( void* ),
+                              void* tagp,
+                              moon_object_vcheck_* nextcheck ) {
+  moon_object_header* obj = moon_newfield_alloc_( L, ti, idx,
+                                                  isvalid != 0, 0, 0 );
+  if( isvalid != 0 ) {
+    moon_object_vcheck_* vc = NULL;
+    vc= (moon_object_vcheck_*)MOON_PTR_( obj, obj->vcheck_offset );
+    vc->check = isvalid;
+    vc->tagp = tagp;
+    vc->next = nextcheck;
+  }
+  return (void**)MOON_PTR_( obj, obj->object_offset );
+}
+
+
+/* Derives the validity record for a new object from the parent
+ * object at stack index `idx` (which must be absolute or 0) and the
+ * generation counter `epochp`. */
+static void moon_epoch_record_( lua_State* L, int idx,
+                                unsigned const* epochp,
+                                moon_object_epoch_* r ) {
+  static unsigned char const valid = MOON_OBJECT_IS_VALID;
+  moon_object_header* h = NULL;
+  moon_object_epoch_ rec;
+  rec.vc.check = moon_epoch_valid_;
+  rec.vc.tagp = NULL;
+  rec.vc.next = NULL;
+  rec.flagsp = &valid;
+  rec.epochp = epochp;
+  rec.epoch = epochp != NULL ? *epochp : 0;
+  if( idx != 0 ) {
+    h = (moon_object_header*)lua_touserdata( L, idx );
+    if( !moon_isobject_( L, idx, h ) )
+      h = NULL;
+  }
+  if( h != NULL && (h->flags & MOON_OBJECT_HAS_EPOCH_) ) {
+    moon_object_epoch_* pe = NULL;
+    pe = (moon_object_epoch_*)MOON_PTR_( h, h->vcheck_offset );
+    if( epochp == NULL || pe->epochp == NULL || pe->epochp == epochp ) {
+      /* merge the parent's record into the new one */
+      rec.vc.next = pe->vc.next;
+      rec.flagsp = pe->flagsp;
+      if( pe->epochp != NULL ) {
+        rec.epochp = pe->epochp;
+        rec.epoch = pe->epoch;
+      }
+    } else { /* different generation counters: chain them */
+      rec.vc.next = &pe->vc;
+      rec.flagsp = &h->flags;
+    }
+  } else if( h != NULL ) {
+    rec.flagsp = &h->flags;
+    if( h->vcheck_offset > 0 )
+      rec.vc.next = (moon_object_vcheck_*)MOON_PTR_( h, h->vcheck_offset );
+  }
+  *r = rec;
+}
+
+
+/* Allocates an object with an epoch record (see `moon_epoch_record_`
+ * and `moon_newfield_alloc_`). The metatable must be at the top of
+ * the stack. */
+static moon_object_header* moon_newepoch_( lua_State* L,
+                                           moon_typeinfo_ const* ti,
+                                           int idx,
+                                           unsigned const* epochp,
+                                           size_t sz ) {
+  moon_object_header* obj = NULL;
+  moon_object_epoch_ rec;
+  moon_object_epoch_* e = NULL;
+  moon_epoch_record_( L, idx, epochp, &rec );
+  obj = moon_newfield_alloc_( L, ti, idx, 0, 1, sz );
+  e = (moon_object_epoch_*)MOON_PTR_( obj, obj->vcheck_offset );
+  *e = rec;
+  e->vc.tagp = e;
+  return obj;
+}
+
+
+/* Same as `moon_newfield_` for objects created via
+ * `moon_newfield_epoch`. */
+static void** moon_newfield_epoch_( lua_State* L,
+                                    moon_typeinfo_ const* ti, int idx,
+                                    unsigned const* epochp ) {
+  moon_object_header* obj = moon_newepoch_( L, ti, idx, epochp, 0 );
+  return (void**)MOON_PTR_( obj, obj->object_offset );
+}
+
+
+MOON_API void** moon_newfield( lua_State* L, char const* tname,
+                               int idx, int (*isvalid)( void* ),
+                               void* tagp ) {
+  moon_object_vcheck_* nextcheck = NULL;
+  moon_typeinfo_* ti = NULL;
+  luaL_checkstack( L, 3, "moon_newfield" );
+  if( idx != 0 ) {
+    idx = moon_absindex( L, idx );
+    moon_newfield_parent_( L, idx, &isvalid, &tagp, &nextcheck );
+  }
+  ti = moon_push_metatable_( L, tname );
+  MOON_STAT_( ti, MOON_STATS_NEWFIELD_ );
+  return moon_newfield_( L, ti, idx, isvalid, tagp, nextcheck );
+}
+
+
+MOON_API void** moon_newfield_epoch( lua_State* L, char const* tname,
+                                     int idx, unsigned const* epochp ) {
+  moon_typeinfo_* ti = NULL;
+  luaL_checkstack( L, 3, "moon_newfield_epoch" );
+  if( idx != 0 )
+    idx = moon_absindex( L, idx );
+  ti = moon_push_metatable_( L, tname );
+  MOON_STAT_( ti, MOON_STATS_NEWFIELD_ );
+  return moon_newfield_epoch_( L, ti, idx, epochp );
+}
+
+
+MOON_API void moon_defpool( lua_State* L, char const* tname,
+                            size_t sz, size_t nslots,
+                            moon_object_destructor destructor ) {
+  moon_typeinfo_* ti = NULL;
+  moon_pool_* pool = NULL;
+  size_t ss = MOON_ROUNDTO_( MOON_POOL_SLOT_OFFSET_ +
+                             (sz > sizeof( void* ) ? sz : sizeof( void* )),
+                             MOON_OBJ_ALIGNMENT_ );
+  luaL_checkstack( L, 2, "moon_defpool" );
+  ti = moon_push_metatable_( L, tname );
+  if( ti == NULL )
+    luaL_error( L, "no type descriptor for type '%s'", tname );
+  if( ti->pool != NULL )
+    luaL_error( L, "pool for type '%s' is already defined", tname );
+  if( nslots == 0 ) { /* make slabs roughly the size of a page */
+    nslots = (4096 - MOON_POOL_SLAB_OFFSET_) / ss;
+    if( nslots == 0 )
+      nslots = 1;
+  }
+  if( sz == 0 || nslots > ((size_t)-1 - MOON_POOL_SLAB_OFFSET_) / ss )
+    luaL_error( L, "invalid pool size for type '%s'", tname );
+  pool = (moon_pool_*)moon_types_realloc_( L, ti->types, NULL, 0,
+                                           sizeof( *pool ) );
+  pool->types = ti->types;
+  pool->alloc = ti->types->alloc;
+  pool->ud = ti->types->ud;
+  pool->destructor = destructor;
+  pool->elem_size = sz;
+  pool->slot_size = ss;
+  pool->nslots = nslots;
+  pool->partial = NULL;
+  pool->slabs = NULL;
+  pool->nslabs = 0;
+  pool->used = 0;
+  ti->pool = pool;
+  lua_pop( L, 1 );
+}
+
+
+MOON_API void* moon_newpooled( lua_State* L, char const* tname ) {
+  moon_typeinfo_* ti = NULL;
+  void** p = NULL;
+  luaL_checkstack( L, 2, "moon_newpooled" );
+  ti = moon_push_metatable_( L, tname );
+  if( ti == NULL || ti->pool == NULL )
+    luaL_error( L, "no pool for type '%s' defined", tname );
+  /* the slot is allocated last, so that it can't leak on errors */
+  p = moon_newpointer_( L, ti, moon_pool_release_ );
+  *p = moon_pool_alloc_( L, ti->pool );
+  MOON_STAT_( ti, MOON_STATS_NEWPOOLED_ );
+  return *p;
+}
+
+
+MOON_API void moon_getpoolstats( lua_State* L, char const* tname ) {
+  moon_typeinfo_* ti = NULL;
+  moon_pool_* pool = NULL;
+  moon_pool_slab_* s = NULL;
+  size_t capacity = 0;
+  int i = 0;
+  luaL_checkstack( L, 3, "moon_getpoolstats" );
+  ti = moon_push_metatable_( L, tname );
+  if( ti == NULL || ti->pool == NULL )
+    luaL_error( L, "no pool for type '%s' defined", tname );
+  pool = ti->pool;
+  capacity = pool->nslabs * pool->nslots;
+  lua_createtable( L, 0, 7 );
+  lua_pushinteger( L, (lua_Integer)pool->nslabs );
+  lua_setfield( L, -2, "slabs" );
+  lua_pushinteger( L, (lua_Integer)pool->nslots );
+  lua_setfield( L, -2, "slots" );
+  lua_pushinteger( L, (lua_Integer)pool->slot_size );
+  lua_setfield( L, -2, "slotsize" );
+  lua_pushinteger( L, (lua_Integer)pool->used );
+  lua_setfield( L, -2, "used" );
+  lua_pushinteger( L, (lua_Integer)(capacity - pool->used) );
+  lua_setfield( L, -2, "free" );
+  /* fraction of allocated slots that are unused */
+  lua_pushnumber( L, capacity > 0 ?
+    (lua_Number)(capacity - pool->used) / (lua_Number)capacity : 0 );
+  lua_setfield( L, -2, "fragmentation" );
+  lua_createtable( L, (int)pool->nslabs, 0 );
+  for( s = pool->slabs; s != NULL; s = s->anext ) {
+    lua_pushinteger( L, (lua_Integer)s->used );
+    lua_rawseti( L, -2, ++i );
+  }
+  lua_setfield( L, -2, "occupancy" );
+  lua_replace( L, -2 );
+}
+
+
+/* Payload of array objects created via `moon_newarray`. The elements
+ * are stored contiguously in a separate memory block which is either
+ * owned by the array (allocated via the Lua allocator), an external
+ * buffer provided by the user, or a memory mapped file. Element views
+ * are field objects with an epoch record that refers to `epoch`, so
+ * resizing the array invalidates all of them. */
+typedef struct {
+  void* data;
+  size_t n;
+  size_t esize;
+  moon_typeinfo_* elem;
+  lua_Alloc alloc; /* 0 for external buffers */
+  void* ud;
+  moon_object_destructor destructor; /* for external buffers */
+  size_t mapsize; /* > 0 for memory mapped files */
+  unsigned epoch;
+  int readonly; /* for read-only memory mapped files */
+} moon_array_;
+
+
+static void moon_array_release_( void* p ) {
+  moon_array_* a = (moon_array_*)p;
+  if( a->alloc != 0 ) {
+    if( a->data != NULL )
+      a->alloc( a->ud, a->data, a->n * a->esize, 0 );
+#ifdef MOON_HAVE_MMAP_
+  } else if( a->mapsize > 0 ) {
+    munmap( a->data, a->mapsize );
+#endif
+  } else if( a->destructor != 0 && a->data != NULL )
+    a->destructor( a->data );
+  a->data = NULL;
+  a->n = 0;
+  a->epoch++;
+}
+
+
+/* Creates a new array object using the array metatable at the top of
+ * the Lua stack (which is replaced by the new object). The owned
+ * storage is zero-initialized. */
+static moon_array_* moon_array_new_( lua_State* L, moon_typeinfo_* ti,
+                                     moon_typeinfo_* elem, size_t n,
+                                     void* buffer,
+                                     moon_object_destructor destructor ) {
+  moon_array_* a = NULL;
+  if( n > 0 && n > (size_t)-1 / elem->size )
+    luaL_error( L, "array of type '%s' is too large", ti->name );
+  a = (moon_array_*)moon_newobject_( L, sizeof( moon_array_ ), ti,
+                                     moon_array_release_ );
+  a->data = buffer;
+  a->n = 0;
+  a->esize = elem->size;
+  a->elem = elem;
+  a->alloc = 0;
+  a->ud = NULL;
+  a->destructor = destructor;
+  a->mapsize = 0;
+  a->epoch = 0;
+  a->readonly = 0;
+  if( buffer == NULL ) {
+    a->alloc = lua_getallocf( L, &a->ud );
+    if( n > 0 ) {
+      a->data = a->alloc( a->ud, NULL, 0, n * elem->size );
+      if( a->data == NULL )
+        luaL_error( L, "memory allocation error" );
+      memset( a->data, 0, n * elem->size );
+    }
+  }
+  a->n = n;
+  MOON_STAT_( ti, MOON_STATS_NEWOBJECT_ );
+  return a;
+}
+
+
+/* Pushes the metatable of the array type `tname` and returns the type
+ * descriptors for the array and its element type. */
+static moon_typeinfo_* moon_array_metatable_( lua_State* L,
+                                              char const* tname,
+                                              moon_typeinfo_** elem ) {
+  moon_typeinfo_* ti = moon_push_metatable_( L, tname );
+  *elem = NULL;
+  lua_getfield( L, -1, "__moon_element" );
+  if( ti != NULL && lua_type( L, -1 ) == LUA_TSTRING ) {
+    unsigned short id = moon_types_find_( ti->types,
+                                          lua_tostring( L, -1 ) );
+    if( id != 0 && ti->types->v[ id ]->size > 0 )
+      *elem = ti->types->v[ id ];
+  }
+  lua_pop( L, 1 );
+  if( *elem == NULL )
+    luaL_error( L, "'%s' is not an array type", tname );
+  return ti;
+}
+
+
+static void moon_array_checkwritable_( lua_State* L,
+                                       moon_array_ const* a ) {
+  if( a->readonly )
+    luaL_error( L, "attempt to modify read-only array" );
+}
+
+
+static moon_array_* moon_array_check_( lua_State* L, int i ) {
+  return (moon_array_*)moon_checkobject( L, i, lua_tostring( L,
+                                         lua_upvalueindex( 1 ) ) );
+}
+
+
+/* Converts the value at index `i` into a 0-based element index if it
+ * is an integer in the range 1 to `n`. */
+static int moon_array_key_( lua_State* L, int i, size_t n, size_t* k ) {
+  if( lua_type( L, i ) == LUA_TNUMBER ) {
+    lua_Number x = lua_tonumber( L, i );
+    if( x >= 1 && x <= (lua_Number)n && x == (lua_Number)(size_t)x ) {
+      *k = (size_t)x - 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* Checks the optional range arguments `i` and `j` (1-based,
+ * inclusive, defaulting to the whole array) of the bulk operations. */
+static void moon_array_range_( lua_State* L, int i, moon_array_* a,
+                               size_t* first, size_t* count ) {
+  lua_Integer lo = moon_optint( L, i, 1, MOON_INTEGER_MAX_, 1 );
+  lua_Integer hi = moon_optint( L, i+1, 0, MOON_INTEGER_MAX_,
+                                (lua_Integer)a->n );
+  luaL_argcheck( L, hi <= (lua_Integer)a->n, i+1, "index out of range" );
+  luaL_argcheck( L, lo <= hi+1, i, "index out of range" );
+  *first = (size_t)lo - 1;
+  *count = (size_t)(hi - lo + 1);
+}
+
+
+/* Kernels for the numeric reductions of array methods. They operate
+ * on one field (at a fixed offset) of every element, so consecutive
+ * values are `stride` bytes apart. Multiple accumulators break the
+ * dependency chain between loop iterations, so that the compiler can
+ * pipeline (and, where possible, vectorize) the loops. */
+#define MOON_KERNELS_( _n, _t ) \
+static lua_Number moon_sum_##_n##_( char const* p, size_t stride, \
+                                    size_t n ) { \
+  lua_Number s0 = 0, s1 = 0, s2 = 0, s3 = 0; \
+  size_t i = 0; \
+  for( ; i + 4 <= n; i += 4, p += 4*stride ) { \
+    s0 += (lua_Number)*(_t const*)p; \
+    s1 += (lua_Number)*(_t const*)(p+stride); \
+    s2 += (lua_Number)*(_t const*)(p+2*stride); \
+    s3 += (lua_Number)*(_t const*)(p+3*stride); \
+  } \
+  for( ; i < n; ++i, p += stride ) \
+    s0 += (lua_Number)*(_t const*)p; \
+  return (s0 + s1) + (s2 + s3); \
+} \
+static void moon_minmax_##_n##_( char const* p, size_t stride, \
+                                 size_t n, lua_Number* lo, \
+                                 lua_Number* hi ) { \
+  _t l0 = *(_t const*)p, l1 = l0, h0 = l0, h1 = l0; \
+  size_t i = 1; \
+  for( p += stride; i + 2 <= n; i += 2, p += 2*stride ) { \
+    _t v0 = *(_t const*)p, v1 = *(_t const*)(p+stride); \
+    l0 = v0 < l0 ? v0 : l0; \
+    h0 = v0 > h0 ? v0 : h0; \
+    l1 = v1 < l1 ? v1 : l1; \
+    h1 = v1 > h1 ? v1 : h1; \
+  } \
+  if( i < n ) { \
+    _t v0 = *(_t const*)p; \
+    l0 = v0 < l0 ? v0 : l0; \
+    h0 = v0 > h0 ? v0 : h0; \
+  } \
+  *lo = (lua_Number)(l1 < l0 ? l1 : l0); \
+  *hi = (lua_Number)(h1 > h0 ? h1 : h0); \
+}
+
+#ifdef MOON_HAVE_STDINT_
+MOON_KERNELS_( int8, int8_t )
+MOON_KERNELS_( uint8, uint8_t )
+MOON_KERNELS_( int16, int16_t )
+MOON_KERNELS_( uint16, uint16_t )
+MOON_KERNELS_( int32, int32_t )
+MOON_KERNELS_( uint32, uint32_t )
+MOON_KERNELS_( int64, int64_t )
+MOON_KERNELS_( uint64, uint64_t )
+#endif
+MOON_KERNELS_( int, int )
+MOON_KERNELS_( float, float )
+#ifndef MOON_HAVE_SSE2_
+MOON_KERNELS_( double, double )
+#endif
+
+
+#ifdef MOON_HAVE_SSE2_
+/* SSE2 is part of the x86-64 base line, so no runtime check is
+ * necessary. Strided values are loaded pairwise into one register,
+ * densely packed values (e.g. arrays of plain doubles) are loaded
+ * directly. */
+static lua_Number moon_sum_double_( char const* p, size_t stride,
+                                    size_t n ) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  double r[ 2 ];
+  size_t i = 0;
+  if( stride == sizeof( double ) ) {
+    for( ; i + 4 <= n; i += 4, p += 4*sizeof( double ) ) {
+      s0 = _mm_add_pd( s0, _mm_loadu_pd( (double const*)p ) );
+      s1 = _mm_add_pd( s1, _mm_loadu_pd( (double const*)p + 2 ) );
+    }
+  } else {
+    for( ; i + 4 <= n; i += 4, p += 4*stride ) {
+      s0 = _mm_add_pd( s0, _mm_loadh_pd( _mm_load_sd(
+        (double const*)p ), (double const*)(p+stride) ) );
+      s1 = _mm_add_pd( s1, _mm_loadh_pd( _mm_load_sd(
+        (double const*)(p+2*stride) ), (double const*)(p+3*stride) ) );
+    }
+  }
+  for( ; i < n; ++i, p += stride )
+    s0 = _mm_add_sd( s0, _mm_load_sd( (double const*)p ) );
+  _mm_storeu_pd( r, _mm_add_pd( s0, s1 ) );
+  return (lua_Number)(r[ 0 ] + r[ 1 ]);
+}
+
+/* _mm_min_pd/_mm_max_pd return their second operand if either one is
+ * NaN, so NaN elements are skipped like in the portable kernels. */
+static void moon_minmax_double_( char const* p, size_t stride,
+                                 size_t n, lua_Number* lo,
+                                 lua_Number* hi ) {
+  __m128d l = _mm_load1_pd( (double const*)p ), h = l;
+  double r[ 2 ];
+  size_t i = 1;
+  for( p += stride; i + 2 <= n; i += 2, p += 2*stride ) {
+    __m128d v = _mm_loadh_pd( _mm_load_sd( (double const*)p ),
+                              (double const*)(p+stride) );
+    l = _mm_min_pd( v, l );
+    h = _mm_max_pd( v, h );
+  }
+  if( i < n ) {
+    __m128d v = _mm_load1_pd( (double const*)p );
+    l = _mm_min_pd( v, l );
+    h = _mm_max_pd( v, h );
+  }
+  _mm_storeu_pd( r, l );
+  *lo = (lua_Number)(r[ 1 ] < r[ 0 ] ? r[ 1 ] : r[ 0 ]);
+  _mm_storeu_pd( r, h );
+  *hi = (lua_Number)(r[ 1 ] > r[ 0 ] ? r[ 1 ] : r[ 0 ]);
+}
+#endif
+
+
+static void moon_scale_float_( char* p, size_t stride, size_t n,
+                               lua_Number a, lua_Number b ) {
+  size_t i = 0;
+  for( ; i < n; ++i, p += stride )
+    *(float*)p = (float)(*(float*)p * a + b);
+}
+
+static void moon_scale_double_( char* p, size_t stride, size_t n,
+                                lua_Number a, lua_Number b ) {
+  size_t i = 0;
+#ifdef MOON_HAVE_SSE2_
+  __m128d va = _mm_set1_pd( (double)a ), vb = _mm_set1_pd( (double)b );
+  for( ; i + 2 <= n; i += 2, p += 2*stride ) {
+    __m128d v = _mm_loadh_pd( _mm_load_sd( (double const*)p ),
+                              (double const*)(p+stride) );
+    v = _mm_add_pd( _mm_mul_pd( v, va ), vb );
+    _mm_storel_pd( (double*)p, v );
+    _mm_storeh_pd( (double*)(p+stride), v );
+  }
+#endif
+  for( ; i < n; ++i, p += stride )
+    *(double*)p = (double)(*(double*)p * a + b);
+}
+
+
+#ifdef MOON_HAVE_AVX2_
+/* The AVX2 kernels are compiled for AVX2 via a function attribute (so
+ * that the rest of the file doesn't require it), and are only used
+ * if the CPU supports AVX2 (see `moon_have_avx2_`). They process four
+ * values at a time: strided values are collected using gather loads,
+ * densely packed values are loaded directly. `float` and `int` values
+ * are widened to `double` for the sums. */
+#define MOON_AVX2_ __attribute__(( target( "avx2" ) ))
+#define MOON_AVX2_PD_( _v ) (_v)
+#define MOON_AVX2_STOREI_( _p, _v ) _mm_storeu_si128( (__m128i*)(_p), _v )
+
+static int moon_have_avx2_( void ) {
+  static int have = -1;
+  if( have < 0 ) {
+    __builtin_cpu_init();
+    have = __builtin_cpu_supports( "avx2" ) != 0;
+  }
+  return have;
+}
+
+/* byte offsets of four consecutive values for the gather loads */
+MOON_AVX2_ static __m256i moon_gather_idx_( size_t stride ) {
+  return _mm256_set_epi64x( 3*stride, 2*stride, stride, 0 );
+}
+
+MOON_AVX2_ static __m256d moon_load4_double_( char const* p,
+                                             size_t stride,
+                                             __m256i idx ) {
+  return stride == sizeof( double )
+    ? _mm256_loadu_pd( (double const*)p )
+    : _mm256_i64gather_pd( (double const*)p, idx, 1 );
+}
+
+MOON_AVX2_ static __m128 moon_load4_float_( char const* p,
+                                           size_t stride,
+                                           __m256i idx ) {
+  return stride == sizeof( float )
+    ? _mm_loadu_ps( (float const*)p )
+    : _mm256_i64gather_ps( (float const*)p, idx, 1 );
+}
+
+MOON_AVX2_ static __m128i moon_load4_int_( char const* p,
+                                          size_t stride,
+                                          __m256i idx ) {
+  return stride == sizeof( int )
+    ? _mm_loadu_si128( (__m128i const*)p )
+    : _mm256_i64gather_epi32( (int const*)p, idx, 1 );
+}
+
+#define MOON_AVX2_KERNELS_( _n, _t, _v, _cvt, _set1, _min, _max, \
+                            _store ) \
+MOON_AVX2_ static lua_Number moon_sum_##_n##_avx2_( char const* p, \
+                                                    size_t stride, \
+                                                    size_t n ) { \
+  __m256i idx = moon_gather_idx_( stride ); \
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd(); \
+  double r[ 4 ]; \
+  size_t i = 0; \
+  for( ; i + 8 <= n; i += 8, p += 8*stride ) { \
+    s0 = _mm256_add_pd( s0, _cvt( moon_load4_##_n##_( p, stride, \
+                                                      idx ) ) ); \
+    s1 = _mm256_add_pd( s1, _cvt( moon_load4_##_n##_( p+4*stride, \
+                                                      stride, idx ) ) ); \
+  } \
+  _mm256_storeu_pd( r, _mm256_add_pd( s0, s1 ) ); \
+  for( ; i < n; ++i, p += stride ) \
+    r[ 0 ] += (lua_Number)*(_t const*)p; \
+  return (lua_Number)((r[ 0 ] + r[ 1 ]) + (r[ 2 ] + r[ 3 ])); \
+} \
+MOON_AVX2_ static void moon_minmax_##_n##_avx2_( char const* p, \
+                                                 size_t stride, \
+                                                 size_t n, \
+                                                 lua_Number* lo, \
+                                                 lua_Number* hi ) { \
+  __m256i idx = moon_gather_idx_( stride ); \
+  _v l = _set1( *(_t const*)p ), h = l; \
+  _t rl[ 4 ], rh[ 4 ]; \
+  size_t i = 1, k = 0; \
+  for( p += stride; i + 4 <= n; i += 4, p += 4*stride ) { \
+    _v v = moon_load4_##_n##_( p, stride, idx ); \
+    l = _min( v, l ); \
+    h = _max( v, h ); \
+  } \
+  _store( rl, l ); \
+  _store( rh, h ); \
+  for( ; i < n; ++i, p += stride ) { \
+    _t v = *(_t const*)p; \
+    rl[ 0 ] = v < rl[ 0 ] ? v : rl[ 0 ]; \
+    rh[ 0 ] = v > rh[ 0 ] ? v : rh[ 0 ]; \
+  } \
+  for( k = 1; k < 4; ++k ) { \
+    rl[ 0 ] = rl[ k ] < rl[ 0 ] ? rl[ k ] : rl[ 0 ]; \
+    rh[ 0 ] = rh[ k ] > rh[ 0 ] ? rh[ k ] : rh[ 0 ]; \
+  } \
+  *lo = (lua_Number)rl[ 0 ]; \
+  *hi = (lua_Number)rh[ 0 ]; \
+}
+
+/* The min/max instructions for floating point values return their
+ * second operand if either one is NaN, so NaN elements are skipped
+ * like in the portable kernels. */
+MOON_AVX2_KERNELS_( double, double, __m256d, MOON_AVX2_PD_,
+                    _mm256_set1_pd, _mm256_min_pd, _mm256_max_pd,
+                    _mm256_storeu_pd )
+MOON_AVX2_KERNELS_( float, float, __m128, _mm256_cvtps_pd,
+                    _mm_set1_ps, _mm_min_ps, _mm_max_ps, _mm_storeu_ps )
+MOON_AVX2_KERNELS_( int, int, __m128i, _mm256_cvtepi32_pd,
+                    _mm_set1_epi32, _mm_min_epi32, _mm_max_epi32,
+                    MOON_AVX2_STOREI_ )
+
+/* The scale kernels only have a vectorized loop for densely packed
+ * values (AVX2 has no scatter stores), the rest is left to the
+ * portable kernels. */
+MOON_AVX2_ static void moon_scale_double_avx2_( char* p, size_t stride,
+                                                size_t n, lua_Number a,
+                                                lua_Number b ) {
+  size_t i = 0;
+  if( stride == sizeof( double ) ) {
+    __m256d va = _mm256_set1_pd( (double)a );
+    __m256d vb = _mm256_set1_pd( (double)b );
+    for( ; i + 4 <= n; i += 4, p += 4*sizeof( double ) )
+      _mm256_storeu_pd( (double*)p, _mm256_add_pd( _mm256_mul_pd(
+        _mm256_loadu_pd( (double const*)p ), va ), vb ) );
+  }
+  moon_scale_double_( p, stride, n-i, a, b );
+}
+
+MOON_AVX2_ static void moon_scale_float_avx2_( char* p, size_t stride,
+                                               size_t n, lua_Number a,
+                                               lua_Number b ) {
+  size_t i = 0;
+  if( stride == sizeof( float ) ) {
+    __m256d va = _mm256_set1_pd( (double)a );
+    __m256d vb = _mm256_set1_pd( (double)b );
+    for( ; i + 4 <= n; i += 4, p += 4*sizeof( float ) )
+      _mm_storeu_ps( (float*)p, _mm256_cvtpd_ps( _mm256_add_pd(
+        _mm256_mul_pd( _mm256_cvtps_pd( _mm_loadu_ps(
+          (float const*)p ) ), va ), vb ) ) );
+  }
+  moon_scale_float_( p, stride, n-i, a, b );
+}
+#endif
+
+
+typedef struct {
+  lua_Number (*sum)( char const*, size_t, size_t );
+  void (*minmax)( char const*, size_t, size_t, lua_Number*,
+                  lua_Number* );
+  void (*scale)( char*, size_t, size_t, lua_Number, lua_Number );
+} moon_kernels_;
+
+
+/* Looks up the field named by the string at index `i` in the fields
+ * of the element type of array `a`, and returns the kernels for it
+ * (or raises an error for non-numeric fields). */
+static moon_field_ const* moon_array_field_( lua_State* L, int i,
+                                             moon_array_ const* a,
+                                             moon_kernels_* k ) {
+  moon_field_ const* f = NULL;
+  char const* name = luaL_checkstring( L, i );
+  luaL_checkstack( L, 2, "moon_array_field_" );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, a->elem->mtref );
+  lua_getfield( L, -1, "__moon_fields" );
+  if( lua_istable( L, -1 ) ) {
+    lua_pushvalue( L, i );
+    lua_rawget( L, -2 );
+    f = (moon_field_ const*)lua_touserdata( L, -1 );
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 2 );
+  if( f == NULL )
+    luaL_argerror( L, i, lua_pushfstring( L, "no field '%s' in type '%s'",
+                                          name, a->elem->name ) );
+  k->scale = 0;
+  switch( f->kind & ~MOON_FIELD_READONLY ) {
+#define MOON_KERNEL_CASE_( _k, _n ) \
+    case _k: \
+      k->sum = moon_sum_##_n##_; \
+      k->minmax = moon_minmax_##_n##_; \
+      break;
+#ifdef MOON_HAVE_STDINT_
+    MOON_KERNEL_CASE_( MOON_FIELD_INT8, int8 )
+    MOON_KERNEL_CASE_( MOON_FIELD_UINT8, uint8 )
+    MOON_KERNEL_CASE_( MOON_FIELD_INT16, int16 )
+    MOON_KERNEL_CASE_( MOON_FIELD_UINT16, uint16 )
+    MOON_KERNEL_CASE_( MOON_FIELD_INT32, int32 )
+    MOON_KERNEL_CASE_( MOON_FIELD_UINT32, uint32 )
+    MOON_KERNEL_CASE_( MOON_FIELD_INT64, int64 )
+    MOON_KERNEL_CASE_( MOON_FIELD_UINT64, uint64 )
+#endif
+    MOON_KERNEL_CASE_( MOON_FIELD_INT, int )
+    case MOON_FIELD_FLOAT:
+      k->sum = moon_sum_float_;
+      k->minmax = moon_minmax_float_;
+      k->scale = moon_scale_float_;
+      break;
+    case MOON_FIELD_DOUBLE:
+      k->sum = moon_sum_double_;
+      k->minmax = moon_minmax_double_;
+      k->scale = moon_scale_double_;
+      break;
+#undef MOON_KERNEL_CASE_
+    default:
+      luaL_argerror( L, i, lua_pushfstring( L, "field '%s' is not numeric",
+                                            name ) );
+  }
+#ifdef MOON_HAVE_AVX2_
+  if( moon_have_avx2_() ) {
+    switch( f->kind & ~MOON_FIELD_READONLY ) {
+#  ifdef MOON_HAVE_STDINT_
+      case MOON_FIELD_INT32: /* `int` is 32 bits on x86 */
+#  endif
+      case MOON_FIELD_INT:
+        k->sum = moon_sum_int_avx2_;
+        k->minmax = moon_minmax_int_avx2_;
+        break;
+      case MOON_FIELD_FLOAT:
+        k->sum = moon_sum_float_avx2_;
+        k->minmax = moon_minmax_float_avx2_;
+        k->scale = moon_scale_float_avx2_;
+        break;
+      case MOON_FIELD_DOUBLE:
+        k->sum = moon_sum_double_avx2_;
+        k->minmax = moon_minmax_double_avx2_;
+        k->scale = moon_scale_double_avx2_;
+        break;
+    }
+  }
+#endif
+  if( f->kind & MOON_FIELD_READONLY )
+    k->scale = 0;
+  return f;
+}
+
+
+MOON_LLINKAGE_BEGIN
+static int moon_array_index_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  size_t k = 0;
+  if( moon_array_key_( L, 2, a->n, &k ) ) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, a->elem->mtref );
+    MOON_STAT_( a->elem, MOON_STATS_NEWFIELD_ );
+    *moon_newfield_epoch_( L, a->elem, 1, &a->epoch ) =
+      MOON_PTR_( a->data, k * a->esize );
+    if( a->readonly )
+      ((moon_object_header*)lua_touserdata( L, -1 ))->flags |=
+        MOON_OBJECT_IS_READONLY_;
+  } else
+    lua_pushnil( L );
+  return 1;
+}
+
+
+static int moon_array_newindex_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  size_t k = 0;
+  void* p = NULL;
+  luaL_argcheck( L, moon_array_key_( L, 2, a->n, &k ), 2,
+                 "index out of range" );
+  moon_array_checkwritable_( L, a );
+  p = moon_checkobject( L, 3, a->elem->name );
+  memmove( MOON_PTR_( a->data, k * a->esize ), p, a->esize );
+  return 0;
+}
+
+
+static int moon_array_len_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  lua_pushinteger( L, (lua_Integer)a->n );
+  return 1;
+}
+
+
+/* a:get( [i [, j]] ) returns a table of copies of the elements */
+static int moon_array_get_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  size_t first = 0, count = 0, k = 0;
+  moon_array_range_( L, 2, a, &first, &count );
+  luaL_argcheck( L, count <= INT_MAX, 2, "range too large" );
+  lua_createtable( L, (int)count, 0 );
+  for( k = 0; k < count; ++k ) {
+    void* p = NULL;
+    lua_rawgeti( L, LUA_REGISTRYINDEX, a->elem->mtref );
+    p = moon_newobject_( L, a->esize, a->elem, 0 );
+    memcpy( p, MOON_PTR_( a->data, (first+k) * a->esize ),
+            a->esize );
+    lua_rawseti( L, -2, (int)(k+1) );
+  }
+  MOON_STATS_ADD_( a->elem, MOON_STATS_NEWOBJECT_, (unsigned long)count );
+  return 1;
+}
+
+
+/* a:set( i, t ) copies the objects in the sequence `t` into the array
+ * starting at index `i` */
+static int moon_array_set_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  lua_Integer i = moon_checkint( L, 2, 1, MOON_INTEGER_MAX_ );
+  size_t n = 0, k = 0;
+  luaL_checktype( L, 3, LUA_TTABLE );
+  moon_array_checkwritable_( L, a );
+#if LUA_VERSION_NUM < 502
+  n = lua_objlen( L, 3 );
+#else
+  n = lua_rawlen( L, 3 );
+#endif
+  luaL_argcheck( L, (size_t)(i-1) <= a->n && n <= a->n - (size_t)(i-1),
+                 3, "too many elements" );
+  /* check all elements first, so that errors don't leave the array
+   * partially modified */
+  for( k = 1; k <= n; ++k ) {
+    lua_rawgeti( L, 3, (int)k );
+    if( moon_testobject( L, -1, a->elem->name ) == NULL )
+      luaL_argerror( L, 3, lua_pushfstring( L, "%s expected at index %d",
+                                            a->elem->name, (int)k ) );
+    lua_pop( L, 1 );
+  }
+  for( k = 0; k < n; ++k ) {
+    void* p = NULL;
+    lua_rawgeti( L, 3, (int)(k+1) );
+    p = moon_checkobject( L, -1, a->elem->name );
+    memmove( MOON_PTR_( a->data, ((size_t)(i-1)+k) * a->esize ),
+             p, a->esize );
+    lua_pop( L, 1 );
+  }
+  return 0;
+}
+
+
+/* a:resize( n ) changes the number of elements of an array with owned
+ * storage, and invalidates all existing element views */
+static int moon_array_resize_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  size_t n = (size_t)moon_checkint( L, 2, 0, MOON_INTEGER_MAX_ );
+  size_t esz = a->esize;
+  void* p = NULL;
+  if( a->alloc == 0 )
+    luaL_error( L, "cannot resize array with external buffer" );
+  if( n > (size_t)-1 / esz )
+    luaL_argerror( L, 2, "array too large" );
+  if( n != a->n ) {
+    p = a->alloc( a->ud, a->data, a->n * esz, n * esz );
+    if( p == NULL && n > 0 )
+      luaL_error( L, "memory allocation error" );
+    if( n > a->n )
+      memset( MOON_PTR_( p, a->n * esz ), 0, (n - a->n) * esz );
+    a->data = p;
+    a->n = n;
+    a->epoch++;
+  }
+  return 0;
+}
+
+
+/* a:slice( [i [, j]] ) copies a range into a new array */
+static int moon_array_slice_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  moon_typeinfo_* ti = NULL;
+  moon_array_* b = NULL;
+  size_t first = 0, count = 0;
+  moon_array_range_( L, 2, a, &first, &count );
+  ti = moon_typeinfo_get_( L, 1, (moon_object_header*)
+                           lua_touserdata( L, 1 ) );
+  if( ti == NULL )
+    luaL_error( L, "no type descriptor for array" );
+  lua_getmetatable( L, 1 );
+  b = moon_array_new_( L, ti, a->elem, count, NULL, 0 );
+  if( count > 0 )
+    memcpy( b->data, MOON_PTR_( a->data, first * a->esize ),
+            count * a->esize );
+  return 1;
+}
+
+
+/* a:sum( field [, i [, j]] ) */
+static int moon_array_sum_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  moon_kernels_ k;
+  moon_field_ const* f = moon_array_field_( L, 2, a, &k );
+  size_t first = 0, count = 0;
+  moon_array_range_( L, 3, a, &first, &count );
+  lua_pushnumber( L, k.sum( (char const*)a->data + first * a->esize +
+                            f->offset, a->esize, count ) );
+  return 1;
+}
+
+
+/* a:minmax( field [, i [, j]] ) */
+static int moon_array_minmax_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  moon_kernels_ k;
+  moon_field_ const* f = moon_array_field_( L, 2, a, &k );
+  size_t first = 0, count = 0;
+  lua_Number lo = 0, hi = 0;
+  moon_array_range_( L, 3, a, &first, &count );
+  if( count == 0 )
+    return 0;
+  k.minmax( (char const*)a->data + first * a->esize + f->offset,
+            a->esize, count, &lo, &hi );
+  lua_pushnumber( L, lo );
+  lua_pushnumber( L, hi );
+  return 2;
+}
+
+
+/* a:scale( field, factor [, offset [, i [, j]]] ) */
+static int moon_array_scale_( lua_State* L ) {
+  moon_array_* a = moon_array_check_( L, 1 );
+  moon_kernels_ k;
+  moon_field_ const* f = moon_array_field_( L, 2, a, &k );
+  lua_Number factor = luaL_checknumber( L, 3 );
+  lua_Number offset = luaL_optnumber( L, 4, 0 );
+  size_t first = 0, count = 0;
+  luaL_argcheck( L, k.scale != 0, 2,
+                 "not a writable floating point field" );
+  moon_array_checkwritable_( L, a );
+  moon_array_range_( L, 5, a, &first, &count );
+  k.scale( (char*)a->data + first * a->esize + f->offset, a->esize,
+           count, factor, offset );
+  return 0;
+}
+MOON_LLINKAGE_END
+
+
+MOON_API void moon_defarray( lua_State* L, char const* tname,
+                             char const* elemtname ) {
+  luaL_Reg const methods[] = {
+    { "get", moon_array_get_ },
+    { "set", moon_array_set_ },
+    { "resize", moon_array_resize_ },
+    { "slice", moon_array_slice_ },
+    { "sum", moon_array_sum_ },
+    { "minmax", moon_array_minmax_ },
+    { "scale", moon_array_scale_ },
+    { "__index", moon_array_index_ },
+    { "__newindex", moon_array_newindex_ },
+    { "__len", moon_array_len_ },
+    { NULL, NULL }
+  };
+  moon_typeinfo_* elem = NULL;
+  luaL_checkstack( L, 3, "moon_defarray" );
+  elem = moon_push_metatable_( L, elemtname );
+  if( elem == NULL || elem->size == 0 )
+    luaL_error( L, "type '%s' is incomplete (size is 0)", elemtname );
+  lua_pop( L, 1 );
+  lua_pushstring( L, tname );
+  moon_defobject( L, tname, sizeof( moon_array_ ), methods, 1 );
+  luaL_getmetatable( L, tname );
+  lua_pushstring( L, elemtname );
+  lua_setfield( L, -2, "__moon_element" );
+  lua_pop( L, 1 );
+}
+
+
+MOON_API void* moon_newarray( lua_State* L, char const* tname,
+                              size_t n, void* buffer,
+                              moon_object_destructor destructor ) {
+  moon_typeinfo_* ti = NULL;
+  moon_typeinfo_* elem = NULL;
+  luaL_checkstack( L, 2, "moon_newarray" );
+  ti = moon_array_metatable_( L, tname, &elem );
+  return moon_array_new_( L, ti, elem, n, buffer, destructor )->data;
+}
+
+
+MOON_API void* moon_maparray( lua_State* L, char const* tname,
+                              char const* path, int mode,
+                              size_t* n ) {
+#ifdef MOON_HAVE_MMAP_
+  moon_typeinfo_* ti = NULL;
+  moon_typeinfo_* elem = NULL;
+  moon_array_* a = NULL;
+  struct stat st;
+  void* p = NULL;
+  size_t sz = 0;
+  int fd = -1, err = 0;
+  luaL_checkstack( L, 2, "moon_maparray" );
+  if( mode != MOON_MAP_PRIVATE && mode != MOON_MAP_SHARED &&
+      mode != MOON_MAP_READONLY )
+    luaL_error( L, "invalid mapping mode for '%s'", path );
+  ti = moon_array_metatable_( L, tname, &elem );
+  /* the (empty) array is created first, so that the mapping can't
+   * leak in case of memory errors */
+  a = moon_array_new_( L, ti, elem, 0, NULL, 0 );
+  a->alloc = 0;
+  a->readonly = mode == MOON_MAP_READONLY;
+  fd = open( path, mode == MOON_MAP_SHARED ? O_RDWR : O_RDONLY );
+  if( fd < 0 || fstat( fd, &st ) != 0 ) {
+    err = errno;
+    if( fd >= 0 )
+      close( fd );
+    luaL_error( L, "cannot map '%s': %s", path, strerror( err ) );
+  }
+  sz = (size_t)st.st_size;
+  if( st.st_size < 0 || (off_t)sz != st.st_size ||
+      sz % elem->size != 0 ) {
+    close( fd );
+    luaL_error( L, "size of '%s' is not a multiple of the size of '%s'",
+                path, elem->name );
   }
-  obj->cleanup_offset = off1;
-  obj->object_offset = off2;
-  obj->vcheck_offset = 0;
-  obj->flags = MOON_OBJECT_IS_VALID | MOON_OBJECT_IS_POINTER;
-  lua_insert( L, -2 );
-  lua_setmetatable( L, -2 );
+  if( sz > 0 ) {
+    /* private mappings are copy-on-write, so that writing to the
+     * elements (e.g. via element objects or C code) doesn't crash,
+     * but the file isn't changed; read-only mappings reject writes
+     * via element objects, and writes from C code crash */
+    p = mmap( NULL, sz, mode == MOON_MAP_READONLY ? PROT_READ :
+                        PROT_READ | PROT_WRITE,
+              mode == MOON_MAP_PRIVATE ? MAP_PRIVATE : MAP_SHARED,
+              fd, 0 );
+    err = errno;
+  }
+  close( fd );
+  if( p == MAP_FAILED )
+    luaL_error( L, "cannot map '%s': %s", path, strerror( err ) );
+  a->data = p;
+  a->n = sz / elem->size;
+  a->mapsize = sz;
+  if( n != NULL )
+    *n = a->n;
   return p;
+#else
+  (void)tname;
+  (void)path;
+  (void)mode;
+  (void)n;
+  luaL_error( L, "memory mapped arrays are not supported" );
+  return NULL;
+#endif
 }
 
 
-MOON_API void** moon_newfield( lua_State* L, char const* tname,
-                               int idx, int (*isvalid)( void* ),
-                               void* tagp ) {
-  moon_object_header* obj = NULL;
-  moon_object_vcheck_* nextcheck = NULL;
-  void** p = NULL;
-  size_t off1 = 0;
-#ifdef _MSC_VER
-#  pragma warning(push)
-#  pragma warning(disable: 4116)
+MOON_API void* moon_checkarray( lua_State* L, int idx,
+                                char const* tname, size_t* n ) {
+  moon_array_* a = NULL;
+  moon_typeinfo_* elem = NULL;
+  luaL_checkstack( L, 2, "moon_checkarray" );
+  moon_array_metatable_( L, tname, &elem );
+  lua_pop( L, 1 );
+  a = (moon_array_*)moon_checkobject( L, idx, tname );
+  if( n != NULL )
+    *n = a->n;
+  return a->data;
+}
+
+
+/* Pushes the metatable of one of the object types provided by moon
+ * itself (defining the type on first use) and returns its type
+ * descriptor. */
+static moon_typeinfo_* moon_builtin_type_( lua_State* L,
+                                           char const* tname,
+                                           size_t sz,
+                                           luaL_Reg const* methods ) {
+  moon_typeinfo_* ti = NULL;
+  luaL_getmetatable( L, tname );
+  if( lua_isnil( L, -1 ) )
+    moon_defobject( L, tname, sz, methods, 0 );
+  lua_pop( L, 1 );
+  ti = moon_push_metatable_( L, tname );
+  if( ti == NULL )
+    luaL_error( L, "no type descriptor for '%s'", tname );
+  return ti;
+}
+
+
+/* Buffer objects are (typed) views of a range of bytes owned by
+ * something else: the payload of another moon object (or the storage
+ * of a moon array), a Lua string, or an external C buffer with a
+ * release function. Root buffers (created by `moon_newbuffer`) run
+ * the release function when they are collected or killed. All other
+ * buffers are field objects that keep their owner alive via the
+ * uservalue and use the same validity record as element views, so a
+ * buffer becomes invalid as soon as its owner does. */
+typedef struct {
+  char* p;
+  size_t len;
+  moon_object_destructor release; /* root buffers only */
+  void* base; /* argument for `release` */
+  int readonly;
+} moon_buffer_;
+
+#define MOON_BUFFER_TNAME_ "moon.buffer"
+
+
+static void moon_buffer_release_( void* p ) {
+  moon_buffer_* b = (moon_buffer_*)p;
+  if( b->release != 0 )
+    b->release( b->base );
+  b->p = NULL;
+  b->len = 0;
+}
+
+
+/* Element types for the typed access methods of buffers. */
+static char const* const moon_buffer_types_[] = {
+#ifdef MOON_HAVE_STDINT_
+  "int8", "uint8", "int16", "uint16", "int32", "uint32", "int64",
+  "uint64",
 #endif
-  size_t off2 = MOON_ROUNDTO_( sizeof( moon_object_header ),
-                               MOON_PTR_ALIGNMENT_ );
-  luaL_checkstack( L, 3, "moon_newfield" );
-  if( idx != 0 ) {
-    moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
-    idx = moon_absindex( L, idx );
-    if( h != NULL && lua_getmetatable( L, idx ) ) {
-      lua_getfield( L, -1, "__moon_version" );
-      if( lua_tointeger( L, -1 ) == MOON_VERSION ) {
-        if( h->vcheck_offset > 0 ) {
-          moon_object_vcheck_* vc = NULL;
-          vc = (moon_object_vcheck_*)MOON_PTR_( h, h->vcheck_offset );
-          if( isvalid == 0 ) { /* inherit vcheck from idx object */
-            isvalid = vc->check;
-            tagp = vc->tagp;
-            nextcheck = vc->next;
-          } else /* add it to the chain */
-            nextcheck = vc;
-        }
-      }
+  "int", "float", "double", NULL
+};
+
+static unsigned const moon_buffer_kinds_[] = {
+#ifdef MOON_HAVE_STDINT_
+  MOON_FIELD_INT8, MOON_FIELD_UINT8, MOON_FIELD_INT16,
+  MOON_FIELD_UINT16, MOON_FIELD_INT32, MOON_FIELD_UINT32,
+  MOON_FIELD_INT64, MOON_FIELD_UINT64,
+#endif
+  MOON_FIELD_INT, MOON_FIELD_FLOAT, MOON_FIELD_DOUBLE
+};
+
+static size_t const moon_buffer_sizes_[] = {
+#ifdef MOON_HAVE_STDINT_
+  1, 2, 2, 2, 4, 4, 8, 8,
+#endif
+  sizeof( int ), sizeof( float ), sizeof( double )
+};
+
+
+static moon_buffer_* moon_buffer_check_( lua_State* L, int i ) {
+  return (moon_buffer_*)moon_checkobject( L, i, MOON_BUFFER_TNAME_ );
+}
+
+
+/* Checks the byte offset at index `i` for an access of `n` bytes. */
+static size_t moon_buffer_offset_( lua_State* L, int i,
+                                   moon_buffer_ const* b, size_t n ) {
+  size_t off = (size_t)moon_checkint( L, i, 0, MOON_INTEGER_MAX_ );
+  luaL_argcheck( L, off <= b->len && n <= b->len - off, i,
+                 "offset out of range" );
+  return off;
+}
+
+
+/* Checks the optional offset and length arguments at indices `i` and
+ * `i+1` (defaulting to the rest of the buffer). */
+static void moon_buffer_range_( lua_State* L, int i,
+                                moon_buffer_ const* b, size_t* off,
+                                size_t* len ) {
+  lua_Integer o = moon_optint( L, i, 0, MOON_INTEGER_MAX_, 0 );
+  lua_Integer n = 0;
+  luaL_argcheck( L, (size_t)o <= b->len, i, "offset out of range" );
+  n = moon_optint( L, i+1, 0, MOON_INTEGER_MAX_,
+                   (lua_Integer)(b->len - (size_t)o) );
+  luaL_argcheck( L, (size_t)n <= b->len - (size_t)o, i+1,
+                 "length out of range" );
+  *off = (size_t)o;
+  *len = (size_t)n;
+}
+
+
+/* Pushes the metatable of the buffer type (defining the type on
+ * first use) and returns its type descriptor. */
+static moon_typeinfo_* moon_buffer_type_( lua_State* L );
+
+
+/* Pushes a new buffer referring to `len` bytes at `p` which are owned
+ * by the value at (absolute) index `idx`. `epochp` is an optional
+ * generation counter of the owner. */
+static moon_buffer_* moon_buffer_view_( lua_State* L, int idx,
+                                        unsigned const* epochp,
+                                        char* p, size_t len,
+                                        int readonly ) {
+  moon_typeinfo_* ti = moon_buffer_type_( L );
+  moon_object_header* obj = NULL;
+  moon_buffer_* b = NULL;
+  MOON_STAT_( ti, MOON_STATS_NEWFIELD_ );
+  obj = moon_newepoch_( L, ti, idx, epochp, sizeof( moon_buffer_ ) );
+  b = (moon_buffer_*)MOON_PTR_( obj, obj->object_offset );
+  b->p = p;
+  b->len = len;
+  b->readonly = readonly;
+  return b;
+}
+
+
+MOON_LLINKAGE_BEGIN
+static int moon_buffer_len_( lua_State* L ) {
+  moon_buffer_* b = moon_buffer_check_( L, 1 );
+  lua_pushinteger( L, (lua_Integer)b->len );
+  return 1;
+}
+
+
+/* b:get( type, offset ) */
+static int moon_buffer_get_( lua_State* L ) {
+  moon_buffer_* b = moon_buffer_check_( L, 1 );
+  int t = luaL_checkoption( L, 2, NULL, moon_buffer_types_ );
+  size_t off = moon_buffer_offset_( L, 3, b, moon_buffer_sizes_[ t ] );
+  moon_object_alignment_u_ v;
+  /* the offset need not be aligned */
+  memcpy( &v, b->p + off, moon_buffer_sizes_[ t ] );
+  moon_field_push_( L, moon_buffer_kinds_[ t ], (char const*)&v );
+  return 1;
+}
+
+
+/* b:set( type, offset, value ) */
+static int moon_buffer_set_( lua_State* L ) {
+  moon_buffer_* b = moon_buffer_check_( L, 1 );
+  int t = luaL_checkoption( L, 2, NULL, moon_buffer_types_ );
+  size_t off = moon_buffer_offset_( L, 3, b, moon_buffer_sizes_[ t ] );
+  lua_Integer low = 0, high = 0;
+  moon_object_alignment_u_ v;
+  if( b->readonly )
+    luaL_error( L, "attempt to modify read-only buffer" );
+  moon_field_range_( moon_buffer_kinds_[ t ], &low, &high );
+  moon_field_store_( L, moon_buffer_kinds_[ t ], (char*)&v, 4, low,
+                     high );
+  memcpy( b->p + off, &v, moon_buffer_sizes_[ t ] );
+  return 0;
+}
+
+
+/* b:slice( [offset [, len]] ) creates a view of a part of the buffer
+ * without copying */
+static int moon_buffer_slice_( lua_State* L ) {
+  moon_buffer_* b = moon_buffer_check_( L, 1 );
+  size_t off = 0, len = 0;
+  moon_buffer_range_( L, 2, b, &off, &len );
+  moon_buffer_view_( L, 1, NULL, b->p + off, len, b->readonly );
+  return 1;
+}
+
+
+/* b:tostring( [offset [, len]] ) copies bytes into a Lua string */
+static int moon_buffer_tostring_( lua_State* L ) {
+  moon_buffer_* b = moon_buffer_check_( L, 1 );
+  size_t off = 0, len = 0;
+  moon_buffer_range_( L, 2, b, &off, &len );
+  lua_pushlstring( L, b->p + off, len );
+  return 1;
+}
+MOON_LLINKAGE_END
+
+
+static moon_typeinfo_* moon_buffer_type_( lua_State* L ) {
+  luaL_Reg const methods[] = {
+    { "get", moon_buffer_get_ },
+    { "set", moon_buffer_set_ },
+    { "slice", moon_buffer_slice_ },
+    { "tostring", moon_buffer_tostring_ },
+    { "__len", moon_buffer_len_ },
+    { NULL, NULL }
+  };
+  return moon_builtin_type_( L, MOON_BUFFER_TNAME_,
+                             sizeof( moon_buffer_ ), methods );
+}
+
+
+MOON_API void* moon_newbuffer( lua_State* L, void* p, size_t len,
+                               moon_object_destructor release ) {
+  moon_typeinfo_* ti = NULL;
+  moon_buffer_* b = NULL;
+  size_t extra = 0;
+  luaL_checkstack( L, 4, "moon_newbuffer" );
+  ti = moon_buffer_type_( L );
+  if( p == NULL ) { /* the memory is part of the userdata */
+    if( len > (size_t)-1 / 2 )
+      luaL_error( L, "buffer too large" );
+    extra = len;
+  }
+  b = (moon_buffer_*)moon_newobject_( L, sizeof( moon_buffer_ ) + extra,
+                                      ti, moon_buffer_release_ );
+  b->p = (char*)p;
+  b->len = len;
+  b->release = p != NULL ? release : 0;
+  b->base = p;
+  b->readonly = 0;
+  if( p == NULL ) {
+    b->p = (char*)(b+1);
+    memset( b->p, 0, len );
+  }
+  MOON_STAT_( ti, MOON_STATS_NEWOBJECT_ );
+  return b->p;
+}
+
+
+MOON_API void* moon_viewbuffer( lua_State* L, int idx, size_t offset,
+                                size_t len ) {
+  moon_object_header* h = NULL;
+  moon_typeinfo_* ti = NULL;
+  moon_typeinfo_* bt = NULL;
+  unsigned const* epochp = NULL;
+  char* p = NULL;
+  size_t sz = 0;
+  int readonly = 0;
+  luaL_checkstack( L, 4, "moon_viewbuffer" );
+  idx = moon_absindex( L, idx );
+  bt = moon_buffer_type_( L );
+  lua_pop( L, 1 );
+  if( lua_type( L, idx ) == LUA_TSTRING ) {
+    p = (char*)lua_tolstring( L, idx, &sz );
+    readonly = 1;
+  } else {
+    h = (moon_object_header*)lua_touserdata( L, idx );
+    ti = moon_typeinfo_get_( L, idx, h );
+    if( ti == NULL )
+      moon_type_error_( L, idx, "string or moon object",
+                        luaL_typename( L, idx ) );
+    if( !(h->flags & MOON_OBJECT_IS_VALID) ||
+        (h->vcheck_offset > 0 && !moon_validate_( h )) )
+      moon_type_error_invalid_( L, idx, ti->name );
+    p = (char*)MOON_PTR_( h, h->object_offset );
+    if( h->flags & MOON_OBJECT_IS_POINTER )
+      p = *(char**)p;
+    if( p == NULL )
+      moon_type_error_invalid_( L, idx, ti->name );
+    sz = ti->size;
+    readonly = (h->flags & MOON_OBJECT_IS_READONLY_) != 0;
+    if( ti == bt ) {
+      moon_buffer_* b = (moon_buffer_*)p;
+      p = b->p;
+      sz = b->len;
+      readonly = b->readonly;
+    } else {
+      lua_getmetatable( L, idx );
+      lua_getfield( L, -1, "__moon_element" );
+      if( lua_type( L, -1 ) == LUA_TSTRING ) { /* a moon array */
+        moon_array_* a = (moon_array_*)p;
+        p = (char*)a->data;
+        sz = a->n * a->esize;
+        epochp = &a->epoch;
+        readonly = a->readonly;
+      } else if( sz == 0 )
+        luaL_error( L, "type '%s' is incomplete (size is 0)", ti->name );
       lua_pop( L, 2 );
     }
   }
-  moon_push_metatable_( L, tname );
-  if( isvalid != 0 ) {
-    off1 = MOON_ROUNDTO_( sizeof( moon_object_header ),
-                          MOON_VCK_ALIGNMENT_ );
-    off2 = MOON_ROUNDTO_( off1 + sizeof( moon_object_vcheck_ ),
-                          MOON_PTR_ALIGNMENT_ );
-#ifdef _MSC_VER
-#  pragma warning(pop)
-#endif
+  if( len == (size_t)-1 && offset <= sz )
+    len = sz - offset;
+  if( offset > sz || len > sz - offset )
+    luaL_error( L, "buffer range out of bounds" );
+  return moon_buffer_view_( L, idx, epochp, p + offset, len,
+                            readonly )->p;
+}
+
+
+MOON_API void* moon_checkbuffer( lua_State* L, int idx, size_t* len,
+                                 int writable ) {
+  moon_buffer_* b = NULL;
+  luaL_checkstack( L, 2, "moon_checkbuffer" );
+  moon_buffer_type_( L );
+  lua_pop( L, 1 );
+  b = moon_buffer_check_( L, idx );
+  if( writable && b->readonly )
+    luaL_argerror( L, idx, "buffer is read-only" );
+  if( len != NULL )
+    *len = b->len;
+  return b->p;
+}
+
+
+/* A region owns the payloads of all objects created in it (allocated
+ * from a list of memory blocks via bump allocation) and the list of
+ * their destructors. The objects are pointer objects with an epoch
+ * record that refers to the flags of the region (and a reference to
+ * the region in the uservalue), so closing the region invalidates all
+ * of them at once, without touching the objects themselves. */
+typedef struct moon_region_block_ {
+  struct moon_region_block_* next;
+  size_t size;
+} moon_region_block_;
+
+typedef struct moon_region_cleanup_ {
+  struct moon_region_cleanup_* next;
+  moon_object_destructor destructor;
+  void* p;
+} moon_region_cleanup_;
+
+typedef struct {
+  moon_region_block_* blocks;
+  char* next; /* free memory in the first block */
+  size_t avail;
+  size_t blocksize;
+  moon_region_cleanup_* cleanups;
+  lua_Alloc alloc;
+  void* ud;
+} moon_region_;
+
+#define MOON_REGION_TNAME_ "moon.region"
+#define MOON_REGION_BLOCKSIZE_ 4096
+#define MOON_REGION_BLOCK_OFFSET_ \
+  MOON_ROUNDTO_( sizeof( moon_region_block_ ), MOON_OBJ_ALIGNMENT_ )
+
+
+/* Runs the destructors (in reverse order of creation) and frees all
+ * memory blocks of a region. */
+static void moon_region_release_( void* p ) {
+  moon_region_* r = (moon_region_*)p;
+  moon_region_cleanup_* c = r->cleanups;
+  moon_region_block_* b = r->blocks;
+  r->cleanups = NULL;
+  for( ; c != NULL; c = c->next )
+    c->destructor( c->p );
+  while( b != NULL ) {
+    moon_region_block_* next = b->next;
+    r->alloc( r->ud, b, b->size, 0 );
+    b = next;
   }
-  obj = (moon_object_header*)lua_newuserdata( L, sizeof( void* )+off2 );
-  p = (void**)MOON_PTR_( obj, off2 );
-  *p = NULL;
-  obj->vcheck_offset = off1;
-  obj->object_offset = off2;
-  obj->cleanup_offset = 0;
-  obj->flags = MOON_OBJECT_IS_VALID | MOON_OBJECT_IS_POINTER;
-  if( off1 > 0 ) {
-    moon_object_vcheck_* vc = NULL;
-    vc= (moon_object_vcheck_*)MOON_PTR_( obj, off1 );
-    vc->check = isvalid;
-    vc->tagp = tagp;
-    vc->next = nextcheck;
+  r->blocks = NULL;
+  r->next = NULL;
+  r->avail = 0;
+}
+
+
+static moon_region_* moon_region_check_( lua_State* L, int i ) {
+  return (moon_region_*)moon_checkobject( L, i, MOON_REGION_TNAME_ );
+}
+
+
+/* Bump allocation of `sz` bytes (aligned like a moon object) from a
+ * region. Large requests get their own block, so that the free
+ * memory in the current block isn't wasted. */
+static void* moon_region_alloc_( lua_State* L, moon_region_* r,
+                                 size_t sz ) {
+  moon_region_block_* b = NULL;
+  size_t bsz = r->blocksize;
+  void* p = NULL;
+  if( sz > (size_t)-1 / 2 )
+    luaL_error( L, "memory allocation error" );
+  sz = MOON_ROUNDTO_( sz > 0 ? sz : 1, MOON_OBJ_ALIGNMENT_ );
+  if( sz <= r->avail ) {
+    p = r->next;
+    r->next += sz;
+    r->avail -= sz;
+    return p;
   }
-  lua_insert( L, -2 );
-  lua_setmetatable( L, -2 );
-  if( idx != 0 ) {
-    lua_newtable( L );
-    lua_pushvalue( L, idx );
-    lua_rawseti( L, -2, 1 );
-#if LUA_VERSION_NUM < 502
-    lua_setfenv( L, -2 );
-#else
-    lua_setuservalue( L, -2 );
-#endif
+  if( sz > bsz / 4 )
+    bsz = sz;
+  b = (moon_region_block_*)r->alloc( r->ud, NULL, 0,
+                                     MOON_REGION_BLOCK_OFFSET_ + bsz );
+  if( b == NULL )
+    luaL_error( L, "memory allocation error" );
+  b->size = MOON_REGION_BLOCK_OFFSET_ + bsz;
+  p = MOON_PTR_( b, MOON_REGION_BLOCK_OFFSET_ );
+  if( bsz == sz && r->blocks != NULL ) { /* dedicated block */
+    b->next = r->blocks->next;
+    r->blocks->next = b;
+  } else {
+    b->next = r->blocks;
+    r->blocks = b;
+    r->next = (char*)p + sz;
+    r->avail = bsz - sz;
+  }
+  return p;
+}
+
+
+MOON_LLINKAGE_BEGIN
+/* r:close() */
+static int moon_region_close_( lua_State* L ) {
+  moon_object_header* h = (moon_object_header*)lua_touserdata( L, 1 );
+  moon_typeinfo_* ti = moon_typeinfo_get_( L, 1, h );
+  if( ti == NULL || 0 != strcmp( ti->name, MOON_REGION_TNAME_ ) )
+    moon_type_error_( L, 1, MOON_REGION_TNAME_, luaL_typename( L, 1 ) );
+  moon_object_run_destructor_( h );
+  return 0;
+}
+MOON_LLINKAGE_END
+
+
+static moon_typeinfo_* moon_region_type_( lua_State* L ) {
+  luaL_Reg const methods[] = {
+    { "close", moon_region_close_ },
+    { NULL, NULL }
+  };
+  return moon_builtin_type_( L, MOON_REGION_TNAME_,
+                             sizeof( moon_region_ ), methods );
+}
+
+
+MOON_API void moon_newregion( lua_State* L, size_t blocksize ) {
+  moon_typeinfo_* ti = NULL;
+  moon_region_* r = NULL;
+  luaL_checkstack( L, 4, "moon_newregion" );
+  ti = moon_region_type_( L );
+  r = (moon_region_*)moon_newobject_( L, sizeof( moon_region_ ), ti,
+                                      moon_region_release_ );
+  r->blocks = NULL;
+  r->next = NULL;
+  r->avail = 0;
+  r->blocksize = blocksize > 0 ? blocksize : MOON_REGION_BLOCKSIZE_;
+  r->cleanups = NULL;
+  r->alloc = lua_getallocf( L, &r->ud );
+  MOON_STAT_( ti, MOON_STATS_NEWOBJECT_ );
+}
+
+
+MOON_API void* moon_regionalloc( lua_State* L, int region, size_t sz ) {
+  return moon_region_alloc_( L, moon_region_check_( L, region ), sz );
+}
+
+
+MOON_API void* moon_newobject_r( lua_State* L, char const* tname,
+                                 int region,
+                                 moon_object_destructor destructor ) {
+  moon_typeinfo_* ti = NULL;
+  moon_region_* r = NULL;
+  moon_region_cleanup_* c = NULL;
+  moon_object_header* obj = NULL;
+  void* p = NULL;
+  size_t sz = 0;
+  luaL_checkstack( L, 3, "moon_newobject_r" );
+  region = moon_absindex( L, region );
+  r = moon_region_check_( L, region );
+  ti = moon_push_metatable_( L, tname );
+  sz = moon_object_size_( L, ti, tname );
+  /* allocate everything before the object, so that a memory error
+   * can't leave an object without its destructor, but register the
+   * destructor only after the object has been created (a memory error
+   * in between must not run it on memory nobody has initialized) */
+  p = moon_region_alloc_( L, r, sz );
+  memset( p, 0, sz );
+  if( destructor != 0 ) {
+    c = (moon_region_cleanup_*)moon_region_alloc_( L, r, sizeof( *c ) );
+    c->destructor = destructor;
+    c->p = p;
+  }
+  MOON_STAT_( ti, MOON_STATS_NEWOBJECT_ );
+  obj = moon_newepoch_( L, ti, region, NULL, 0 );
+  *(void**)MOON_PTR_( obj, obj->object_offset ) = p;
+  if( c != NULL ) {
+    c->next = r->cleanups;
+    r->cleanups = c;
   }
   return p;
 }
@@ -629,24 +3900,41 @@ MOON_API void** moon_newfield( lua_State* L, char const* tname,
 
 MOON_API int moon_getmethods( lua_State* L, char const* tname ) {
   int t = 0;
-  luaL_checkstack( L, 2, "moon_getmethods" );
+  luaL_checkstack( L, 7, "moon_getmethods" );
   moon_push_metatable_( L, tname );
   lua_getfield( L, -1, "__index" );
-  lua_replace( L, -2 );
   t = lua_type( L, -1 );
-  if( t == LUA_TTABLE )
+  if( t == LUA_TTABLE ) {
+    lua_replace( L, -2 );
     return t;
-  else if( t == LUA_TFUNCTION ) {
+  } else if( t == LUA_TFUNCTION ) {
     lua_CFunction dispatch = moon_getf_( L, "index",
                                          moon_index_dispatch_ );
     if( lua_tocfunction( L, -1 ) == dispatch &&
         lua_getupvalue( L, -1, 1 ) != NULL ) {
-      lua_replace( L, -2 );
-      if( lua_type( L, -1 ) == LUA_TTABLE )
+      if( lua_type( L, -1 ) == LUA_TTABLE ) {
+        /* the caller may modify the methods table, so a compiled
+         * dispatcher goes back to using the live tables */
+        if( lua_getupvalue( L, -2, 5 ) != NULL ) {
+          int compiled = lua_type( L, -1 ) == LUA_TUSERDATA;
+          lua_pop( L, 1 );
+          if( compiled ) {
+            lua_pushvalue( L, -1 );
+            lua_getupvalue( L, -3, 2 );
+            lua_getupvalue( L, -4, 3 );
+            lua_getupvalue( L, -5, 4 );
+            moon_pushindex_( L, dispatch, 4 );
+            lua_setfield( L, -4, "__index" );
+          }
+        }
+        lua_replace( L, -3 );
+        lua_pop( L, 1 );
         return LUA_TTABLE;
+      }
+      lua_pop( L, 1 );
     }
   }
-  lua_pop( L, 1 );
+  lua_pop( L, 2 );
   return LUA_TNIL;
 }
 
@@ -660,19 +3948,292 @@ MOON_API void moon_killobject( lua_State* L, int idx ) {
   if( lua_tointeger( L, -1 ) != MOON_VERSION )
     moon_type_error_version_( L, idx );
   lua_pop( L, 2 );
+#ifdef MOON_STATS
+  moon_stats_count_( L, idx, MOON_STATS_KILL_ );
+#endif
   moon_object_run_destructor_( h );
 }
 
 
-MOON_API void moon_defcast( lua_State* L, char const* tname1,
-                            char const* tname2,
-                            moon_object_cast cast ) {
-  luaL_checkstack( L, 2, "moon_defcast" );
-  moon_push_metatable_( L, tname1 );
-  moon_check_tname_( L, tname2 );
-  lua_pushcfunction( L, (lua_CFunction)(void(*)(void))cast );
-  lua_setfield( L, -2, tname2 );
-  lua_pop( L, 1 );
+/* Records the cast in the metatable of `tname1` (or with the pending
+ * definition of a lazy type), and returns the type descriptors of
+ * both types without updating the cast graph. */
+static moon_typeinfo_* moon_defcast_( lua_State* L, char const* tname1,
+                                      char const* tname2,
+                                      moon_object_cast cast,
+                                      moon_typeinfo_** ti2 ) {
+  moon_typeinfo_* ti = NULL;
+  luaL_checkstack( L, 4, "moon_defcast" );
+  moon_check_tname_( L, tname1 );
+  moon_check_tname_( L, tname2 );
+  luaL_getmetatable( L, tname1 );
+  if( lua_isnil( L, -1 ) && moon_lazy_push_( L, tname1 ) ) {
+    /* don't materialize lazy types, just record the cast */
+    lua_replace( L, -2 );
+    lua_getfield( L, -1, "casts" );
+    if( !lua_istable( L, -1 ) ) {
+      lua_pop( L, 1 );
+      lua_newtable( L );
+      lua_pushvalue( L, -1 );
+      lua_setfield( L, -3, "casts" );
+    }
+    lua_pushcfunction( L, (lua_CFunction)(void(*)(void))cast );
+    lua_setfield( L, -2, tname2 );
+    lua_pop( L, 1 );
+    ti = moon_types_intern_( L, moon_types_push_( L ), tname1 );
+    lua_pop( L, 1 );
+  } else {
+    lua_pop( L, 1 );
+    ti = moon_push_metatable_( L, tname1 );
+    lua_pushcfunction( L, (lua_CFunction)(void(*)(void))cast );
+    lua_setfield( L, -2, tname2 );
+  }
+  if( ti != NULL )
+    *ti2 = moon_types_intern_( L, ti->types, tname2 );
+  lua_pop( L, 1 );
+  return ti;
+}
+
+
+MOON_API void moon_defcast( lua_State* L, char const* tname1,
+                            char const* tname2,
+                            moon_object_cast cast ) {
+  moon_typeinfo_* ti2 = NULL;
+  moon_typeinfo_* ti = moon_defcast_( L, tname1, tname2, cast, &ti2 );
+  if( ti != NULL )
+    moon_typeinfo_addcast_( L, ti, ti2, cast );
+}
+
+
+MOON_API void moon_defobjects( lua_State* L,
+                               moon_object_def const* defs,
+                               moon_object_castdef const* casts ) {
+  moon_object_def const* d = defs;
+  moon_object_castdef const* c = casts;
+  size_t n = 0;
+  luaL_checkstack( L, 3, "moon_defobjects" );
+  /* casts usually refer to types in `defs`, so this is enough to
+   * avoid growing the type registry while registering */
+  for( ; d != NULL && d->tname != NULL; ++d )
+    ++n;
+  moon_types_reserve_( L, moon_types_push_( L ), n );
+  lua_pop( L, 1 );
+  for( d = defs; d != NULL && d->tname != NULL; ++d ) {
+    moon_defobject( L, d->tname, d->size, d->methods, 0 );
+    if( d->fields != NULL )
+      moon_deffields( L, d->tname, d->fields );
+  }
+  /* Add all casts to the cast graph first, and then compute the cast
+   * chains once for all types that can reach any of the new casts
+   * (instead of updating them after every single cast). */
+  for( n = 0; c != NULL && c->tname1 != NULL; ++c )
+    ++n;
+  if( n > 0 ) {
+    moon_types_* t = moon_types_push_( L );
+    /* every cast interns at most two types */
+    size_t m = t->n + 2*n, i = 0, j = 0;
+    /* use a userdata, so that the memory is released on errors */
+    unsigned char* mark = (unsigned char*)lua_newuserdata( L, m );
+    for( i = 0; i < m; ++i )
+      mark[ i ] = 0;
+    for( c = casts; c->tname1 != NULL; ++c ) {
+      moon_typeinfo_* ti2 = NULL;
+      moon_typeinfo_* ti = moon_defcast_( L, c->tname1, c->tname2,
+                                          c->cast, &ti2 );
+      if( ti != NULL && moon_typeinfo_addedge_( L, ti, ti2, c->cast ) )
+        mark[ ti->id ] = 1;
+    }
+    /* The cast chains of the other types can't have changed. This
+     * uses the cast chains from before the new casts were added. */
+    for( i = 1; i < t->n; ++i ) {
+      if( mark[ i ] != 1 ) {
+        for( j = 1; j < t->n; ++j ) {
+          if( mark[ j ] == 1 && moon_typeinfo_isa_( t->v[ i ], j ) ) {
+            mark[ i ] = 2;
+            break;
+          }
+        }
+      }
+    }
+    moon_types_reclose_( L, t, mark );
+    lua_pop( L, 2 );
+  }
+}
+
+
+/* A type set is a frozen type registry that is not bound to any Lua
+ * state (it uses malloc/free), so that it can be shared by all Lua
+ * states in a process. The type IDs 1 to `ndefs` belong to the types
+ * in `defs` (in that order), the others are targets of casts. */
+struct moon_typeset_ {
+  moon_types_ types;
+  moon_object_def const* defs;
+  moon_object_castdef const* casts;
+  size_t ndefs;
+};
+
+
+static void* moon_malloc_alloc_( void* ud, void* p, size_t osz,
+                                 size_t nsz ) {
+  (void)ud;
+  (void)osz;
+  if( nsz == 0 ) {
+    free( p );
+    return NULL;
+  }
+  return realloc( p, nsz );
+}
+
+
+MOON_API moon_object_typeset*
+moon_newtypeset( lua_State* L, moon_object_def const* types,
+                 moon_object_castdef const* casts ) {
+  moon_types_* t = NULL;
+  moon_object_typeset* set = NULL;
+  moon_object_def const* d = types;
+  moon_object_castdef const* c = casts;
+  size_t i = 0;
+  luaL_checkstack( L, 3, "moon_newtypeset" );
+  /* the types are collected in a temporary type registry, which is
+   * a userdata, so that the memory is released on errors */
+  t = (moon_types_*)lua_newuserdata( L, sizeof( moon_types_ ) );
+  t->self = t;
+  t->version = MOON_VERSION;
+  t->alloc = moon_malloc_alloc_;
+  t->ud = NULL;
+  t->v = NULL;
+  t->hash = NULL;
+  t->n = t->cap = t->hcap = 0;
+  t->remaps = NULL;
+  lua_newtable( L );
+  lua_pushcfunction( L, moon_types_gc_ );
+  lua_setfield( L, -2, "__gc" );
+  lua_setmetatable( L, -2 );
+  for( ; d != NULL && d->tname != NULL; ++d ) {
+    moon_check_tname_( L, d->tname );
+    if( moon_types_find_( t, d->tname ) != 0 )
+      luaL_error( L, "type '%s' is already defined", d->tname );
+    moon_types_intern_( L, t, d->tname )->size = d->size;
+  }
+  i = t->n > 0 ? t->n-1 : 0;
+  for( ; c != NULL && c->tname1 != NULL; ++c ) {
+    unsigned short id = moon_types_find_( t, c->tname1 );
+    moon_check_tname_( L, c->tname2 );
+    if( id == 0 || id > i )
+      luaL_error( L, "type '%s' is not part of the type set",
+                  c->tname1 );
+    moon_typeinfo_addcast_( L, t->v[ id ],
+                            moon_types_intern_( L, t, c->tname2 ),
+                            c->cast );
+  }
+  set = (moon_object_typeset*)malloc( sizeof( *set ) );
+  if( set == NULL )
+    luaL_error( L, "memory allocation error" );
+  set->types = *t;
+  set->types.self = &set->types;
+  set->defs = types;
+  set->casts = casts;
+  set->ndefs = i;
+  for( i = 1; i < set->types.n; ++i )
+    set->types.v[ i ]->types = &set->types;
+  t->v = NULL;
+  t->hash = NULL;
+  t->n = t->cap = t->hcap = 0;
+  lua_pop( L, 1 );
+  return set;
+}
+
+
+MOON_API void moon_deftypes( lua_State* L,
+                             moon_object_typeset const* set ) {
+  moon_types_ const* st = &set->types;
+  moon_types_* t = NULL;
+  moon_types_remap_* r = NULL;
+  size_t i = 0, j = 0;
+  int same = 1, borrow = 1;
+  luaL_checkstack( L, 3, "moon_deftypes" );
+  t = moon_types_push_( L );
+  moon_types_reserve_( L, t, st->n );
+  for( i = 1; i < st->n; ++i )
+    if( moon_types_intern_( L, t, st->v[ i ]->name )->id != i )
+      same = 0;
+  /* The cast tables of the type set can be used as is, unless casts
+   * from or to types of the type set are already defined in this Lua
+   * state (in which case the casts are registered one by one). */
+  for( i = 1; i < t->n && borrow; ++i ) {
+    moon_typeinfo_ const* ti = t->v[ i ];
+    for( j = 0; j < ti->nedges && borrow; ++j )
+      if( moon_types_find_( st, ti->name ) != 0 ||
+          moon_types_find_( st, t->v[ ti->edges[ j ].to ]->name ) != 0 )
+        borrow = 0;
+  }
+  /* If other moon types have been defined in this Lua state before,
+   * the type IDs differ from the ones in the type set, and a
+   * translation table is necessary for the borrowed cast tables. */
+  if( borrow && !same ) {
+    r = (moon_types_remap_*)moon_types_realloc_( L, t, NULL, 0,
+      sizeof( *r ) + t->n*sizeof( *r->id ) );
+    r->id = (unsigned short*)(r+1);
+    r->n = t->n;
+    for( i = 0; i < r->n; ++i )
+      r->id[ i ] = 0;
+    r->next = t->remaps;
+    t->remaps = r;
+    for( i = 1; i < st->n; ++i )
+      r->id[ moon_types_find_( t, st->v[ i ]->name ) ] = (unsigned short)i;
+  }
+  lua_pop( L, 1 );
+  for( i = 0; i < set->ndefs; ++i ) {
+    moon_object_def const* d = set->defs + i;
+    moon_defobject( L, d->tname, d->size, d->methods, 0 );
+    if( d->fields != NULL )
+      moon_deffields( L, d->tname, d->fields );
+  }
+  if( borrow ) {
+    moon_object_castdef const* c = set->casts;
+    for( i = 1; i < st->n; ++i ) {
+      moon_typeinfo_ const* si = st->v[ i ];
+      moon_typeinfo_* ti = t->v[ moon_types_find_( t, si->name ) ];
+      if( si->nedges > 0 ) {
+        ti->edges = (moon_typeinfo_edge_*)moon_types_realloc_( L, t,
+          ti->edges, ti->cedges*sizeof( *ti->edges ),
+          si->nedges*sizeof( *ti->edges ) );
+        ti->cedges = si->nedges;
+        for( j = 0; j < si->nedges; ++j ) {
+          ti->edges[ j ].cast = si->edges[ j ].cast;
+          ti->edges[ j ].to = moon_types_find_( t,
+            st->v[ si->edges[ j ].to ]->name );
+        }
+        ti->nedges = si->nedges;
+      }
+      moon_typeinfo_freecasts_( t, ti );
+      ti->casts = si->casts;
+      ti->isa = si->isa;
+      ti->ncasts = si->ncasts;
+      ti->shared = 1;
+      ti->remap = r;
+      ti->stamp = moon_types_stamp_();
+    }
+    /* for the slow path of `moon_checkobject` */
+    for( ; c != NULL && c->tname1 != NULL; ++c ) {
+      luaL_getmetatable( L, c->tname1 );
+      lua_pushcfunction( L, (lua_CFunction)(void(*)(void))c->cast );
+      lua_setfield( L, -2, c->tname2 );
+      lua_pop( L, 1 );
+    }
+  } else {
+    moon_object_castdef const* c = set->casts;
+    for( ; c != NULL && c->tname1 != NULL; ++c )
+      moon_defcast( L, c->tname1, c->tname2, c->cast );
+  }
+}
+
+
+MOON_API void moon_freetypeset( moon_object_typeset* set ) {
+  if( set != NULL ) {
+    moon_types_free_( &set->types );
+    free( set );
+  }
 }
 
 
@@ -687,16 +4248,40 @@ static int moon_validate_vcheck_( moon_object_vcheck_ const* vc ) {
 }
 
 
-MOON_API void* moon_checkobject( lua_State* L, int idx,
-                                 char const* tname ) {
-  moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
-  void* p = NULL;
-  int res = 0;
+/* Validates an epoch record: one flag test and (optionally) one
+ * comparison, plus the vcheck chain of non-epoch parents. */
+static int moon_validate_epoch_( moon_object_epoch_ const* e ) {
+  return (*e->flagsp & MOON_OBJECT_IS_VALID) &&
+         (e->epochp == NULL || *e->epochp == e->epoch) &&
+         (e->vc.next == NULL || moon_validate_vcheck_( e->vc.next ));
+}
+
+
+/* vcheck function for epoch records (used when an epoch object is in
+ * the vcheck chain of another object). */
+static int moon_epoch_valid_( void* p ) {
+  return moon_validate_epoch_( (moon_object_epoch_ const*)p );
+}
+
+
+/* Runs the validity checks of a moon object. */
+static int moon_validate_( moon_object_header const* h ) {
+  void const* v = MOON_PTR_( h, h->vcheck_offset );
+  if( h->flags & MOON_OBJECT_HAS_EPOCH_ )
+    return moon_validate_epoch_( (moon_object_epoch_ const*)v );
+  else
+    return moon_validate_vcheck_( (moon_object_vcheck_ const*)v );
+}
+
+
+/* Slow path for `moon_checkobject`: Uses the metatable of the object
+ * and the registry to find the cast function (if any). Raises
+ * appropriate errors for non-matching objects. */
+static moon_object_cast moon_checkcast_( lua_State* L, int idx,
+                                         char const* tname ) {
   moon_object_cast cast = 0;
-  moon_check_tname_( L, tname );
-  luaL_checkstack( L, 3, "moon_checkobject" );
-  idx = moon_absindex( L, idx );
-  if( h == NULL )
+  int res = 0;
+  if( lua_touserdata( L, idx ) == NULL )
     moon_type_error_( L, idx, tname, luaL_typename( L, idx ) );
   if( lua_islightuserdata( L, idx ) )
     moon_type_error_( L, idx, tname, "lightuserdata" );
@@ -723,42 +4308,74 @@ MOON_API void* moon_checkobject( lua_State* L, int idx,
     }
   }
   lua_pop( L, 1 );
+  return cast;
+}
+
+
+/* Common part of `moon_checkobject` and friends once the type of the
+ * object (and the necessary casts) has been figured out. */
+static void* moon_checkobject_ptr_( lua_State* L, int idx,
+                                    moon_typeinfo_* ti,
+                                    moon_object_header* h,
+                                    char const* tname,
+                                    moon_object_cast const* casts ) {
+  void* p = NULL;
+  moon_object_cast const* c = casts;
   if( !(h->flags & MOON_OBJECT_IS_VALID) )
     moon_type_error_invalid_( L, idx, tname );
   if( h->vcheck_offset > 0 ) {
-    moon_object_vcheck_* vc = NULL;
-    vc = (moon_object_vcheck_*)MOON_PTR_( h, h->vcheck_offset );
-    if( !moon_validate_vcheck_( vc ) )
+    MOON_STAT_( ti, MOON_STATS_VCHECK_ );
+    if( !moon_validate_( h ) ) {
+      MOON_STAT_( ti, MOON_STATS_VCHECK_FAIL_ );
       moon_type_error_invalid_( L, idx, tname );
+    }
   }
   p = MOON_PTR_( h, h->object_offset );
   if( h->flags & MOON_OBJECT_IS_POINTER )
     p = *((void**)p);
   if( p == NULL )
     moon_type_error_invalid_( L, idx, tname );
-  if( cast != 0 ) {
-    p = cast( p );
-    if( p == NULL )
-      moon_type_error_invalid_( L, idx, tname );
+  if( c != NULL ) {
+    for( ; *c != 0; ++c ) {
+      p = (*c)( p );
+      if( p == NULL )
+        moon_type_error_invalid_( L, idx, tname );
+    }
   }
+  MOON_STAT_( ti, casts == NULL || *casts == 0 ?
+                  MOON_STATS_CHECK_DIRECT_ : MOON_STATS_CHECK_CAST_ );
   return p;
 }
 
 
-MOON_API void* moon_testobject( lua_State* L, int idx,
-                                char const* tname ) {
+MOON_API void* moon_checkobject( lua_State* L, int idx,
+                                 char const* tname ) {
   moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
-  void* p = NULL;
-  int res = 0;
-  moon_object_cast cast = 0;
+  moon_typeinfo_* ti = NULL;
+  moon_object_cast const* casts = NULL;
+  moon_object_cast slow[ 2 ] = { 0, 0 };
   moon_check_tname_( L, tname );
-  luaL_checkstack( L, 2, "moon_testobject" );
-  if( h == NULL || !lua_getmetatable( L, idx ) )
-    return NULL;
+  luaL_checkstack( L, 3, "moon_checkobject" );
+  idx = moon_absindex( L, idx );
+  ti = moon_typeinfo_get_( L, idx, h );
+  if( ti == NULL || !moon_typeinfo_match_( ti, tname, &casts ) ) {
+    slow[ 0 ] = moon_checkcast_( L, idx, tname );
+    casts = slow;
+  }
+  return moon_checkobject_ptr_( L, idx, ti, h, tname, casts );
+}
+
+
+/* Slow path for `moon_testobject`. */
+static int moon_testcast_( lua_State* L, int idx, char const* tname,
+                           moon_object_cast* cast ) {
+  int res = 0;
+  if( lua_touserdata( L, idx ) == NULL || !lua_getmetatable( L, idx ) )
+    return 0;
   lua_getfield( L, -1, "__moon_version" );
   if( lua_tointeger( L, -1 ) != MOON_VERSION ) {
     lua_pop( L, 2 );
-    return NULL;
+    return 0;
   }
   lua_pop( L, 1 );
   luaL_getmetatable( L, tname );
@@ -766,29 +4383,295 @@ MOON_API void* moon_testobject( lua_State* L, int idx,
   lua_pop( L, 1 );
   if( !res ) {
     lua_getfield( L, -1, tname );
-    cast = (moon_object_cast)(void(*)(void))lua_tocfunction( L, -1 );
+    *cast = (moon_object_cast)(void(*)(void))lua_tocfunction( L, -1 );
     lua_pop( L, 2 );
-    if( cast == 0 )
-      return NULL;
+    if( *cast == 0 )
+      return 0;
   } else
     lua_pop( L, 1 );
+  return 1;
+}
+
+
+/* Result of `moon_testobject` and friends for non-matching objects.
+ */
+static void* moon_testobject_fail_( lua_State* L, char const* tname ) {
+#ifdef MOON_STATS
+  moon_stats_fail_( L, tname );
+#else
+  (void)L;
+  (void)tname;
+#endif
+  return NULL;
+}
+
+
+/* Same as `moon_checkobject_ptr_` but returns NULL instead of
+ * raising errors. */
+static void* moon_testobject_ptr_( lua_State* L, moon_typeinfo_* ti,
+                                   moon_object_header* h,
+                                   char const* tname,
+                                   moon_object_cast const* casts ) {
+  void* p = NULL;
+  moon_object_cast const* c = casts;
   if( !(h->flags & MOON_OBJECT_IS_VALID) )
-    return NULL;
+    return moon_testobject_fail_( L, tname );
   if( h->vcheck_offset > 0 ) {
-    moon_object_vcheck_* vc = NULL;
-    vc = (moon_object_vcheck_*)MOON_PTR_( h, h->vcheck_offset );
-    if( !moon_validate_vcheck_( vc ) )
-      return NULL;
+    MOON_STAT_( ti, MOON_STATS_VCHECK_ );
+    if( !moon_validate_( h ) ) {
+      MOON_STAT_( ti, MOON_STATS_VCHECK_FAIL_ );
+      return moon_testobject_fail_( L, tname );
+    }
   }
   p = MOON_PTR_( h, h->object_offset );
   if( h->flags & MOON_OBJECT_IS_POINTER )
     p = *((void**)p);
-  if( cast != 0 )
-    p = cast( p );
+  if( c != NULL )
+    for( ; *c != 0 && p != NULL; ++c )
+      p = (*c)( p );
+  if( p == NULL )
+    return moon_testobject_fail_( L, tname );
+  MOON_STAT_( ti, casts == NULL || *casts == 0 ?
+                  MOON_STATS_CHECK_DIRECT_ : MOON_STATS_CHECK_CAST_ );
   return p;
 }
 
 
+MOON_API void* moon_testobject( lua_State* L, int idx,
+                                char const* tname ) {
+  moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
+  moon_typeinfo_* ti = NULL;
+  moon_object_cast const* casts = NULL;
+  moon_object_cast slow[ 2 ] = { 0, 0 };
+  moon_check_tname_( L, tname );
+  luaL_checkstack( L, 2, "moon_testobject" );
+  ti = moon_typeinfo_get_( L, idx, h );
+  if( ti == NULL || !moon_typeinfo_match_( ti, tname, &casts ) ) {
+    if( !moon_testcast_( L, idx, tname, slow ) )
+      return moon_testobject_fail_( L, tname );
+    casts = slow;
+  }
+  return moon_testobject_ptr_( L, ti, h, tname, casts );
+}
+
+
+/* The following functions use a type handle (as returned by
+ * `moon_gettype`) instead of a type name, so that the metatable, the
+ * size, and the type ID are available without any lookups by name.
+ */
+MOON_API moon_object_type* moon_gettype( lua_State* L,
+                                         char const* tname ) {
+  moon_typeinfo_* ti = NULL;
+  luaL_checkstack( L, 2, "moon_gettype" );
+  ti = moon_push_metatable_( L, tname );
+  if( ti == NULL )
+    luaL_error( L, "no type descriptor for type '%s'", tname );
+  lua_pop( L, 1 );
+  return ti;
+}
+
+
+MOON_API void* moon_newobject_t( lua_State* L, moon_object_type* t,
+                                 void (*gc)( void* ) ) {
+  luaL_checkstack( L, 2, "moon_newobject_t" );
+  if( t->size == 0 )
+    luaL_error( L, "type '%s' is incomplete (size is 0)", t->name );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, t->mtref );
+  MOON_STAT_( t, MOON_STATS_NEWOBJECT_ );
+  return moon_newobject_( L, t->size, t, gc );
+}
+
+
+MOON_API void** moon_newpointer_t( lua_State* L, moon_object_type* t,
+                                   void (*gc)( void* ) ) {
+  luaL_checkstack( L, 2, "moon_newpointer_t" );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, t->mtref );
+  MOON_STAT_( t, MOON_STATS_NEWPOINTER_ );
+  return moon_newpointer_( L, t, gc );
+}
+
+
+MOON_API void** moon_newfield_t( lua_State* L, moon_object_type* t,
+                                 int idx, int (*isvalid)( void* ),
+                                 void* tagp ) {
+  moon_object_vcheck_* nextcheck = NULL;
+  luaL_checkstack( L, 3, "moon_newfield_t" );
+  if( idx != 0 ) {
+    idx = moon_absindex( L, idx );
+    moon_newfield_parent_( L, idx, &isvalid, &tagp, &nextcheck );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, t->mtref );
+  MOON_STAT_( t, MOON_STATS_NEWFIELD_ );
+  return moon_newfield_( L, t, idx, isvalid, tagp, nextcheck );
+}
+
+
+/* Used for embedded objects in fields defined via `moon_deffields`.
+ * `idx` must be an absolute stack index. */
+static void** moon_newfield_epoch_t_( lua_State* L, moon_object_type* t,
+                                      int idx, unsigned const* epochp ) {
+  luaL_checkstack( L, 3, "moon_newfield_epoch" );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, t->mtref );
+  MOON_STAT_( t, MOON_STATS_NEWFIELD_ );
+  return moon_newfield_epoch_( L, t, idx, epochp );
+}
+
+
+/* Checks whether objects of type `ti` can be cast to type `t`. */
+static int moon_typeinfo_castto_( moon_typeinfo_ const* ti,
+                                  moon_typeinfo_ const* t,
+                                  moon_object_cast const** casts ) {
+  if( ti != NULL && ti->types == t->types &&
+      moon_typeinfo_isa_( ti, t->id ) ) {
+    *casts = moon_typeinfo_chain_( ti, t->id );
+    return 1;
+  }
+  return 0;
+}
+
+
+MOON_API void* moon_checkobject_t( lua_State* L, int idx,
+                                   moon_object_type* t ) {
+  moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
+  moon_typeinfo_* ti = NULL;
+  moon_object_cast const* casts = NULL;
+  moon_object_cast slow[ 2 ] = { 0, 0 };
+  luaL_checkstack( L, 3, "moon_checkobject_t" );
+  idx = moon_absindex( L, idx );
+  ti = moon_typeinfo_get_t_( L, idx, h, t );
+  if( ti != t && !moon_typeinfo_castto_( ti, t, &casts ) ) {
+    slow[ 0 ] = moon_checkcast_( L, idx, t->name );
+    casts = slow;
+  }
+  return moon_checkobject_ptr_( L, idx, ti, h, t->name, casts );
+}
+
+
+MOON_API void* moon_testobject_t( lua_State* L, int idx,
+                                  moon_object_type* t ) {
+  moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
+  moon_typeinfo_* ti = NULL;
+  moon_object_cast const* casts = NULL;
+  moon_object_cast slow[ 2 ] = { 0, 0 };
+  luaL_checkstack( L, 2, "moon_testobject_t" );
+  ti = moon_typeinfo_get_t_( L, idx, h, t );
+  if( ti != t && !moon_typeinfo_castto_( ti, t, &casts ) ) {
+    if( !moon_testcast_( L, idx, t->name, slow ) )
+      return moon_testobject_fail_( L, t->name );
+    casts = slow;
+  }
+  return moon_testobject_ptr_( L, ti, h, t->name, casts );
+}
+
+
+/* Inline caches may be shared by several threads (each with its own
+ * Lua state), so they are protected by a sequence lock: a writer
+ * makes the sequence number odd while it updates the cache (other
+ * writers just skip the update in the mean time), and a reader only
+ * uses what it has read if the sequence number was even and didn't
+ * change while reading. Without the atomic builtins of GCC/Clang the
+ * caches are not thread-safe. */
+#if defined( __ATOMIC_ACQUIRE )
+#  define MOON_IC_GET_( _p ) __atomic_load_n( _p, __ATOMIC_RELAXED )
+#  define MOON_IC_SET_( _p, _v ) \
+  __atomic_store_n( _p, _v, __ATOMIC_RELAXED )
+#  define MOON_IC_ACQUIRE_( _p ) __atomic_load_n( _p, __ATOMIC_ACQUIRE )
+#  define MOON_IC_RELEASE_( _p, _v ) \
+  __atomic_store_n( _p, _v, __ATOMIC_RELEASE )
+#  define MOON_IC_RFENCE_() __atomic_thread_fence( __ATOMIC_ACQUIRE )
+#  define MOON_IC_WFENCE_() __atomic_thread_fence( __ATOMIC_RELEASE )
+#  define MOON_IC_LOCK_( _p, _s ) \
+  __atomic_compare_exchange_n( _p, &(_s), (_s)+1, 0, __ATOMIC_ACQ_REL, \
+                               __ATOMIC_RELAXED )
+#else
+#  define MOON_IC_GET_( _p ) (*(_p))
+#  define MOON_IC_SET_( _p, _v ) (*(_p) = (_v))
+#  define MOON_IC_ACQUIRE_( _p ) (*(_p))
+#  define MOON_IC_RELEASE_( _p, _v ) (*(_p) = (_v))
+#  define MOON_IC_RFENCE_() ((void)0)
+#  define MOON_IC_WFENCE_() ((void)0)
+#  define MOON_IC_LOCK_( _p, _s ) (*(_p) = (_s)+1, 1)
+#endif
+
+
+/* Figures out the cast functions for an object of type `ti` using the
+ * inline cache `c` if possible. The cache is only filled (and used) for
+ * objects that have a type descriptor in the current Lua state, so
+ * the cache is never dereferenced, only compared to a live
+ * descriptor. */
+static int moon_typeinfo_match_ic_( moon_typeinfo_ const* ti,
+                                    char const* tname,
+                                    moon_object_cache* c,
+                                    moon_object_cast const** casts ) {
+  unsigned long seq = 0;
+  if( ti == NULL )
+    return 0;
+  seq = MOON_IC_ACQUIRE_( &c->seq );
+  if( !(seq & 1) ) {
+    moon_object_type const* type = MOON_IC_GET_( &c->type );
+    unsigned long stamp = MOON_IC_GET_( &c->stamp );
+    char const* name = MOON_IC_GET_( &c->tname );
+    moon_object_cast const* cs = MOON_IC_GET_( &c->casts );
+    MOON_IC_RFENCE_();
+    if( type == ti && stamp == ti->stamp && name == tname &&
+        MOON_IC_GET_( &c->seq ) == seq ) {
+      *casts = cs;
+      return 1;
+    }
+  }
+  if( moon_typeinfo_match_( ti, tname, casts ) ) {
+    if( !(seq & 1) && MOON_IC_LOCK_( &c->seq, seq ) ) {
+      MOON_IC_WFENCE_();
+      MOON_IC_SET_( &c->type, ti );
+      MOON_IC_SET_( &c->stamp, ti->stamp );
+      MOON_IC_SET_( &c->tname, tname );
+      MOON_IC_SET_( &c->casts, *casts );
+      MOON_IC_RELEASE_( &c->seq, seq+2 );
+    }
+    return 1;
+  }
+  return 0;
+}
+
+
+MOON_API void* moon_checkobject_ic( lua_State* L, int idx,
+                                    char const* tname,
+                                    moon_object_cache* cache ) {
+  moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
+  moon_typeinfo_* ti = NULL;
+  moon_object_cast const* casts = NULL;
+  moon_object_cast slow[ 2 ] = { 0, 0 };
+  luaL_checkstack( L, 3, "moon_checkobject_ic" );
+  idx = moon_absindex( L, idx );
+  ti = moon_typeinfo_get_( L, idx, h );
+  if( !moon_typeinfo_match_ic_( ti, tname, cache, &casts ) ) {
+    moon_check_tname_( L, tname );
+    slow[ 0 ] = moon_checkcast_( L, idx, tname );
+    casts = slow;
+  }
+  return moon_checkobject_ptr_( L, idx, ti, h, tname, casts );
+}
+
+
+MOON_API void* moon_testobject_ic( lua_State* L, int idx,
+                                   char const* tname,
+                                   moon_object_cache* cache ) {
+  moon_object_header* h = (moon_object_header*)lua_touserdata( L, idx );
+  moon_typeinfo_* ti = NULL;
+  moon_object_cast const* casts = NULL;
+  moon_object_cast slow[ 2 ] = { 0, 0 };
+  luaL_checkstack( L, 2, "moon_testobject_ic" );
+  ti = moon_typeinfo_get_( L, idx, h );
+  if( !moon_typeinfo_match_ic_( ti, tname, cache, &casts ) ) {
+    moon_check_tname_( L, tname );
+    if( !moon_testcast_( L, idx, tname, slow ) )
+      return moon_testobject_fail_( L, tname );
+    casts = slow;
+  }
+  return moon_testobject_ptr_( L, ti, h, tname, casts );
+}
+
+
 static void* moon_cast_id_( void* p ) {
   return p;
 }
@@ -807,20 +4690,291 @@ static void moon_copy_table_( lua_State* L, int src, int dst ) {
 }
 
 
+MOON_API void moon_deffields( lua_State* L, char const* tname,
+                              moon_object_field const* fields ) {
+  moon_typeinfo_* ti = NULL;
+  lua_CFunction dispatch = 0;
+  int mt = 0, ft = 0, t = 0;
+  luaL_checkstack( L, 8, "moon_deffields" );
+  moon_check_tname_( L, tname );
+  luaL_getmetatable( L, tname );
+  if( lua_isnil( L, -1 ) && moon_lazy_push_( L, tname ) ) {
+    /* the field array is static, so we can apply it later */
+    int i = 1;
+    lua_getfield( L, -1, "fields" );
+    if( !lua_istable( L, -1 ) ) {
+      lua_pop( L, 1 );
+      lua_newtable( L );
+      lua_pushvalue( L, -1 );
+      lua_setfield( L, -3, "fields" );
+    }
+    lua_rawgeti( L, -1, i );
+    while( !lua_isnil( L, -1 ) ) {
+      lua_pop( L, 1 );
+      lua_rawgeti( L, -1, ++i );
+    }
+    lua_pop( L, 1 );
+    lua_pushlightuserdata( L, (void*)fields );
+    lua_rawseti( L, -2, i );
+    lua_pop( L, 3 );
+    return;
+  }
+  lua_pop( L, 1 );
+  ti = moon_push_metatable_( L, tname );
+  if( ti == NULL )
+    luaL_error( L, "no type descriptor for type '%s'", tname );
+  mt = lua_gettop( L );
+  /* the new fields table starts as a copy of the old one (if any) */
+  lua_newtable( L );
+  ft = lua_gettop( L );
+  dispatch = moon_getf_( L, "index", moon_index_dispatch_ );
+  lua_getfield( L, mt, "__index" );
+  if( lua_tocfunction( L, -1 ) == dispatch &&
+      lua_getupvalue( L, -1, 4 ) != NULL ) {
+    if( lua_istable( L, -1 ) )
+      moon_copy_table_( L, -1, ft );
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 1 );
+  for( ; fields != NULL && fields->name != NULL; ++fields ) {
+    moon_field_* f = (moon_field_*)lua_newuserdata( L, sizeof( *f ) );
+    f->owner = ti;
+    f->type = NULL;
+    f->tid = 0;
+    f->size = 0;
+    f->offset = fields->offset;
+    f->epoch = fields->epoch;
+    f->kind = fields->type;
+    if( !moon_field_range_( f->kind, &f->low, &f->high ) )
+      luaL_error( L, "invalid type for field '%s'", fields->name );
+    if( fields->low != 0 || fields->high != 0 ) {
+      f->low = fields->low;
+      f->high = fields->high;
+    }
+    f->view = 0;
+    if( (f->kind & ~MOON_FIELD_READONLY) == MOON_FIELD_OBJECT ) {
+      /* the user values must fit in an unsigned short */
+      if( ti->nviews >= USHRT_MAX-3 )
+        luaL_error( L, "too many object fields for type '%s'", tname );
+      f->view = ++ti->nviews;
+      f->type = moon_gettype( L, fields->tname );
+      f->tid = f->type->id;
+      f->size = f->type->size;
+      if( f->size == 0 )
+        luaL_error( L, "type '%s' is incomplete (size is 0)",
+                    fields->tname );
+    }
+    lua_setfield( L, ft, fields->name );
+  }
+  /* replace __index with a dispatcher that also knows the fields */
+  lua_getfield( L, mt, "__index" );
+  t = lua_type( L, -1 );
+  if( t == LUA_TFUNCTION && lua_tocfunction( L, -1 ) == dispatch ) {
+    lua_getupvalue( L, -1, 1 );
+    lua_getupvalue( L, -2, 2 );
+    lua_getupvalue( L, -3, 3 );
+  } else if( t == LUA_TTABLE ) { /* methods only */
+    lua_pushvalue( L, -1 );
+    lua_pushnil( L );
+    lua_pushnil( L );
+  } else if( t == LUA_TFUNCTION ) { /* index function only */
+    lua_pushnil( L );
+    lua_pushnil( L );
+    lua_pushvalue( L, -3 );
+  } else {
+    lua_pushnil( L );
+    lua_pushnil( L );
+    lua_pushnil( L );
+  }
+  lua_pushvalue( L, ft );
+  moon_pushindex_( L, dispatch, 4 );
+  lua_setfield( L, mt, "__index" );
+  /* for looking up field descriptors by name (see moon_defarray) */
+  lua_pushvalue( L, ft );
+  lua_setfield( L, mt, "__moon_fields" );
+  lua_pop( L, 1 );
+  /* same for __newindex */
+  dispatch = moon_getf_( L, "newindex", moon_newindex_dispatch_ );
+  lua_getfield( L, mt, "__newindex" );
+  t = lua_type( L, -1 );
+  if( t == LUA_TFUNCTION && lua_tocfunction( L, -1 ) == dispatch ) {
+    lua_getupvalue( L, -1, 1 );
+    lua_getupvalue( L, -2, 2 );
+  } else if( t == LUA_TFUNCTION ) { /* newindex function only */
+    lua_pushnil( L );
+    lua_pushvalue( L, -2 );
+  } else {
+    lua_pushnil( L );
+    lua_pushnil( L );
+  }
+  lua_pushvalue( L, ft );
+  lua_pushcclosure( L, dispatch, 3 );
+  lua_setfield( L, mt, "__newindex" );
+  lua_pop( L, 3 );
+}
+
+
+/* Collects the string keys of the table at index `src` in the values
+ * table `vals` (as triples of key, value, and tag). The key strings
+ * in `vals` map to their position in the array part, so that later
+ * entries override earlier entries with the same key. */
+static void moon_compileindex_merge_( lua_State* L, int src, int vals,
+                                      unsigned tag, size_t* n ) {
+  lua_pushnil( L );
+  while( lua_next( L, src ) ) {
+    if( lua_type( L, -2 ) == LUA_TSTRING ) {
+      int i = 0;
+      lua_pushvalue( L, -2 ); /* duplicate key */
+      lua_rawget( L, vals );
+      i = (int)lua_tointeger( L, -1 );
+      lua_pop( L, 1 );
+      if( i == 0 ) {
+        i = (int)(3*(*n)++ + 1);
+        lua_pushvalue( L, -2 );
+        lua_pushinteger( L, i );
+        lua_rawset( L, vals );
+        lua_pushvalue( L, -2 );
+        lua_rawseti( L, vals, i );
+      }
+      lua_pushvalue( L, -1 ); /* duplicate value */
+      lua_rawseti( L, vals, i+1 );
+      lua_pushinteger( L, (lua_Integer)tag );
+      lua_rawseti( L, vals, i+2 );
+    }
+    lua_pop( L, 1 ); /* pop value */
+  }
+}
+
+
+/* Tries to put all `n` keys from the values table into the hash table
+ * without collisions using the current seed. The key strings stay
+ * alive (and in place) because the values table references them. */
+static int moon_compileindex_try_( lua_State* L,
+                                   moon_dispatch_hash_* dh, int vals,
+                                   size_t n ) {
+  size_t i = 0;
+  for( i = 0; i <= dh->mask; ++i )
+    dh->e[ i ].key = NULL;
+  for( i = 0; i < n; ++i ) {
+    moon_dispatch_entry_* e = NULL;
+    char const* s = NULL;
+    lua_rawgeti( L, vals, (int)(3*i+1) );
+    s = lua_tostring( L, -1 );
+    lua_pop( L, 1 );
+    e = dh->e + (moon_dispatch_hashstr_( s, dh->seed ) & dh->mask);
+    if( e->key != NULL )
+      return 0;
+    e->key = s;
+    e->value = (int)(3*i+2);
+    lua_rawgeti( L, vals, (int)(3*i+3) );
+    e->tag = (unsigned)lua_tointeger( L, -1 );
+    lua_rawgeti( L, vals, e->value );
+    e->field = e->tag == MOON_DISPATCH_FIELD_ ?
+               (moon_field_ const*)lua_touserdata( L, -1 ) : NULL;
+    lua_pop( L, 2 );
+  }
+  return 1;
+}
+
+
+MOON_API void moon_compileindex( lua_State* L, char const* tname ) {
+  static int const uvs[] = { 2, 4, 1 };
+  static unsigned const tags[] = {
+    MOON_DISPATCH_PROPERTY_, MOON_DISPATCH_FIELD_, MOON_DISPATCH_METHOD_
+  };
+  lua_CFunction dispatch = 0;
+  moon_dispatch_hash_* dh = NULL;
+  size_t n = 0, m = 2;
+  int mt = 0, ix = 0, vals = 0, i = 0;
+  luaL_checkstack( L, 12, "moon_compileindex" );
+  moon_push_metatable_( L, tname );
+  mt = lua_gettop( L );
+  dispatch = moon_getf_( L, "index", moon_index_dispatch_ );
+  lua_getfield( L, mt, "__index" );
+  ix = lua_gettop( L );
+  if( lua_type( L, ix ) == LUA_TTABLE ) { /* methods only */
+    lua_pushvalue( L, ix );
+    lua_pushnil( L );
+    lua_pushnil( L );
+    lua_pushnil( L );
+    moon_pushindex_( L, dispatch, 4 );
+    lua_replace( L, ix );
+  } else if( lua_tocfunction( L, ix ) != dispatch ) {
+    lua_pop( L, 2 ); /* nothing to compile */
+    return;
+  }
+  /* merge properties, fields, and methods (in increasing order of
+   * precedence) */
+  lua_newtable( L );
+  vals = lua_gettop( L );
+  for( i = 0; i < 3; ++i ) {
+    if( lua_getupvalue( L, ix, uvs[ i ] ) != NULL ) {
+      if( lua_istable( L, -1 ) )
+        moon_compileindex_merge_( L, lua_gettop( L ), vals, tags[ i ],
+                                  &n );
+      lua_pop( L, 1 );
+    }
+  }
+  /* find a collision-free seed, use a larger table if necessary */
+  while( m < 2*n )
+    m *= 2;
+  for( ;; m *= 2 ) {
+    dh = (moon_dispatch_hash_*)lua_newuserdata( L,
+           sizeof( moon_dispatch_hash_ ) +
+           (m-1) * sizeof( moon_dispatch_entry_ ) );
+    dh->mask = m-1;
+    for( dh->seed = 0; dh->seed < 256; ++dh->seed )
+      if( moon_compileindex_try_( L, dh, vals, n ) )
+        break;
+    if( dh->seed < 256 )
+      break;
+    lua_pop( L, 1 );
+    if( m > 256*n ) { /* should never happen */
+      lua_pop( L, 3 );
+      return;
+    }
+  }
+  /* map the key strings to their slots in the hash (plus 1) */
+  for( i = 0; i <= (int)dh->mask; ++i ) {
+    if( dh->e[ i ].key != NULL ) {
+      lua_rawgeti( L, vals, dh->e[ i ].value-1 );
+      lua_pushinteger( L, i+1 );
+      lua_rawset( L, vals );
+    }
+  }
+  /* replace the __index dispatcher with a compiled one */
+  for( i = 1; i <= 4; ++i )
+    if( lua_getupvalue( L, ix, i ) == NULL )
+      lua_pushnil( L );
+  lua_pushvalue( L, -5 ); /* hash */
+  lua_pushvalue( L, vals );
+  moon_pushindex_( L, dispatch, 6 );
+  lua_setfield( L, mt, "__index" );
+  lua_pop( L, 4 );
+}
+
+
 MOON_LLINKAGE_BEGIN
 MOON_API int moon_derive( lua_State* L ) {
   char const* newtype = luaL_checkstring( L, 1 );
   char const* oldtype = luaL_checkstring( L, 2 );
   int t = 0;
+  moon_typeinfo_* oti = NULL;
+  moon_typeinfo_* nti = NULL;
   lua_settop( L, 2 );
   moon_check_tname_( L, newtype );
   lua_pushvalue( L, 1 );
   lua_rawget( L, LUA_REGISTRYINDEX );
-  luaL_argcheck( L, lua_isnil( L, -1 ), 1,
-                 "attempt to redefine type" );
+  luaL_argcheck( L, lua_isnil( L, -1 ) && !moon_lazy_push_( L, newtype ),
+                 1, "attempt to redefine type" );
   lua_pop( L, 1 );
   lua_pushvalue( L, 2 );
   lua_rawget( L, LUA_REGISTRYINDEX ); /* 3: old metatable */
+  if( lua_isnil( L, 3 ) && moon_lazy_materialize_( L, oldtype ) ) {
+    lua_pop( L, 1 );
+    lua_pushvalue( L, 2 );
+    lua_rawget( L, LUA_REGISTRYINDEX ); /* 3: old metatable */
+  }
   moon_check_metatable_( L, oldtype );
   /* clone metatable */
   lua_newtable( L ); /* 4: new metatable */
@@ -854,16 +5008,29 @@ MOON_API int moon_derive( lua_State* L ) {
       lua_pushvalue( L, 6 ); /* 8: new methods table */
       lua_getupvalue( L, 5, 2 ); /* 9: properties */
       lua_getupvalue( L, 5, 3 ); /* 10: index func */
-      lua_pushcclosure( L, dispatch, 3 ); /* 8: dispatcher */
+      if( lua_getupvalue( L, 5, 4 ) == NULL ) /* 11: fields */
+        lua_pushnil( L );
+      moon_pushindex_( L, dispatch, 4 ); /* 8: dispatcher */
     } else {
       lua_pushvalue( L, 6 ); /* 8: new methods table */
       lua_pushnil( L ); /* 9: no properties */
       lua_pushvalue( L, 5 ); /* 10: index func */
-      lua_pushcclosure( L, dispatch, 3 ); /* 8: dispatcher */
+      lua_pushnil( L ); /* 11: no fields */
+      moon_pushindex_( L, dispatch, 4 ); /* 8: dispatcher */
     }
   } else
     lua_pushvalue( L, 6 ); /* 8: new methods table */
   lua_rawset( L, 4 );
+  /* add the new type to the type registry, it can be used wherever
+   * the old type (or anything the old type casts to) is expected */
+  oti = moon_typeinfo_frommt_( L, 3, oldtype );
+  lua_pushvalue( L, 4 );
+  nti = moon_types_define_( L, newtype, oti ? oti->size : 0 );
+  if( oti != NULL ) /* the fields are shared */
+    nti->nviews = oti->nviews;
+  lua_pop( L, 1 );
+  if( oti != NULL )
+    moon_typeinfo_addcast_( L, nti, oti, 0 );
   /* register new type */
   lua_pushvalue( L, 1 );
   lua_pushvalue( L, 4 );
@@ -878,6 +5045,7 @@ MOON_API int moon_downcast( lua_State* L ) {
   void* h = lua_touserdata( L, 1 );
   char const* tname = luaL_checkstring( L, 2 );
   moon_object_cast cast = 0, id_cast = 0;
+  moon_typeinfo_* ti = NULL;
   lua_settop( L, 2 );
   luaL_argcheck( L, h != NULL && lua_getmetatable( L, 1 ), 1,
                  "object expected" ); /* 3: metatable */
@@ -897,6 +5065,8 @@ MOON_API int moon_downcast( lua_State* L ) {
   id_cast = (moon_object_cast)(void(*)(void))moon_getf_( L, "cast", (lua_CFunction)(void(*)(void))moon_cast_id_ );
   luaL_argcheck( L, cast == id_cast, 1, "invalid downcast" );
   lua_pop( L, 1 );
+  ti = moon_typeinfo_frommt_( L, 5, tname );
+  ((moon_object_header*)h)->type_id = ti != NULL ? ti->id : 0;
   lua_setmetatable( L, 1 );
   lua_settop( L, 1 );
   return 1;
@@ -904,6 +5074,38 @@ MOON_API int moon_downcast( lua_State* L ) {
 MOON_LLINKAGE_END
 
 
+/* Pushes a table with the per-type counters of an instrumented build
+ * (compiled with MOON_STATS defined), or an empty table otherwise. */
+MOON_LLINKAGE_BEGIN
+MOON_API int moon_stats( lua_State* L ) {
+#ifdef MOON_STATS
+  moon_types_* t = NULL;
+  size_t i = 0;
+  int j = 0;
+  luaL_checkstack( L, 5, "moon_stats" );
+#endif
+  lua_newtable( L );
+#ifdef MOON_STATS
+  lua_getfield( L, LUA_REGISTRYINDEX, "__moon_types" );
+  t = moon_types_test_( L, -1 );
+  for( i = 1; t != NULL && i < t->n; ++i ) {
+    moon_typeinfo_* ti = t->v[ i ];
+    if( ti->mt != NULL ) {
+      lua_createtable( L, 0, MOON_STATS_N_ );
+      for( j = 0; j < MOON_STATS_N_; ++j ) {
+        lua_pushinteger( L, (lua_Integer)ti->stats[ j ] );
+        lua_setfield( L, -2, moon_stats_names_[ j ] );
+      }
+      lua_setfield( L, -3, ti->name );
+    }
+  }
+  lua_pop( L, 1 );
+#endif
+  return 1;
+}
+MOON_LLINKAGE_END
+
+
 MOON_API lua_Integer moon_checkint( lua_State* L, int idx,
                                     lua_Integer low,
                                     lua_Integer high ) {
@@ -956,14 +5158,36 @@ MOON_API int* moon_atexit( lua_State* L, lua_CFunction func ) {
 }
 
 
-MOON_API void moon_setuvfield( lua_State* L, int i, char const* key ) {
-  luaL_checkstack( L, 2, "moon_setuvfield" );
+/* Pushes the uservalue table of the userdata at index `i` (creating
+ * it if necessary) and returns 1. If the uservalue is something else,
+ * it is pushed anyway and 0 is returned. */
+static int moon_pushuvtable_( lua_State* L, int i ) {
+  i = moon_absindex( L, i );
 #if LUA_VERSION_NUM < 502
   lua_getfenv( L, i );
+  /* the default environment is not a good place for private data */
+  if( lua_rawequal( L, -1, LUA_GLOBALSINDEX ) ) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setfenv( L, i );
+  }
 #else
   lua_getuservalue( L, i );
+  if( lua_isnil( L, -1 ) ) { /* create uservalue table on demand */
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setuservalue( L, i );
+  }
 #endif
-  if( !lua_istable( L, -1 ) )
+  return lua_istable( L, -1 );
+}
+
+
+MOON_API void moon_setuvfield( lua_State* L, int i, char const* key ) {
+  luaL_checkstack( L, 3, "moon_setuvfield" );
+  if( !moon_pushuvtable_( L, i ) )
     luaL_error( L, "attempt to add to non-table uservalue" );
   lua_pushvalue( L, -2 );
   lua_setfield( L, -2, key );
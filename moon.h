@@ -113,16 +113,47 @@ extern "C" {
 /* make sure all functions can be called using the moon_ prefix, even
  * if we change the prefix behind the scenes */
 #define moon_defobject      MOON_CONCAT( MOON_PREFIX, _defobject )
+#define moon_defobject_lazy MOON_CONCAT( MOON_PREFIX, _defobject_lazy )
+#define moon_defobjects     MOON_CONCAT( MOON_PREFIX, _defobjects )
 #define moon_newobject      MOON_CONCAT( MOON_PREFIX, _newobject )
+#define moon_newobjects     MOON_CONCAT( MOON_PREFIX, _newobjects )
 #define moon_newpointer     MOON_CONCAT( MOON_PREFIX, _newpointer )
 #define moon_newfield       MOON_CONCAT( MOON_PREFIX, _newfield )
+#define moon_newfield_epoch MOON_CONCAT( MOON_PREFIX, _newfield_epoch )
+#define moon_defpool        MOON_CONCAT( MOON_PREFIX, _defpool )
+#define moon_newpooled      MOON_CONCAT( MOON_PREFIX, _newpooled )
+#define moon_getpoolstats   MOON_CONCAT( MOON_PREFIX, _getpoolstats )
+#define moon_defarray       MOON_CONCAT( MOON_PREFIX, _defarray )
+#define moon_newarray       MOON_CONCAT( MOON_PREFIX, _newarray )
+#define moon_maparray       MOON_CONCAT( MOON_PREFIX, _maparray )
+#define moon_checkarray     MOON_CONCAT( MOON_PREFIX, _checkarray )
+#define moon_newbuffer      MOON_CONCAT( MOON_PREFIX, _newbuffer )
+#define moon_viewbuffer     MOON_CONCAT( MOON_PREFIX, _viewbuffer )
+#define moon_checkbuffer    MOON_CONCAT( MOON_PREFIX, _checkbuffer )
+#define moon_newregion      MOON_CONCAT( MOON_PREFIX, _newregion )
+#define moon_regionalloc    MOON_CONCAT( MOON_PREFIX, _regionalloc )
+#define moon_newobject_r    MOON_CONCAT( MOON_PREFIX, _newobject_r )
+#define moon_newtypeset     MOON_CONCAT( MOON_PREFIX, _newtypeset )
+#define moon_deftypes       MOON_CONCAT( MOON_PREFIX, _deftypes )
+#define moon_freetypeset    MOON_CONCAT( MOON_PREFIX, _freetypeset )
 #define moon_getmethods     MOON_CONCAT( MOON_PREFIX, _getmethods )
+#define moon_deffields      MOON_CONCAT( MOON_PREFIX, _deffields )
+#define moon_compileindex   MOON_CONCAT( MOON_PREFIX, _compileindex )
 #define moon_killobject     MOON_CONCAT( MOON_PREFIX, _killobject )
 #define moon_defcast        MOON_CONCAT( MOON_PREFIX, _defcast )
 #define moon_checkobject    MOON_CONCAT( MOON_PREFIX, _checkobject )
 #define moon_testobject     MOON_CONCAT( MOON_PREFIX, _testobject )
+#define moon_gettype        MOON_CONCAT( MOON_PREFIX, _gettype )
+#define moon_newobject_t    MOON_CONCAT( MOON_PREFIX, _newobject_t )
+#define moon_newpointer_t   MOON_CONCAT( MOON_PREFIX, _newpointer_t )
+#define moon_newfield_t     MOON_CONCAT( MOON_PREFIX, _newfield_t )
+#define moon_checkobject_t  MOON_CONCAT( MOON_PREFIX, _checkobject_t )
+#define moon_testobject_t   MOON_CONCAT( MOON_PREFIX, _testobject_t )
+#define moon_checkobject_ic MOON_CONCAT( MOON_PREFIX, _checkobject_ic )
+#define moon_testobject_ic  MOON_CONCAT( MOON_PREFIX, _testobject_ic )
 #define moon_derive         MOON_CONCAT( MOON_PREFIX, _derive )
 #define moon_downcast       MOON_CONCAT( MOON_PREFIX, _downcast )
+#define moon_stats          MOON_CONCAT( MOON_PREFIX, _stats )
 #define moon_checkint       MOON_CONCAT( MOON_PREFIX, _checkint )
 #define moon_optint         MOON_CONCAT( MOON_PREFIX, _optint )
 #define moon_atexit         MOON_CONCAT( MOON_PREFIX, _atexit )
@@ -140,6 +171,7 @@ typedef struct {
   unsigned char cleanup_offset;
   unsigned char vcheck_offset;
   unsigned char object_offset;
+  unsigned short type_id;
 } moon_object_header;
 
 
@@ -154,19 +186,141 @@ typedef void* (*moon_object_cast)( void* );
 /* function pointer type for destructors */
 typedef void (*moon_object_destructor)( void* );
 
+/* opaque handle for a moon object type in a given Lua state */
+typedef struct moon_typeinfo_ moon_object_type;
+
+/* per-callsite cache for moon_{check,test}object_ic, must be
+ * zero-initialized (e.g. by making it static) */
+typedef struct {
+  unsigned long seq; /* odd while the cache is being updated */
+  moon_object_type const* type;
+  unsigned long stamp;
+  char const* tname;
+  moon_object_cast const* casts;
+} moon_object_cache;
+
+/* field types for moon_deffields */
+#define MOON_FIELD_INT8     1u
+#define MOON_FIELD_UINT8    2u
+#define MOON_FIELD_INT16    3u
+#define MOON_FIELD_UINT16   4u
+#define MOON_FIELD_INT32    5u
+#define MOON_FIELD_UINT32   6u
+#define MOON_FIELD_INT64    7u
+#define MOON_FIELD_UINT64   8u
+#define MOON_FIELD_INT      9u
+#define MOON_FIELD_FLOAT    10u
+#define MOON_FIELD_DOUBLE   11u
+#define MOON_FIELD_BOOL     12u
+#define MOON_FIELD_POINTER  13u
+#define MOON_FIELD_OBJECT   14u
+/* can be or-ed to any of the above */
+#define MOON_FIELD_READONLY 0x100u
+
+/* field descriptor for moon_deffields, arrays of those are terminated
+ * by an entry with a NULL name */
+typedef struct {
+  char const* name;
+  unsigned type;
+  size_t offset;
+  lua_Integer low; /* low == high == 0 means natural range */
+  lua_Integer high;
+  char const* tname; /* for MOON_FIELD_OBJECT */
+  size_t epoch; /* for MOON_FIELD_OBJECT: 0 or MOON_FIELD_EPOCH(...) */
+} moon_object_field;
+
+/* location of an `unsigned` generation counter in the parent struct
+ * that invalidates the views of an embedded MOON_FIELD_OBJECT */
+#define MOON_FIELD_EPOCH( _t, _m ) (offsetof( _t, _m )+1)
+
+/* static type description for moon_defobjects and moon_newtypeset,
+ * arrays of those are terminated by an entry with a NULL tname */
+typedef struct {
+  char const* tname;
+  size_t size;
+  luaL_Reg const* methods; /* may be NULL */
+  moon_object_field const* fields; /* may be NULL */
+} moon_object_def;
+
+/* cast description for moon_defobjects and moon_newtypeset, arrays
+ * of those are terminated by an entry with a NULL tname1 */
+typedef struct {
+  char const* tname1;
+  char const* tname2;
+  moon_object_cast cast;
+} moon_object_castdef;
+
+/* mapping modes for moon_maparray */
+#define MOON_MAP_PRIVATE    0
+#define MOON_MAP_SHARED     1
+#define MOON_MAP_READONLY   2
+
+/* opaque handle for a process-wide set of moon object types */
+typedef struct moon_typeset_ moon_object_typeset;
+
 
 /* additional Lua API functions in this toolkit */
 MOON_API void moon_defobject( lua_State* L, char const* tname,
                               size_t sz, luaL_Reg const* methods,
                               int nup );
+MOON_API void moon_defobject_lazy( lua_State* L, char const* tname,
+                                   size_t sz, luaL_Reg const* methods,
+                                   int nup );
+MOON_API void moon_defobjects( lua_State* L,
+                               moon_object_def const* defs,
+                               moon_object_castdef const* casts );
 MOON_API void* moon_newobject( lua_State* L, char const* tname,
                                moon_object_destructor destructor );
+MOON_API void moon_newobjects( lua_State* L, char const* tname,
+                               int n,
+                               moon_object_destructor destructor,
+                               void const* proto,
+                               void (*init)( void* p, int i,
+                                             void* ud ),
+                               void* ud );
 MOON_API void** moon_newpointer( lua_State* L, char const* tname,
                                  moon_object_destructor destructor );
 MOON_API void** moon_newfield( lua_State* L, char const* tname,
                                int idx, int (*isvalid)( void* p ),
                                void* p );
+MOON_API void** moon_newfield_epoch( lua_State* L, char const* tname,
+                                     int idx, unsigned const* epochp );
+MOON_API void moon_defpool( lua_State* L, char const* tname,
+                            size_t sz, size_t nslots,
+                            moon_object_destructor destructor );
+MOON_API void* moon_newpooled( lua_State* L, char const* tname );
+MOON_API void moon_getpoolstats( lua_State* L, char const* tname );
+MOON_API void moon_defarray( lua_State* L, char const* tname,
+                             char const* elemtname );
+MOON_API void* moon_newarray( lua_State* L, char const* tname,
+                              size_t n, void* buffer,
+                              moon_object_destructor destructor );
+MOON_API void* moon_maparray( lua_State* L, char const* tname,
+                              char const* path, int mode,
+                              size_t* n );
+MOON_API void* moon_checkarray( lua_State* L, int idx,
+                                char const* tname, size_t* n );
+MOON_API void* moon_newbuffer( lua_State* L, void* p, size_t len,
+                               moon_object_destructor release );
+MOON_API void* moon_viewbuffer( lua_State* L, int idx, size_t offset,
+                                size_t len );
+MOON_API void* moon_checkbuffer( lua_State* L, int idx, size_t* len,
+                                 int writable );
+MOON_API void moon_newregion( lua_State* L, size_t blocksize );
+MOON_API void* moon_regionalloc( lua_State* L, int region, size_t sz );
+MOON_API void* moon_newobject_r( lua_State* L, char const* tname,
+                                 int region,
+                                 moon_object_destructor destructor );
+MOON_API moon_object_typeset*
+moon_newtypeset( lua_State* L, moon_object_def const* types,
+                 moon_object_castdef const* casts );
+MOON_API void moon_deftypes( lua_State* L,
+                             moon_object_typeset const* set );
+MOON_API void moon_freetypeset( moon_object_typeset* set );
 MOON_API int moon_getmethods( lua_State* L, char const* tname );
+MOON_API void moon_deffields( lua_State* L, char const* tname,
+                              moon_object_field const* fields );
+MOON_API void moon_compileindex( lua_State* L, char const* tname );
 MOON_API void moon_killobject( lua_State* L, int idx );
 MOON_API void moon_defcast( lua_State* L, char const* tname1,
                             char const* tname2,
@@ -175,10 +329,30 @@ MOON_API void* moon_checkobject( lua_State* L, int idx,
                                  char const* tname );
 MOON_API void* moon_testobject( lua_State* L, int idx,
                                 char const* tname );
+MOON_API moon_object_type* moon_gettype( lua_State* L,
+                                         char const* tname );
+MOON_API void* moon_newobject_t( lua_State* L, moon_object_type* t,
+                                 moon_object_destructor destructor );
+MOON_API void** moon_newpointer_t( lua_State* L, moon_object_type* t,
+                                   moon_object_destructor destructor );
+MOON_API void** moon_newfield_t( lua_State* L, moon_object_type* t,
+                                 int idx, int (*isvalid)( void* p ),
+                                 void* p );
+MOON_API void* moon_checkobject_t( lua_State* L, int idx,
+                                   moon_object_type* t );
+MOON_API void* moon_testobject_t( lua_State* L, int idx,
+                                  moon_object_type* t );
+MOON_API void* moon_checkobject_ic( lua_State* L, int idx,
+                                    char const* tname,
+                                    moon_object_cache* cache );
+MOON_API void* moon_testobject_ic( lua_State* L, int idx,
+                                   char const* tname,
+                                   moon_object_cache* cache );
 
 MOON_LLINKAGE_BEGIN
 MOON_API int moon_derive( lua_State* L );
 MOON_API int moon_downcast( lua_State* L );
+MOON_API int moon_stats( lua_State* L );
 MOON_LLINKAGE_END
 
 MOON_API lua_Integer moon_checkint( lua_State* L, int idx,
@@ -0,0 +1,174 @@
+/* Copyright 2013-2016 Philipp Janda <siffiejoe@gmx.net>
+ *
+ * You may do anything with this work that copyright law would normally
+ * restrict, so long as you retain the above notice(s) and this license
+ * in all redistributed copies and derived works.  There is no warranty.
+ */
+
+#ifndef MOON_HPP_
+#define MOON_HPP_
+
+/* file: moon.hpp
+ * Header-only C++11 layer on top of moon.h: type names, sizes,
+ * alignments, and destructors of moon objects are derived from the
+ * C++ types at compile time.
+ */
+
+#include <new>
+#include <utility>
+#include <type_traits>
+#include "moon.h"
+
+#if (!defined( _MSC_VER ) || _MSC_VER < 1900) && __cplusplus < 201103L
+#  error moon.hpp needs C++11 or newer
+#endif
+
+#if defined( __cpp_exceptions ) || defined( __EXCEPTIONS ) || \
+    defined( _CPPUNWIND )
+#  define MOON_CPP_EXCEPTIONS_
+#endif
+
+
+namespace moon {
+
+  /* Maps a C++ type to the name of the corresponding moon object type.
+   * Use MOON_CPP_TYPE to provide specializations. */
+  template< typename T >
+  struct type_name;
+
+  namespace detail {
+
+    /* same as the alignment of the payload of moon objects */
+    union max_align {
+      lua_Number n;
+      double d;
+      lua_Integer i;
+      long l;
+      size_t s;
+      void* p;
+      void (*fp)( void );
+    };
+
+    template< typename T >
+    void destroy( void* p ) {
+      static_cast< T* >( p )->~T();
+    }
+
+    template< typename From, typename To >
+    void* upcast( void* p ) {
+      return static_cast< To* >( static_cast< From* >( p ) );
+    }
+
+  } /* namespace detail */
+
+
+  /* Compile-time descriptor of a moon object type. */
+  template< typename T >
+  struct type {
+    static_assert( alignof( T ) <= alignof( detail::max_align ),
+                   "alignment of T is too large for moon objects" );
+
+    static size_t const size = sizeof( T );
+    static size_t const alignment = alignof( T );
+
+    static char const* name() {
+      return type_name< T >::get();
+    }
+
+    /* trivially destructible types don't need a __gc call */
+    static moon_object_destructor destructor() {
+      return std::is_trivially_destructible< T >::value
+        ? static_cast< moon_object_destructor >( 0 )
+        : &detail::destroy< T >;
+    }
+
+    /* The type descriptor found by the last type check is remembered
+     * here, so checking an object of type T (or a type with a cast to
+     * T) is a pointer comparison most of the time. There is one cache
+     * per thread, so threads with their own `lua_State`s don't
+     * interfere with each other. */
+    static moon_object_cache* cache() {
+      static thread_local moon_object_cache c;
+      return &c;
+    }
+  };
+
+
+  template< typename T >
+  inline void define( lua_State* L, luaL_Reg const* methods = NULL,
+                      int nup = 0 ) {
+    moon_defobject( L, type< T >::name(), type< T >::size, methods,
+                    nup );
+  }
+
+
+  /* Makes objects of type `From` usable where `To` is expected, e.g.
+   * for public base classes. */
+  template< typename From, typename To >
+  inline void defcast( lua_State* L ) {
+    moon_defcast( L, type< From >::name(), type< To >::name(),
+                  &detail::upcast< From, To > );
+  }
+
+
+  /* Creates a new moon object and constructs the T in place using
+   * the given arguments. ~T is called when the object is collected
+   * (or killed). If the constructor throws, nothing is pushed. */
+  template< typename T, typename... Args >
+  inline T* make( lua_State* L, Args&&... args ) {
+    void* p = moon_newobject( L, type< T >::name(),
+                              type< T >::destructor() );
+#ifdef MOON_CPP_EXCEPTIONS_
+    try {
+#endif
+      return ::new( p ) T( std::forward< Args >( args )... );
+#ifdef MOON_CPP_EXCEPTIONS_
+    } catch( ... ) {
+      moon_object_header* h = static_cast< moon_object_header* >(
+        lua_touserdata( L, -1 ) );
+      h->flags &= ~MOON_OBJECT_IS_VALID; /* don't call ~T */
+      lua_pop( L, 1 );
+      throw;
+    }
+#endif
+  }
+
+
+  /* Moves (or copies) a value into a new moon object. */
+  template< typename T >
+  inline typename std::decay< T >::type* push( lua_State* L, T&& v ) {
+    return make< typename std::decay< T >::type >( L,
+                                                   std::forward< T >( v ) );
+  }
+
+
+  template< typename T >
+  inline T* check( lua_State* L, int idx ) {
+    return static_cast< T* >( moon_checkobject_ic( L, idx,
+      type< T >::name(), type< T >::cache() ) );
+  }
+
+
+  template< typename T >
+  inline T* test( lua_State* L, int idx ) {
+    return static_cast< T* >( moon_testobject_ic( L, idx,
+      type< T >::name(), type< T >::cache() ) );
+  }
+
+} /* namespace moon */
+
+
+/* Associates a C++ type with a moon object type name. Must be used
+ * at global scope. */
+#define MOON_CPP_TYPE( _t, _name ) \
+  namespace moon { \
+    template<> \
+    struct type_name< _t > { \
+      static char const* get() { \
+        static char const name[] = _name; \
+        return name; \
+      } \
+    }; \
+  }
+
+#endif /* MOON_HPP_ */
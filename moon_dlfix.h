@@ -23,6 +23,14 @@
 #endif
 
 
+/* the helper functions below are unused unless MOON_DLFIX() is used */
+#if defined( __GNUC__ )
+#define MOON_DLFIX_UNUSED __attribute__(( unused ))
+#else
+#define MOON_DLFIX_UNUSED
+#endif
+
+
 /* detect some form of UNIX, so that unistd.h can be included to
  * use other feature macros */
 #if defined( unix ) || defined( __unix ) || defined( __unix__ ) || \
@@ -96,38 +104,147 @@ static char const* const moon_dlfix_lib_names[] = {
 #define MOON_DLFIX_LIBPREFIX  "liblua"
 #endif
 
+#ifdef ElfW
+/* Looks up a symbol in the dynamic symbol table of a loaded ELF
+ * object using its hash table (DT_GNU_HASH or DT_HASH), which is a
+ * lot cheaper than a dlopen()/dlsym()/dlclose() round trip. Returns
+ * 1 if the symbol is defined in the object, 0 if it isn't, and -1 if
+ * the dynamic section could not be used.
+ */
+MOON_DLFIX_UNUSED
+static int moon_dlfix_hassym( struct dl_phdr_info* info,
+                              char const* name ) {
+  ElfW(Dyn) const* dyn = NULL;
+  ElfW(Sym) const* symtab = NULL;
+  char const* strtab = NULL;
+  Elf32_Word const* hash = NULL;
+  Elf32_Word const* gnuhash = NULL;
+  int i = 0;
+  for( i = 0; i < (int)info->dlpi_phnum; ++i )
+    if( info->dlpi_phdr[ i ].p_type == PT_DYNAMIC )
+      dyn = (ElfW(Dyn) const*)(info->dlpi_addr +
+                                info->dlpi_phdr[ i ].p_vaddr);
+  if( dyn == NULL )
+    return -1;
+  for( ; dyn->d_tag != DT_NULL; ++dyn ) {
+    /* some dynamic linkers relocate the addresses in the dynamic
+     * section, others don't */
+    ElfW(Addr) a = dyn->d_un.d_ptr;
+    if( a < info->dlpi_addr )
+      a += info->dlpi_addr;
+    switch( dyn->d_tag ) {
+      case DT_SYMTAB:
+        symtab = (ElfW(Sym) const*)a; break;
+      case DT_STRTAB:
+        strtab = (char const*)a; break;
+      case DT_HASH:
+        hash = (Elf32_Word const*)a; break;
+#ifdef DT_GNU_HASH
+      case DT_GNU_HASH:
+        gnuhash = (Elf32_Word const*)a; break;
+#endif
+    }
+  }
+  if( symtab == NULL || strtab == NULL )
+    return -1;
+  if( gnuhash != NULL ) {
+    Elf32_Word nbuckets = gnuhash[ 0 ];
+    Elf32_Word symoffset = gnuhash[ 1 ];
+    Elf32_Word bloomsize = gnuhash[ 2 ];
+    Elf32_Word bloomshift = gnuhash[ 3 ];
+    ElfW(Addr) const* bloom = (ElfW(Addr) const*)(gnuhash + 4);
+    Elf32_Word const* buckets = (Elf32_Word const*)(bloom + bloomsize);
+    Elf32_Word const* chain = buckets + nbuckets;
+    unsigned const bits = sizeof( ElfW(Addr) ) * 8;
+    Elf32_Word h = 5381;
+    Elf32_Word idx = 0;
+    ElfW(Addr) word = 0;
+    unsigned char const* p = (unsigned char const*)name;
+    for( ; *p != '\0'; ++p )
+      h = h * 33 + *p;
+    if( nbuckets == 0 || bloomsize == 0 )
+      return 0;
+    word = bloom[ (h / bits) % bloomsize ];
+    if( !((word >> (h % bits)) & (word >> ((h >> bloomshift) % bits)) & 1) )
+      return 0;
+    idx = buckets[ h % nbuckets ];
+    if( idx < symoffset )
+      return 0;
+    for( ;; ++idx ) {
+      Elf32_Word h2 = chain[ idx - symoffset ];
+      if( (h|1) == (h2|1) &&
+          0 == strcmp( name, strtab + symtab[ idx ].st_name ) )
+        return symtab[ idx ].st_shndx != SHN_UNDEF;
+      if( h2 & 1 )
+        return 0;
+    }
+  } else if( hash != NULL ) {
+    Elf32_Word nbuckets = hash[ 0 ];
+    Elf32_Word const* buckets = hash + 2;
+    Elf32_Word const* chain = buckets + nbuckets;
+    Elf32_Word h = 0;
+    Elf32_Word idx = 0;
+    unsigned char const* p = (unsigned char const*)name;
+    for( ; *p != '\0'; ++p ) {
+      Elf32_Word g = 0;
+      h = (h << 4) + *p;
+      g = h & 0xf0000000;
+      if( g != 0 )
+        h ^= g >> 24;
+      h &= ~g;
+    }
+    if( nbuckets == 0 )
+      return 0;
+    for( idx = buckets[ h % nbuckets ]; idx != STN_UNDEF;
+         idx = chain[ idx ] ) {
+      if( 0 == strcmp( name, strtab + symtab[ idx ].st_name ) )
+        return symtab[ idx ].st_shndx != SHN_UNDEF;
+    }
+    return 0;
+  }
+  return -1;
+}
+#else
+#define moon_dlfix_hassym( _i, _n ) (-1)
+#endif /* has ElfW */
+
+MOON_DLFIX_UNUSED
 static int moon_dlfix_cb( struct dl_phdr_info* info, size_t size,
                           void* data ) {
-  int* found = data;
-  void* dl = dlopen( info->dlpi_name, RTLD_LAZY );
+  int* found = (int*)data;
+  char const* libname = strrchr( info->dlpi_name, '/' );
   (void)size;
+  if( libname )
+    ++libname; /* skip slash */
+  else
+    libname = info->dlpi_name;
   MOON_DLFIX_DBG(("Checking ELF object '%s'.\n", info->dlpi_name));
-  if( dl ) {
-    if( dlsym( dl, "lua_gettop" ) ) {
+  /* the Lua API could be in a dependency, so test the library name
+   * for "liblua" (this is cheap, so it's done first) */
+  if( 0 == strncmp( libname, MOON_DLFIX_LIBPREFIX,
+                    sizeof( MOON_DLFIX_LIBPREFIX )-1 ) ) {
+    int has = moon_dlfix_hassym( info, "lua_gettop" );
+    if( has < 0 ) {
+      void* dl = dlopen( info->dlpi_name, RTLD_LAZY );
+      has = dl != NULL && dlsym( dl, "lua_gettop" ) != NULL;
+      if( dl )
+        dlclose( dl );
+    }
+    if( has ) {
+      void* dl2 = NULL;
       MOON_DLFIX_DBG(("'%s' does have Lua symbols.\n", info->dlpi_name));
-      /* the Lua API could be in a dependency, so test the library
-       * name for "liblua" */
-      char const* libname = strrchr( info->dlpi_name, '/' );
-      if( libname )
-        ++libname; /* skip slash */
-      else
-        libname = info->dlpi_name;
-      if( 0 == strncmp( libname, MOON_DLFIX_LIBPREFIX,
-                        sizeof( MOON_DLFIX_LIBPREFIX )-1 ) ) {
-        void* dl2 = dlopen( info->dlpi_name,
-                            RTLD_LAZY|RTLD_GLOBAL|RTLD_NOLOAD );
-        if( dl2 ) {
-          MOON_DLFIX_DBG(("Found and fixed Lua SO!\n"));
-          dlclose( dl2 );
-          *found = 1;
-        }
+      dl2 = dlopen( info->dlpi_name, RTLD_LAZY|RTLD_GLOBAL|RTLD_NOLOAD );
+      if( dl2 ) {
+        MOON_DLFIX_DBG(("Found and fixed Lua SO!\n"));
+        dlclose( dl2 );
+        *found = 1;
       }
     }
-    dlclose( dl );
   }
   return *found;
 }
 
+MOON_DLFIX_UNUSED
 static int moon_dlfix_find( void ) {
   int found = 0;
   MOON_DLFIX_DBG(("Iterating all loaded ELF objects ...\n"));
@@ -141,28 +258,91 @@ static int moon_dlfix_find( void ) {
 #  define MOON_DLFIX_FIND()  (0)
 #endif
 
-/* Try to iterate all loaded shared libraries using a platform-
+/* Once the Lua library has been reopened in global mode, the Lua API
+ * is visible via the handle of the main program, so this check
+ * remembers the result of MOON_DLFIX() for the whole process (e.g.
+ * for other plugins or for reloaded ones).
+ */
+MOON_DLFIX_UNUSED
+static int moon_dlfix_isglobal( void ) {
+  int found = 0;
+  void* self = dlopen( NULL, RTLD_LAZY );
+  if( self ) {
+    found = dlsym( self, "lua_gettop" ) != NULL;
+    dlclose( self );
+  }
+  return found;
+}
+
+/* Check whether the Lua API is already globally available. If not,
+ * try to iterate all loaded shared libraries using a platform-
  * specific way to find a loaded Lua shared library.
  * If that fails, try a list of common library names.
  * In all cases reopen the Lua library using RTLD_GLOBAL and
  * RTLD_NOLOAD.
  */
-#define MOON_DLFIX() \
-  do { \
-    if( !MOON_DLFIX_FIND() ) { \
-      unsigned i = 0; \
-      MOON_DLFIX_DBG(("Trying some common Lua library names ...\n")); \
-      for( ; i < sizeof( moon_dlfix_lib_names )/sizeof( *moon_dlfix_lib_names ); ++i ) { \
-        void* dl = dlopen( moon_dlfix_lib_names[ i ], RTLD_LAZY|RTLD_GLOBAL|RTLD_NOLOAD ); \
-        MOON_DLFIX_DBG(("Trying '%s'.\n", moon_dlfix_lib_names[ i ])); \
-        if( dl ) { \
-          MOON_DLFIX_DBG(("Fixed Lua SO.\n")); \
-          dlclose( dl ); \
-          break; \
-        } \
-      } \
-    } \
-  } while( 0 )
+MOON_DLFIX_UNUSED
+static void moon_dlfix_run( void ) {
+  unsigned i = 0;
+  if( moon_dlfix_isglobal() || MOON_DLFIX_FIND() )
+    return;
+  MOON_DLFIX_DBG(("Trying some common Lua library names ...\n"));
+  for( ; i < sizeof( moon_dlfix_lib_names )/
+             sizeof( *moon_dlfix_lib_names ); ++i ) {
+    void* dl = dlopen( moon_dlfix_lib_names[ i ],
+                       RTLD_LAZY|RTLD_GLOBAL|RTLD_NOLOAD );
+    MOON_DLFIX_DBG(("Trying '%s'.\n", moon_dlfix_lib_names[ i ]));
+    if( dl ) {
+      MOON_DLFIX_DBG(("Fixed Lua SO.\n"));
+      dlclose( dl );
+      return;
+    }
+  }
+}
+
+/* Run moon_dlfix_run() at most once per module, even if multiple
+ * threads use MOON_DLFIX() at the same time. With GCC-compatible
+ * compilers the state is a weak hidden symbol, so that all
+ * translation units of a module share it, and it is updated using
+ * atomic builtins (0 = not started, 1 = running, 2 = done). Other
+ * compilers use pthread_once().
+ */
+#if defined( __GNUC__ ) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#include <sched.h>
+
+__attribute__(( weak, visibility( "hidden" ) ))
+int moon_dlfix_state = 0;
+
+MOON_DLFIX_UNUSED
+static int moon_dlfix_once( void ) {
+  int s = 0;
+  if( __atomic_load_n( &moon_dlfix_state, __ATOMIC_ACQUIRE ) != 2 ) {
+    if( __atomic_compare_exchange_n( &moon_dlfix_state, &s, 1, 0,
+                                     __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE ) ) {
+      moon_dlfix_run();
+      __atomic_store_n( &moon_dlfix_state, 2, __ATOMIC_RELEASE );
+    } else {
+      while( __atomic_load_n( &moon_dlfix_state,
+                              __ATOMIC_ACQUIRE ) != 2 )
+        sched_yield();
+    }
+  }
+  return 1;
+}
+#else /* no atomic builtins */
+#include <pthread.h>
+
+static pthread_once_t moon_dlfix_state = PTHREAD_ONCE_INIT;
+
+MOON_DLFIX_UNUSED
+static int moon_dlfix_once( void ) {
+  return pthread_once( &moon_dlfix_state, moon_dlfix_run ) == 0;
+}
+#endif /* has atomic builtins */
+
+#define MOON_DLFIX() ((void)moon_dlfix_once())
 
 #endif /* has RTLD_NOLOAD */
 #endif /* has dlfcn.h */
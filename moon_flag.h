@@ -8,6 +8,7 @@
 /* this include file is a macro file which could be included
  * multiple times with different settings.
  */
+#include <string.h>
 #include "moon.h"
 
 /* "parameter checking" */
@@ -32,80 +33,225 @@
 #define MOON_FLAG_DEF MOON_CONCAT( moon_flag_def_, MOON_FLAG_SUFFIX )
 #define MOON_FLAG_NEW MOON_CONCAT( moon_flag_new_, MOON_FLAG_SUFFIX )
 #define MOON_FLAG_GET MOON_CONCAT( moon_flag_get_, MOON_FLAG_SUFFIX )
+#define MOON_FLAG_BITS MOON_CONCAT( moon_flag_bits_, MOON_FLAG_SUFFIX )
+#define MOON_FLAG_NEXT MOON_CONCAT( moon_flag_next_, MOON_FLAG_SUFFIX )
+#define MOON_FLAG_PARSE MOON_CONCAT( moon_flag_parse_, MOON_FLAG_SUFFIX )
+#define MOON_FLAG_NAMETAB MOON_CONCAT( moon_flag_names_, MOON_FLAG_SUFFIX )
 #ifndef MOON_FLAG_EQMETHOD
 #  define MOON_FLAG_EQMETHOD( a, b ) ((a) == (b))
 #endif
+/* unboxed flags need the integer subtype of Lua 5.3+ */
+#if defined( MOON_FLAG_UNBOXED ) && LUA_VERSION_NUM < 503
+#  undef MOON_FLAG_UNBOXED
+#endif
+#ifndef MOON_FLAG_CACHESIZE
+#  define MOON_FLAG_CACHESIZE 64
+#endif
 
 
 static void MOON_FLAG_NEW( lua_State* L, MOON_FLAG_TYPE v ) {
-#ifdef MOON_FLAG_USECACHE
+#if defined( MOON_FLAG_UNBOXED )
+  lua_pushinteger( L, (lua_Integer)v );
+#elif defined( MOON_FLAG_USECACHE )
   luaL_checkstack( L, 5, MOON_STRINGIFY( MOON_FLAG_NEW ) );
   luaL_getmetatable( L, MOON_FLAG_NAME );
   if( !lua_istable( L, -1 ) )
     luaL_error( L, "no metatable for type '%s' defined", MOON_FLAG_NAME );
+  if( (size_t)v < MOON_FLAG_CACHESIZE &&
+      (MOON_FLAG_TYPE)(size_t)v == v ) {
+    /* small values are kept alive in the array part of the metatable
+     * (index 1 is reserved for moon's type registry), so they are
+     * never allocated twice */
+    lua_rawgeti( L, -1, (int)v+2 );
+    if( lua_isnil( L, -1 ) ) {
+      lua_pop( L, 1 );
+      *(MOON_FLAG_TYPE*)moon_newobject( L, MOON_FLAG_NAME, 0 ) = v;
+      lua_pushvalue( L, -1 );
+      lua_rawseti( L, -3, (int)v+2 );
+    }
+    lua_replace( L, -2 );
+    return;
+  }
+#if LUA_VERSION_NUM < 503
+  /* the cache key must represent `v` exactly */
+  if( (MOON_FLAG_TYPE)(lua_Number)v != v ) {
+    lua_pop( L, 1 );
+    *(MOON_FLAG_TYPE*)moon_newobject( L, MOON_FLAG_NAME, 0 ) = v;
+    return;
+  }
+#endif
   moon_getcache( L, -1 );
+#if LUA_VERSION_NUM < 503
   lua_pushnumber( L, (lua_Number)v );
+#else
+  lua_pushinteger( L, (lua_Integer)v );
+#endif
   lua_rawget( L, -2 );
   if( lua_isnil( L, -1 ) ) {
     lua_pop( L, 1 );
-#endif
     *(MOON_FLAG_TYPE*)moon_newobject( L, MOON_FLAG_NAME, 0 ) = v;
-#ifdef MOON_FLAG_USECACHE
+#if LUA_VERSION_NUM < 503
     lua_pushnumber( L, (lua_Number)v );
+#else
+    lua_pushinteger( L, (lua_Integer)v );
+#endif
     lua_pushvalue( L, -2 );
     lua_rawset( L, -4 );
   }
   lua_replace( L, -3 );
   lua_pop( L, 1 );
+#else
+  *(MOON_FLAG_TYPE*)moon_newobject( L, MOON_FLAG_NAME, 0 ) = v;
 #endif
 }
 
 static MOON_FLAG_TYPE MOON_FLAG_GET( lua_State* L, int index ) {
+#ifdef MOON_FLAG_UNBOXED
+  if( lua_isinteger( L, index ) ) {
+    lua_Integer i = lua_tointeger( L, index );
+    MOON_FLAG_TYPE v = (MOON_FLAG_TYPE)i;
+    if( (lua_Integer)v != i )
+      luaL_argerror( L, index, "invalid value for flag type '"
+                     MOON_FLAG_NAME "'" );
+    return v;
+  }
+#endif
   return *(MOON_FLAG_TYPE*)moon_checkobject( L, index, MOON_FLAG_NAME );
 }
 
 #ifndef MOON_FLAG_NOBITOPS
 MOON_LLINKAGE_BEGIN
 static int MOON_FLAG_ADD( lua_State* L ) {
-  MOON_FLAG_TYPE* a = (MOON_FLAG_TYPE*)moon_checkobject( L, 1, MOON_FLAG_NAME );
-  MOON_FLAG_TYPE* b = (MOON_FLAG_TYPE*)moon_checkobject( L, 2, MOON_FLAG_NAME );
-  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(*a | *b) );
+  MOON_FLAG_TYPE a = MOON_FLAG_GET( L, 1 );
+  MOON_FLAG_TYPE b = MOON_FLAG_GET( L, 2 );
+  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(a | b) );
   return 1;
 }
 static int MOON_FLAG_SUB( lua_State* L ) {
-  MOON_FLAG_TYPE* a = (MOON_FLAG_TYPE*)moon_checkobject( L, 1, MOON_FLAG_NAME );
-  MOON_FLAG_TYPE* b = (MOON_FLAG_TYPE*)moon_checkobject( L, 2, MOON_FLAG_NAME );
-  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(*a & ~(*b)) );
+  MOON_FLAG_TYPE a = MOON_FLAG_GET( L, 1 );
+  MOON_FLAG_TYPE b = MOON_FLAG_GET( L, 2 );
+  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(a & ~b) );
   return 1;
 }
 static int MOON_FLAG_CALL( lua_State* L ) {
-  MOON_FLAG_TYPE* a = (MOON_FLAG_TYPE*)moon_checkobject( L, 1, MOON_FLAG_NAME );
-  MOON_FLAG_TYPE* b = (MOON_FLAG_TYPE*)moon_checkobject( L, 2, MOON_FLAG_NAME );
-  lua_pushboolean( L, !(~(*a) & (*b)) );
+  MOON_FLAG_TYPE a = MOON_FLAG_GET( L, 1 );
+  MOON_FLAG_TYPE b = MOON_FLAG_GET( L, 2 );
+  lua_pushboolean( L, !(~a & b) );
   return 1;
 }
 #if LUA_VERSION_NUM > 502
 static int MOON_FLAG_AND( lua_State* L ) {
-  MOON_FLAG_TYPE* a = (MOON_FLAG_TYPE*)moon_checkobject( L, 1, MOON_FLAG_NAME );
-  MOON_FLAG_TYPE* b = (MOON_FLAG_TYPE*)moon_checkobject( L, 2, MOON_FLAG_NAME );
-  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(*a & *b) );
+  MOON_FLAG_TYPE a = MOON_FLAG_GET( L, 1 );
+  MOON_FLAG_TYPE b = MOON_FLAG_GET( L, 2 );
+  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(a & b) );
   return 1;
 }
 static int MOON_FLAG_NOT( lua_State* L ) {
-  MOON_FLAG_TYPE* a = (MOON_FLAG_TYPE*)moon_checkobject( L, 1, MOON_FLAG_NAME );
-  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(~*a) );
+  MOON_FLAG_TYPE a = MOON_FLAG_GET( L, 1 );
+  MOON_FLAG_NEW( L, (MOON_FLAG_TYPE)(~a) );
   return 1;
 }
 #endif
 MOON_LLINKAGE_END
 #endif
 
+#ifdef MOON_FLAG_NAMES
+static struct {
+  char const* name;
+  MOON_FLAG_TYPE value;
+} const MOON_FLAG_NAMETAB[] = {
+  MOON_FLAG_NAMES,
+  { NULL, (MOON_FLAG_TYPE)0 }
+};
+#endif
+
+#ifndef MOON_FLAG_NOBITOPS
+MOON_LLINKAGE_BEGIN
+/* iterator function: the state is the flag value, the control
+ * variable is the last bit returned (or nil) */
+static int MOON_FLAG_NEXT( lua_State* L ) {
+  MOON_FLAG_TYPE v = MOON_FLAG_GET( L, 1 );
+#if LUA_VERSION_NUM >= 503
+  MOON_FLAG_TYPE prev = (MOON_FLAG_TYPE)lua_tointeger( L, 2 );
+#else
+  MOON_FLAG_TYPE prev = (MOON_FLAG_TYPE)lua_tonumber( L, 2 );
+#endif
+  MOON_FLAG_TYPE bit = (MOON_FLAG_TYPE)0;
+  if( prev != 0 ) /* clear `prev` and all lower bits */
+    v = (MOON_FLAG_TYPE)(v & ~(prev | (prev - 1)));
+  if( v == 0 )
+    return 0;
+  bit = (MOON_FLAG_TYPE)(v & (~v + 1));
+#if LUA_VERSION_NUM >= 503
+  lua_pushinteger( L, (lua_Integer)bit );
+#else
+  lua_pushnumber( L, (lua_Number)bit );
+#endif
+#ifdef MOON_FLAG_NAMES
+  {
+    size_t i = 0;
+    for( ; MOON_FLAG_NAMETAB[ i ].name != NULL; ++i ) {
+      if( MOON_FLAG_NAMETAB[ i ].value == bit ) {
+        lua_pushstring( L, MOON_FLAG_NAMETAB[ i ].name );
+        return 2;
+      }
+    }
+  }
+#endif
+  return 1;
+}
+static int MOON_FLAG_BITS( lua_State* L ) {
+  MOON_FLAG_GET( L, 1 );
+  lua_pushcfunction( L, MOON_FLAG_NEXT );
+  lua_pushvalue( L, 1 );
+  lua_pushnil( L );
+  return 3;
+}
+MOON_LLINKAGE_END
+#endif
+
+#ifdef MOON_FLAG_NAMES
+MOON_LLINKAGE_BEGIN
+static int MOON_FLAG_PARSE( lua_State* L ) {
+  size_t len = 0;
+  char const* s = luaL_checklstring( L, 1, &len );
+  char const* e = s + len;
+  MOON_FLAG_TYPE v = (MOON_FLAG_TYPE)0;
+  while( s < e ) {
+    char const* t = NULL;
+    size_t i = 0;
+    while( s < e && (*s == '|' || *s == ' ' || *s == '\t' ||
+                     *s == '\n' || *s == '\r') )
+      ++s;
+    if( s >= e )
+      break;
+    for( t = s; s < e && *s != '|' && *s != ' ' && *s != '\t' &&
+                *s != '\n' && *s != '\r'; ++s )
+      ;
+    for( ; MOON_FLAG_NAMETAB[ i ].name != NULL; ++i )
+      if( 0 == strncmp( MOON_FLAG_NAMETAB[ i ].name, t, (size_t)(s-t) ) &&
+          MOON_FLAG_NAMETAB[ i ].name[ s-t ] == '\0' )
+        break;
+    if( MOON_FLAG_NAMETAB[ i ].name == NULL ) {
+      lua_pushlstring( L, t, (size_t)(s-t) );
+      return luaL_argerror( L, 1, lua_pushfstring( L,
+        "unknown name '%s' for flag type '%s'", lua_tostring( L, -1 ),
+        MOON_FLAG_NAME ) );
+    }
+    v = (MOON_FLAG_TYPE)(v | MOON_FLAG_NAMETAB[ i ].value);
+  }
+  MOON_FLAG_NEW( L, v );
+  return 1;
+}
+MOON_LLINKAGE_END
+#endif
+
 #ifndef MOON_FLAG_NORELOPS
 MOON_LLINKAGE_BEGIN
 static int MOON_FLAG_EQ( lua_State* L ) {
-  MOON_FLAG_TYPE* a = (MOON_FLAG_TYPE*)moon_checkobject( L, 1, MOON_FLAG_NAME );
-  MOON_FLAG_TYPE* b = (MOON_FLAG_TYPE*)moon_checkobject( L, 2, MOON_FLAG_NAME );
-  lua_pushboolean( L, MOON_FLAG_EQMETHOD( *a, *b ) );
+  MOON_FLAG_TYPE a = MOON_FLAG_GET( L, 1 );
+  MOON_FLAG_TYPE b = MOON_FLAG_GET( L, 2 );
+  lua_pushboolean( L, MOON_FLAG_EQMETHOD( a, b ) );
   return 1;
 }
 MOON_LLINKAGE_END
@@ -117,6 +263,7 @@ static void MOON_FLAG_DEF( lua_State* L ) {
     { "__add", MOON_FLAG_ADD },
     { "__sub", MOON_FLAG_SUB },
     { "__call", MOON_FLAG_CALL },
+    { "bits", MOON_FLAG_BITS },
 #if LUA_VERSION_NUM > 502
     { "__band", MOON_FLAG_AND },
     { "__bor", MOON_FLAG_ADD },
@@ -142,6 +289,10 @@ static void MOON_FLAG_DEF( lua_State* L ) {
 #undef MOON_FLAG_NEW
 #undef MOON_FLAG_DEF
 #undef MOON_FLAG_GET
+#undef MOON_FLAG_BITS
+#undef MOON_FLAG_NEXT
+#undef MOON_FLAG_PARSE
+#undef MOON_FLAG_NAMETAB
 
 #undef MOON_FLAG_NAME
 #undef MOON_FLAG_TYPE
@@ -149,5 +300,8 @@ static void MOON_FLAG_DEF( lua_State* L ) {
 #undef MOON_FLAG_NOBITOPS
 #undef MOON_FLAG_NORELOPS
 #undef MOON_FLAG_USECACHE
+#undef MOON_FLAG_CACHESIZE
+#undef MOON_FLAG_UNBOXED
 #undef MOON_FLAG_EQMETHOD
+#undef MOON_FLAG_NAMES
 